@@ -0,0 +1,63 @@
+#ifndef __BATCHRUNNER_INCLUDED__
+#define __BATCHRUNNER_INCLUDED__
+
+#include "settings.h"
+
+#ifdef BATCH_RUNNER
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "ff.h"
+#include "File.h"
+
+#if defined(DEBUGGER) || defined(PROFILER) || defined(TRACE_INSTRUCTIONS)
+#error BATCH_RUNNER cannot be used with DEBUGGER, PROFILER or TRACE_INSTRUCTIONS, the cores report to them for the machine on screen
+#endif
+
+// Frames each snapshot runs for
+#define BATCH_FRAMES 500
+
+// Worker tasks, each runs its own headless machine
+#define BATCH_TASKS portNUM_PROCESSORS
+
+// Runs every .z80 and .sna of a folder on headless machines, one per worker task, and writes
+// "<name>,<frames>,<PC>,<SP>,<AF>,<hash>" lines, where hash is FNV-1a of all RAM banks.
+// Snapshots are read and lines are written under the SD card mutex, frames run in parallel.
+// Average load time of each format, open and read from the SD card, is logged at the end.
+class BatchRunner
+{
+private:
+    SemaphoreHandle_t _sdCardMutex;
+    uint8_t* _buffer;
+    const char* _folderName;
+    FF_DIR _folder;
+    zx::File _results;
+    TaskHandle_t _caller;
+    // Counted under the SD card mutex
+    int _passed;
+    int _failed;
+    int _loads[2];
+    int64_t _loadTime[2];
+
+    static void workerMain(void* parameter);
+    void work();
+
+    // Next snapshot name, caller holds the SD card mutex
+    bool next(char* fileName);
+    // Takes the SD card mutex, frames is 0 for a snapshot that was not loaded
+    void writeResult(const char* fileName, uint32_t frames, uint16_t pc, uint16_t sp, uint16_t af, uint32_t hash);
+
+public:
+    // Caller holds the SD card mutex with the card mounted, it is released while the machines run.
+    // Folder is a path on the SD card, buffer is used to load snapshots. Returns when all are done.
+    bool Run(SemaphoreHandle_t sdCardMutex, const char* folder, const char* resultFileName,
+        uint8_t buffer[0x4000]);
+};
+
+extern BatchRunner Batch;
+
+#endif
+
+#endif
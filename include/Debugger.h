@@ -0,0 +1,110 @@
+#ifndef __DEBUGGER_INCLUDED__
+#define __DEBUGGER_INCLUDED__
+
+#include "settings.h"
+
+#ifdef DEBUGGER
+
+#include <stdint.h>
+
+// Watchpoints kept at once
+#define DEBUGGER_WATCHPOINTS 8
+
+// Accesses a watchpoint stops on, can be combined
+enum WatchType : uint8_t
+{
+    WatchRead = 0x01,
+    WatchWrite = 0x02,
+    WatchInput = 0x04,
+    WatchOutput = 0x08
+};
+
+enum class StopReason : uint8_t
+{
+    None,
+    Break,
+    Step,
+    Breakpoint,
+    Read,
+    Write,
+    Input,
+    Output
+};
+
+// PC breakpoints and memory and port watchpoints.
+// The cores check breakpoints before each instruction only while something is armed, and stop
+// emulation early when OnInstruction() returns true. Memory accesses take a slow path only in the
+// 16K slots that have a watchpoint. A watchpoint stops before the instruction after the access.
+class Debugger
+{
+private:
+    struct Watchpoint
+    {
+        uint16_t Start;
+        uint16_t End;
+        uint8_t Types;
+    };
+
+    // Bit per address, allocated with the first breakpoint
+    uint8_t* _breakpoints = nullptr;
+    uint16_t _breakpointCount = 0;
+
+    Watchpoint _watchpoints[DEBUGGER_WATCHPOINTS];
+    uint8_t _watchpointCount = 0;
+
+    bool _isArmed = false;
+    bool _isBreakPending = false;
+    bool _isStepping = false;
+    bool _isResuming = false;
+    StopReason _stopReason = StopReason::None;
+    uint16_t _stopAddress = 0;
+
+    void update();
+    void onAccess(WatchType type, uint16_t address);
+
+public:
+    // Bit per 16K slot with a watchpoint of that type
+    uint8_t ReadSlots = 0;
+    uint8_t WriteSlots = 0;
+    bool IsWatchingPorts = false;
+
+    bool SetBreakpoint(uint16_t address);
+    void ClearBreakpoint(uint16_t address);
+    bool IsBreakpoint(uint16_t address)
+    {
+        return this->_breakpoints != nullptr && (this->_breakpoints[address >> 3] & (1 << (address & 0x07))) != 0;
+    }
+
+    // Addresses or ports from start to end inclusive
+    bool SetWatchpoint(uint16_t start, uint16_t end, uint8_t types);
+    void ClearWatchpoint(uint16_t start, uint16_t end, uint8_t types);
+    void ClearWatchpoints();
+    void ClearAll();
+
+    // Stops before the next instruction
+    void Break();
+    // Continues from a stop, with step it stops again after one instruction
+    void Resume(bool step = false);
+
+    bool IsArmed() { return this->_isArmed; }
+    bool IsStopped() { return this->_stopReason != StopReason::None; }
+    StopReason GetStopReason() { return this->_stopReason; }
+    // Breakpoint, watched address or port
+    uint16_t GetStopAddress() { return this->_stopAddress; }
+    const char* GetStopReasonName();
+
+    // Called by the cores before each instruction while armed, true stops emulation
+    bool OnInstruction(uint16_t pc);
+
+    // Slow path of watched slots and ports
+    void OnRead(uint16_t address) { this->onAccess(WatchRead, address); }
+    void OnWrite(uint16_t address) { this->onAccess(WatchWrite, address); }
+    void OnInput(uint16_t port) { this->onAccess(WatchInput, port); }
+    void OnOutput(uint16_t port) { this->onAccess(WatchOutput, port); }
+};
+
+extern Debugger Debug;
+
+#endif
+
+#endif
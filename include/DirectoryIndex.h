@@ -0,0 +1,69 @@
+#ifndef __DIRECTORYINDEX_INCLUDED__
+#define __DIRECTORYINDEX_INCLUDED__
+
+#include <stdint.h>
+#include "ff.h"
+#include "z80snapshot.h"
+
+#define DIRECTORY_NAME_SIZE 91
+#define DIRECTORY_PATH_SIZE 192
+
+#define ENTRY_FOLDER 0x01
+#define ENTRY_PARENT 0x02
+
+struct DirectoryEntry
+{
+    uint32_t NameOffset;
+    uint32_t SortKey;
+    uint32_t Size;
+    uint16_t Date;
+    uint16_t Time;
+    uint8_t Flags;
+    zx::SnapshotModel Model;
+};
+
+// One page of the sorted list of subfolders and snapshot files in a folder.
+// A page is selected by a single pass over the folder, so folders of any size need
+// only a page of entries in RAM, and names of the candidates in the work buffer.
+class DirectoryIndex
+{
+private:
+    DirectoryEntry* _entries = nullptr;
+    DirectoryEntry* _candidates = nullptr;
+    uint8_t* _order = nullptr;
+    char* _names = nullptr;
+    uint8_t* _workBuffer;
+    uint16_t _pageSize = 0;
+    uint16_t _count = 0;
+    uint32_t _namesCapacity = 0;
+    uint32_t _pageStart = 0;
+    uint32_t _totalCount = 0;
+    bool _isValid = false;
+    char _path[DIRECTORY_PATH_SIZE];
+
+    bool loadPage(const DirectoryEntry* cursor, const char* cursorName, bool isForward);
+    void addCandidate(DirectoryEntry* entry, const char* name, uint16_t* heapCount, int8_t sign);
+    char* workName(uint8_t slot) { return (char*)&this->_workBuffer[slot * DIRECTORY_NAME_SIZE]; }
+
+public:
+    // Work buffer holds pageSize names of DIRECTORY_NAME_SIZE while a page is loaded, so 16K fits
+    // 180 entries. A larger page is cut to what fits, slots are 8 bit so the page is at most 256.
+    void Initialize(uint16_t pageSize, uint8_t* workBuffer, uint32_t workBufferSize);
+
+    bool Load(const char* path);
+    bool LoadNextPage();
+    bool LoadPreviousPage();
+    void Invalidate();
+
+    bool IsValid(const char* path);
+    const char* GetPath() { return this->_path; }
+    uint16_t Count() { return this->_count; }
+    uint32_t PageStart() { return this->_pageStart; }
+    uint32_t TotalCount() { return this->_totalCount; }
+    bool HasNextPage() { return this->_pageStart + this->_count < this->_totalCount; }
+    bool HasPreviousPage() { return this->_pageStart > 0; }
+    const char* GetName(uint16_t index) { return &this->_names[this->_entries[index].NameOffset]; }
+    DirectoryEntry* GetEntry(uint16_t index) { return &this->_entries[index]; }
+};
+
+#endif
@@ -10,5 +10,33 @@ bool saveSnapshotSetup(const char* path);
 bool saveSnapshotLoop();
 
 bool ReadFromFile(const char* fileName, uint8_t* buffer, size_t size);
+// Copies the screen, the capture task writes it to the next free screenNNN.ppm.
+// False while the previous capture is still being written.
+bool SaveScreenCapture();
+
+#ifdef CAPTURE_FRAMES
+// Captures every CAPTURE_FRAMES frames since the last snapshot load and compares
+// the hashes with golden.txt on the SD card, loads the snapshots of the golden set
+void ScreenCaptureOnFrame();
+#endif
+
+// Records input with a snapshot to the next free inputNNN.rzx, stop also stops playback
+bool StartInputRecording();
+void StopInputRecording();
+
+#ifdef PROFILER
+// Saves the profile to the next free profNNN.csv and stops profiling
+bool SaveProfile();
+#endif
+
+#ifdef TRACE_INSTRUCTIONS
+// Saves the last instructions to the next free traceNNN.txt
+bool SaveTrace();
+#endif
+
+#ifdef BATCH_RUNNER
+// Runs the snapshots of the BATCH_RUNNER folder on headless machines and writes batch.csv
+bool RunBatch();
+#endif
 
 #endif /* __SDCARD_H__ */
@@ -0,0 +1,24 @@
+#ifndef __FRAMECAPTURE_INCLUDED__
+#define __FRAMECAPTURE_INCLUDED__
+
+#include <stdint.h>
+#include "File.h"
+#include "VideoController.h"
+
+#define CAPTURE_WIDTH  (SCREEN_WIDTH * 8 / 2)
+#define CAPTURE_HEIGHT (SCREEN_HEIGHT * 8 / 2)
+
+// One VGA line and one RGB line
+#define CAPTURE_BUFFER_SIZE (SCREEN_WIDTH * 8 + CAPTURE_WIDTH * 3)
+
+namespace zx
+{
+
+// Spectrum screen with border as binary PPM, hash is FNV-1a of the RGB data.
+// Screen data can be a copy, so that it is written while emulation goes on.
+bool CaptureFrame(VideoController* screen, SpectrumScreenData* screenData, uint8_t borderColor,
+    File* file, uint8_t buffer[CAPTURE_BUFFER_SIZE], uint32_t* hash);
+
+}
+
+#endif
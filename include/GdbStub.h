@@ -0,0 +1,71 @@
+#ifndef __GDBSTUB_INCLUDED__
+#define __GDBSTUB_INCLUDED__
+
+#include "settings.h"
+
+#ifdef GDB_STUB
+
+#ifndef DEBUGGER
+#error GDB_STUB needs DEBUGGER
+#endif
+
+#include <stdint.h>
+
+#define GDB_PACKET_SIZE 1024
+#define GDB_UART_BAUD_RATE 115200
+
+// GDB remote serial protocol for "target remote" of a z80 GDB, over a UART on the device and
+// over a Unix socket on the host. Registers are af bc de hl sp pc ix iy af' bc' de' hl' ir,
+// breakpoints and watchpoints are those of Debug. Polled from the emulator loop, which does
+// not run while GDB has it stopped.
+class GdbStub
+{
+private:
+#ifndef ESP_PLATFORM
+    int _listener = -1;
+    int _client = -1;
+#endif
+    // A UART client is connected from its first byte until it detaches
+    bool _isConnected = false;
+
+    // Packet being received, after '$'
+    char _packet[GDB_PACKET_SIZE];
+    int _length = 0;
+    bool _isInPacket = false;
+    // Checksum digits still to come after '#'
+    uint8_t _checksumLeft = 0;
+
+    // GDB waits for a stop reply
+    bool _isRunning = false;
+
+    // Transport, false or -1 when it fails or the client is gone
+    bool open();
+    bool accept();
+    int receive(char* buffer, int size);
+    void send(const char* data, int length);
+    void close();
+
+    void disconnect();
+    void onByte(char c);
+    void onPacket();
+    void reply(const char* data);
+    void replyStop();
+
+    void readRegisters(char* buffer);
+    void writeRegister(int number, uint16_t value);
+    bool breakpoint(bool isSet);
+
+public:
+    bool Initialize();
+
+    // Handles what GDB sent, true while GDB has emulation stopped
+    bool Poll();
+
+    bool IsConnected() { return this->_isConnected; }
+};
+
+extern GdbStub Gdb;
+
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef __INPUTRECORDER_INCLUDED__
+#define __INPUTRECORDER_INCLUDED__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "File.h"
+
+// Port reads kept for one frame, a frame with more stops recording or playback
+#define RZX_MAX_FRAME_INPUTS 2048
+
+// Records results of port reads per frame into .rzx, and plays them back instead of real input.
+// Recording and playback start at the end of a frame, with the snapshot taken or loaded there,
+// so that the frames of the recording match the frames of the emulator.
+class InputRecorder
+{
+private:
+    enum State : uint8_t
+    {
+        Idle,
+        RecordPending,
+        Recording,
+        PlayPending,
+        Playing
+    };
+
+    zx::File _file;
+    SemaphoreHandle_t _sdCardMutex;
+    uint8_t* _buffer1;
+    uint8_t* _buffer2;
+    State _state = Idle;
+
+    // Input block, its frame count is written when recording stops
+    uint32_t _blockPosition;
+    uint32_t _frameCount;
+
+    // Port reads of the current frame, and of the previous one for "same as previous"
+    uint8_t _inputs[2][RZX_MAX_FRAME_INPUTS];
+    uint8_t _current = 0;
+    uint16_t _inputCount[2];
+    uint16_t _inputIndex = 0;
+    bool _isOverflow = false;
+    bool _isDesync = false;
+
+    // Opcode fetches recorded for the frame being played, 0 if unknown
+    uint16_t _fetchCount = 0;
+
+    bool startRecording();
+    bool writeFrame(uint32_t fetchCount);
+    bool startPlayback();
+    bool readFrame(uint32_t fetchCount);
+
+public:
+    // SD card mutex is taken at the end of each frame, buffers are used when recording or playback starts
+    void Initialize(SemaphoreHandle_t sdCardMutex, uint8_t buffer1[0x4000], uint8_t buffer2[0x4000]);
+
+    // Caller holds the SD card mutex
+    bool Record(const char* fileName);
+    bool Play(const char* fileName);
+    void Stop();
+
+    bool IsRecording() { return this->_state == Recording; }
+    bool IsPlaying() { return this->_state == Playing; }
+    bool IsActive() { return this->_state != Idle; }
+
+    // Called at the end of each frame, before the interrupt, with the opcode fetches of the frame
+    void OnFrame(uint32_t fetchCount);
+
+    // Called for each port read
+    void PutInput(uint8_t value)
+    {
+        if (this->_inputCount[this->_current] < RZX_MAX_FRAME_INPUTS)
+        {
+            this->_inputs[this->_current][this->_inputCount[this->_current]++] = value;
+        }
+        else
+        {
+            this->_isOverflow = true;
+        }
+    }
+
+    uint8_t GetInput()
+    {
+        if (this->_inputIndex < this->_inputCount[this->_current])
+        {
+            return this->_inputs[this->_current][this->_inputIndex++];
+        }
+
+        this->_isDesync = true;
+        return 0xFF;
+    }
+};
+
+extern InputRecorder Recorder;
+
+#endif
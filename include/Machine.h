@@ -0,0 +1,36 @@
+#ifndef __MACHINE_INCLUDED__
+#define __MACHINE_INCLUDED__
+
+#include <stdint.h>
+#include "z80Environment.h"
+#include "z80Emulator.h"
+
+class VideoController;
+
+// One Spectrum: memory, ports, sound and keyboard rows in Environment, and the CPU.
+// Spectrum is the machine on screen, headless machines keep no global state and can run
+// on several tasks at once.
+class Machine
+{
+public:
+    Z80Environment Environment;
+    z80Emulator Cpu;
+
+    // Machine on screen, its environment is initialized by the emulator task
+    Machine(VideoController* screen) : Environment(screen) { }
+    // Headless machine, InitializeHeadless() allocates its RAM
+    Machine() : Environment(nullptr) { }
+
+    // False if its RAM does not fit into the heap
+    bool InitializeHeadless();
+
+    // Power on, ROM and RAM are kept
+    void Reset();
+
+    // Runs to the end of the frame and interrupts, for headless machines
+    void RunFrame();
+};
+
+extern Machine Spectrum;
+
+#endif
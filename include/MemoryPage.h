@@ -25,6 +25,7 @@ public:
     }
 
     void virtual FromBuffer(void* buffer) = 0;
+    void virtual FromBuffer(void* buffer, uint16_t offset, uint16_t size) = 0;
     void virtual ToBuffer(void* buffer) = 0;
 };
 
@@ -0,0 +1,132 @@
+#ifndef __PERFCOUNTERS_INCLUDED__
+#define __PERFCOUNTERS_INCLUDED__
+
+#include <stdint.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "freertos/FreeRTOS.h"
+#define PERF_CYCLES_PER_SECOND (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000ULL)
+#define PERF_CORES portNUM_PROCESSORS
+#else
+#include <time.h>
+#define PERF_CYCLES_PER_SECOND 1000000000ULL
+#define PERF_CORES 1
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+#endif
+
+// Where host time goes. Audio is the part of Emulate spent in the sound chip and beeper.
+enum class PerfCounter : uint8_t
+{
+    Emulate,
+    Scanline,
+    Input,
+    Audio,
+    Rewind,
+    Idle,
+    Count
+};
+
+// Averages since the previous log
+struct PerfValues
+{
+    // Share of host time in tenths of percent
+    uint16_t Permille[(int)PerfCounter::Count];
+    uint32_t TStatesPerFrame;
+    uint16_t FramesPerSecond;
+};
+
+// Counts CPU cycles (CCOUNT on the device, nanoseconds on the host) spent in parts of a frame.
+// Values are logged every PERF_LOG_SECONDS, a cycle count must not wrap within a frame. Sums
+// over a log are 64 bit, the 32-bit cycle counter wraps in 17 s on the device and 4 s on the host.
+// Scanline time is counted by the VGA interrupt per core, only the interrupt writes it. Time of
+// the other counters excludes interrupts on the core of their task, which must be pinned to it.
+class PerfCounters
+{
+private:
+    uint64_t _cycles[(int)PerfCounter::Count] = {};
+    // Kept by the interrupt in 32 bits, read as a difference of at most one wrap per log
+    volatile uint32_t _interruptCycles[PERF_CORES] = {};
+    uint32_t _lastInterruptCycles[PERF_CORES] = {};
+    uint64_t _elapsed = 0;
+    uint32_t _lastFrame = 0;
+    uint32_t _tstates = 0;
+    uint16_t _frames = 0;
+    bool _isHudVisible = false;
+    bool _isUpdated = false;
+
+    void update();
+
+public:
+    PerfValues Values = {};
+
+    static inline uint32_t IRAM_ATTR Cycles()
+    {
+#ifdef ESP_PLATFORM
+        return esp_cpu_get_ccount();
+#else
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return (uint32_t)(time.tv_sec * 1000000000ULL + time.tv_nsec);
+#endif
+    }
+
+    static inline int IRAM_ATTR Core()
+    {
+#ifdef ESP_PLATFORM
+        return xPortGetCoreID();
+#else
+        return 0;
+#endif
+    }
+
+    // Cycles of the calling task, without the interrupts that ran on its core
+    uint32_t Now()
+    {
+        int core = Core();
+        uint32_t interruptCycles;
+        uint32_t now;
+        do
+        {
+            interruptCycles = this->_interruptCycles[core];
+            now = Cycles();
+        } while (interruptCycles != this->_interruptCycles[core]);
+        return now - interruptCycles;
+    }
+
+    // Adds the cycles since start, which is a value of Now()
+    void Add(PerfCounter counter, uint32_t start)
+    {
+        this->_cycles[(int)counter] += Now() - start;
+    }
+
+    // Adds the cycles of the scanline interrupt since start, which is a value of Cycles()
+    inline void IRAM_ATTR AddInterrupt(uint32_t start)
+    {
+        int core = Core();
+        this->_interruptCycles[core] = this->_interruptCycles[core] + (Cycles() - start);
+    }
+
+    void AddTStates(uint32_t tstates) { this->_tstates += tstates; }
+
+    // Called at the end of each frame, logs and updates Values every PERF_LOG_SECONDS
+    void OnFrame();
+
+    void ToggleHud() { this->_isHudVisible = !this->_isHudVisible; }
+    bool IsHudVisible() { return this->_isHudVisible; }
+
+    // True once after Values were updated
+    bool IsUpdated()
+    {
+        bool result = this->_isUpdated;
+        this->_isUpdated = false;
+        return result;
+    }
+};
+
+extern PerfCounters Perf;
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __PREVIEWCACHE_INCLUDED__
+#define __PREVIEWCACHE_INCLUDED__
+
+#include <stdint.h>
+#include "File.h"
+#include "DirectoryIndex.h"
+
+#define PREVIEW_SIZE 0x1B00
+#define PREVIEW_CACHE_SLOTS 256
+#define PREVIEW_LRU_SIZE 4
+
+// Identifies the file a preview was made from
+struct PreviewKey
+{
+    uint32_t Magic;
+    uint32_t PathHash;
+    uint32_t Size;
+    uint16_t Date;
+    uint16_t Time;
+};
+
+struct PreviewRecord
+{
+    PreviewKey Key;
+    uint8_t BorderColor;
+    uint8_t Reserved[3];
+    uint8_t Screen[PREVIEW_SIZE];
+};
+
+// Previews are stored in a file on the SD card, one record per slot chosen by the path hash,
+// and the last few used ones are kept in RAM
+class PreviewCache
+{
+private:
+    const char* _fileName;
+    PreviewRecord* _records[PREVIEW_LRU_SIZE];
+    uint32_t _lastUsed[PREVIEW_LRU_SIZE];
+    uint32_t _useCounter = 0;
+
+    bool readSlot(PreviewKey* key, PreviewRecord* record, bool keyOnly);
+
+public:
+    void Initialize(const char* fileName);
+
+    static void MakeKey(const char* path, DirectoryEntry* entry, PreviewKey* key);
+
+    // Records in RAM
+    PreviewRecord* Find(PreviewKey* key);
+    PreviewRecord* Put(PreviewRecord* record);
+
+    // Records in the cache file
+    bool Read(PreviewKey* key, PreviewRecord* record);
+    bool Contains(PreviewKey* key);
+    bool Store(PreviewRecord* record);
+};
+
+#endif
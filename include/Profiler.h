@@ -0,0 +1,82 @@
+#ifndef __PROFILER_INCLUDED__
+#define __PROFILER_INCLUDED__
+
+#include "settings.h"
+
+#ifdef PROFILER
+
+#include <stdint.h>
+#include "z80Environment.h"
+#include "File.h"
+
+// T-states are counted per 2^PROFILER_PC_SHIFT bytes of address space
+#define PROFILER_PC_SHIFT 4
+#define PROFILER_PC_BUCKETS (0x10000 >> PROFILER_PC_SHIFT)
+
+enum class OpcodeTable : uint8_t
+{
+    Main,
+    CB,
+    ED,
+    DD,
+    FD,
+    DDCB,
+    FDCB,
+    Count
+};
+
+// Counts executed opcodes per prefix and T-states per address, for the cores that report instructions.
+// Tables are allocated when profiling starts and freed when it stops.
+class Profiler
+{
+private:
+    uint32_t (*_opcodes)[256] = nullptr;
+    uint32_t* _tstates = nullptr;
+
+public:
+    bool Start();
+    void Stop();
+    bool IsRunning() { return this->_tstates != nullptr; }
+
+    // Called after each instruction with its address, the prefixes are read from memory
+    void OnInstruction(Z80Environment* environment, uint16_t pc, uint32_t tstates)
+    {
+        this->_tstates[pc >> PROFILER_PC_SHIFT] += tstates;
+
+        uint8_t opcode = environment->PeekByte(pc);
+        OpcodeTable table = OpcodeTable::Main;
+        switch (opcode)
+        {
+        case 0xCB:
+            table = OpcodeTable::CB;
+            opcode = environment->PeekByte(pc + 1);
+            break;
+        case 0xED:
+            table = OpcodeTable::ED;
+            opcode = environment->PeekByte(pc + 1);
+            break;
+        case 0xDD:
+        case 0xFD:
+            table = opcode == 0xDD ? OpcodeTable::DD : OpcodeTable::FD;
+            opcode = environment->PeekByte(pc + 1);
+            if (opcode == 0xCB)
+            {
+                // DD CB d op
+                table = table == OpcodeTable::DD ? OpcodeTable::DDCB : OpcodeTable::FDCB;
+                opcode = environment->PeekByte(pc + 3);
+            }
+            break;
+        }
+
+        this->_opcodes[(int)table][opcode]++;
+    }
+
+    // Writes non-zero counts as "opcode,<prefix><opcode>,<count>" and "pc,<address>,<T-states>" lines
+    bool Save(zx::File* file);
+};
+
+extern Profiler Profile;
+
+#endif
+
+#endif
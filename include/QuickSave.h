@@ -0,0 +1,49 @@
+#ifndef __QUICKSAVE_INCLUDED__
+#define __QUICKSAVE_INCLUDED__
+
+#include <stdint.h>
+#include "z80snapshot.h"
+
+#define QUICK_SAVE_SLOTS 4
+
+// Compressed memory page, shared by slots while it stays the same
+struct QuickSavePage
+{
+    uint16_t RefCount;
+    // 0x4000 if not compressed
+    uint16_t Size;
+    uint8_t Data[];
+};
+
+struct QuickSaveSlot
+{
+    bool IsUsed;
+    uint8_t State[Z80_HEADER_SIZE];
+    QuickSavePage* Pages[8];
+};
+
+// Keeps states in heap, pages are compressed as in .z80 and registers are kept in the .z80 header format.
+// Pages that did not change since the previous save are not stored again.
+class QuickSave
+{
+private:
+    QuickSaveSlot _slots[QUICK_SAVE_SLOTS];
+    int8_t _lastSaved = -1;
+    uint8_t* _pageBuffer;
+    uint8_t* _outputBuffer;
+
+    QuickSavePage* savePage(uint8_t pageNumber, QuickSavePage* previous);
+    void releasePage(QuickSavePage* page);
+
+public:
+    // Buffers are used only during Save() and Load()
+    void Initialize(uint8_t pageBuffer[0x4000], uint8_t outputBuffer[0x4000]);
+
+    bool Save(uint8_t slot);
+    bool Load(uint8_t slot);
+    bool IsUsed(uint8_t slot) { return this->_slots[slot].IsUsed; }
+};
+
+extern QuickSave QuickSaves;
+
+#endif
@@ -14,6 +14,7 @@ public:
     uint8_t virtual ReadByte(uint16_t addr) override;
     void virtual WriteByte(uint16_t addr, uint8_t data) override;
     void virtual FromBuffer(void* buffer) override;
+    void virtual FromBuffer(void* buffer, uint16_t offset, uint16_t size) override;
     void virtual ToBuffer(void* buffer) override;    
 };
 
@@ -0,0 +1,95 @@
+#ifndef __REWINDBUFFER_INCLUDED__
+#define __REWINDBUFFER_INCLUDED__
+
+#include <stdint.h>
+#include "z80snapshot.h"
+
+// A state is captured every second, the ring keeps up to 32 seconds
+#define REWIND_INTERVAL_FRAMES 50
+#define REWIND_CAPTURES 32
+
+// Every 8th capture is a keyframe with all pages, the others keep only pages
+// changed since the keyframe, as XOR with it
+#define REWIND_KEYFRAME_INTERVAL 8
+
+// Share of the free heap at startup used by captured pages, oldest captures are dropped to stay
+// within it. A capture in progress can go over it until it is complete. A keyframe that does not
+// fit alone is skipped and the captures already in the ring are kept, which happens for 128K
+// keyframes that do not compress well on a device with little free heap.
+#define REWIND_HEAP_DIVISOR 4
+
+// Pages are captured over several frames, a frame spends about this long on them.
+// Pages written after they were captured are captured again, after
+// REWIND_CAPTURE_MAX_FRAMES frames the rest is captured at once.
+#define REWIND_SLICE_MICROS 2000
+#define REWIND_CAPTURE_MAX_FRAMES 16
+
+// Compressed page, 0x4000 if not compressed
+struct RewindPage
+{
+    uint16_t Size;
+    uint8_t Data[];
+};
+
+struct RewindCapture
+{
+    bool IsKeyframe;
+    uint8_t PageMask;
+    uint8_t State[Z80_HEADER_SIZE];
+    RewindPage* Pages[8];
+};
+
+// Ring of states to go back in time. Changed pages are known from Environment.GetDirtyPages(),
+// so a capture between keyframes costs a few pages at most. The state of a capture is taken
+// in the frame where its last page is captured.
+class RewindBuffer
+{
+private:
+    RewindCapture _captures[REWIND_CAPTURES];
+    uint8_t _first = 0;
+    uint8_t _count = 0;
+    // Keyframe of the newest captures, -1 if the next capture has to be a keyframe
+    int8_t _keyframe = -1;
+    uint8_t _dirtySinceKeyframe = 0;
+    uint16_t _frames = 0;
+    uint32_t _usedBytes = 0;
+    uint32_t _budget = 0;
+    uint8_t* _pageBuffer;
+    uint8_t* _deltaBuffer;
+
+    // Capture in progress, in the slot after the newest capture
+    bool _isCapturing = false;
+    uint8_t _pendingPages = 0;
+    uint8_t _captureFrames = 0;
+    uint32_t _captureBytes = 0;
+    uint32_t _longestSlice = 0;
+
+    uint8_t indexOf(uint8_t position) { return (this->_first + position) % REWIND_CAPTURES; }
+    void startCapture();
+    bool continueCapture();
+    void cancelCapture();
+    bool capturePage(RewindCapture* capture, uint8_t pageNumber);
+    bool storePage(RewindCapture* capture, uint8_t pageNumber, uint8_t* data);
+    void readPage(RewindPage* page, uint8_t* buffer);
+    void freePage(RewindCapture* capture, uint8_t pageNumber);
+    void freeCapture(RewindCapture* capture);
+    bool canDropOldest(RewindCapture* capture);
+    bool dropOldest();
+
+public:
+    // Buffers are used only during captures and restores
+    void Initialize(uint8_t pageBuffer[0x4000], uint8_t deltaBuffer[0x4000]);
+
+    // Called once per frame, starts a capture when it is time and captures some of its pages
+    void OnFrame();
+
+    // Memory was loaded without WriteByte(), next capture has to be a keyframe
+    void NewKeyframe();
+
+    // Restores the newest capture and removes it, so each call goes further back
+    bool StepBack();
+};
+
+extern RewindBuffer Rewind;
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __TAPELOADER_INCLUDED__
+#define __TAPELOADER_INCLUDED__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "File.h"
+
+// LD-BYTES of the 48K ROM, trapped after its DI, where the expected flag is in A'
+// and carry of F' tells load from verify
+#define LD_BYTES 0x0556
+#define LD_BYTES_TRAP 0x055A
+#define SA_LD_RET 0x053F
+
+#define TAPE_CHUNK_SIZE 256
+
+// Feeds blocks of a .tap file to the ROM loading routine, without emulating the tape signal.
+// Cores call LoadBytes() when PC reaches LD_BYTES_TRAP at the end of an instruction.
+class TapeLoader
+{
+private:
+    zx::File _file;
+    SemaphoreHandle_t _sdCardMutex;
+    bool _isInserted = false;
+    uint32_t _size = 0;
+    uint32_t _position = 0;
+    uint8_t _chunk[TAPE_CHUNK_SIZE];
+
+    bool isLoadRoutine();
+    bool loadBlock();
+
+public:
+    // SD card mutex is held while blocks are read
+    void Initialize(SemaphoreHandle_t sdCardMutex);
+
+    bool Insert(const char* fileName);
+    void Eject();
+    void Rewind() { this->_position = 0; }
+    bool IsInserted() { return this->_isInserted; }
+
+    // Offset of the next block in the file
+    uint32_t GetPosition() { return this->_position; }
+    void Seek(uint32_t position) { this->_position = position; }
+
+    // Loads the next block the way LD-BYTES would and returns to the caller of LD-BYTES,
+    // returns false if ROM has to run as is
+    bool LoadBytes();
+
+    // Reads the first block that looks like a loading screen
+    static bool ReadScreen(zx::File* file, uint8_t screen[0x1B00]);
+};
+
+extern TapeLoader Tape;
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef __TAPEPLAYER_INCLUDED__
+#define __TAPEPLAYER_INCLUDED__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "File.h"
+#include "TapeLoader.h"
+
+#define TAPE_BUFFER_SIZE 512
+
+// T-states per millisecond
+#define TAPE_MS_TSTATES 3500
+
+// Cores that run many instructions per call are called in slices of this size while the tape plays
+#define TAPE_SLICE_TSTATES 64
+
+// Plays .tzx and .tap files as a signal on the EAR bit of port 0xFE.
+// Blocks are decoded from the file only when the time of the next edge is needed,
+// so nothing runs per instruction: reading the port catches up with the current T-state.
+class TapePlayer
+{
+private:
+    enum Stage : uint8_t
+    {
+        BlockStart,
+        Pilot,
+        Sync1,
+        Sync2,
+        Data,
+        Pause,
+        PauseRest,
+        Tone,
+        Pulses,
+        Direct,
+        End
+    };
+
+    zx::File _file;
+    SemaphoreHandle_t _sdCardMutex;
+    bool _isInserted = false;
+    bool _isPlaying = false;
+    bool _isTzx = false;
+    uint32_t _size = 0;
+
+    // Buffered reading
+    uint8_t _buffer[TAPE_BUFFER_SIZE];
+    uint32_t _bufferStart = 0;
+    uint16_t _bufferLength = 0;
+    uint16_t _bufferIndex = 0;
+
+    // Signal, edge time is relative to the start of the current frame
+    int32_t _edgeTime = 0;
+    uint8_t _level = 0;
+    uint8_t _edgeLevel = 0;
+    uint8_t _signal = 0;
+    int32_t _pausedRemaining = 0;
+
+    // Current block
+    Stage _stage = BlockStart;
+    uint32_t _blockStart = 0;
+    uint16_t _pilotPulse;
+    uint16_t _pilotCount;
+    uint16_t _sync1;
+    uint16_t _sync2;
+    uint16_t _zero;
+    uint16_t _one;
+    uint32_t _dataLength;
+    uint8_t _lastBits;
+    uint16_t _pauseMs;
+    uint8_t _byte;
+    uint8_t _bitsLeft;
+    bool _isSecondHalf;
+    uint16_t _pulseCount;
+    uint32_t _loopStart;
+    uint16_t _loopCount = 0;
+
+    // Edge sampling loop found after a read of the port, LD_BYTES_TRAP if none
+    uint16_t _loopAddress = LD_BYTES_TRAP;
+    uint16_t _checkedAddress = LD_BYTES_TRAP;
+    bool _isSampled = false;
+
+    uint32_t tell() { return this->_bufferStart + this->_bufferIndex; }
+    void seekTo(uint32_t position);
+    bool readByte(uint8_t* value);
+    bool readWord(uint16_t* value);
+    bool readLength(uint32_t* value, uint8_t size);
+    bool skip(uint32_t count);
+
+    bool startBlock();
+    bool startTzxBlock();
+    void setStandardBlock(uint32_t length, uint16_t pauseMs);
+    bool nextPulse(uint32_t* duration);
+    void advance();
+    uint8_t levelAt(uint32_t tstates);
+    bool isEdgeLoop(uint16_t address);
+    uint32_t fastForward(uint32_t tstates);
+
+public:
+    // SD card mutex is held while the file is read
+    void Initialize(SemaphoreHandle_t sdCardMutex);
+
+    bool Insert(const char* fileName);
+    void Eject();
+    bool IsInserted() { return this->_isInserted; }
+
+    // Time is in T-states from the start of the current frame
+    void Play(uint32_t tstates);
+    void Stop(uint32_t tstates);
+    bool IsPlaying() { return this->_isPlaying; }
+
+    // Position of the block being played, or of the next one between blocks
+    uint32_t GetBlockPosition();
+    void Seek(uint32_t position);
+
+    // EAR level at the given T-state of the current frame
+    uint8_t GetEar(uint32_t tstates);
+
+    // Called at the end of each frame with its length
+    void EndFrame(uint32_t tstates);
+
+    // Cores call OnTrap() at the end of an instruction when IsTrap() is true,
+    // it returns T-states skipped by fast-forwarding an edge sampling loop
+    bool IsTrap(uint16_t pc) { return pc == LD_BYTES_TRAP || pc == this->_loopAddress || this->_isSampled; }
+    uint32_t OnTrap(uint16_t pc, uint32_t tstates);
+};
+
+extern TapePlayer Player;
+
+#endif
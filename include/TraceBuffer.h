@@ -0,0 +1,77 @@
+#ifndef __TRACEBUFFER_INCLUDED__
+#define __TRACEBUFFER_INCLUDED__
+
+#include "settings.h"
+
+#ifdef TRACE_INSTRUCTIONS
+
+#include <stdint.h>
+#include "z80Environment.h"
+#include "File.h"
+
+#if (TRACE_INSTRUCTIONS & (TRACE_INSTRUCTIONS - 1)) != 0
+#error TRACE_INSTRUCTIONS must be a power of 2
+#endif
+
+// State at the start of an instruction
+struct TraceEntry
+{
+    uint16_t PC;
+    uint8_t Bytes[4];
+    uint16_t AF;
+    uint16_t BC;
+    uint16_t DE;
+    uint16_t HL;
+    uint16_t IX;
+    uint16_t IY;
+    uint16_t SP;
+    uint32_t TStates;
+};
+
+// Last TRACE_INSTRUCTIONS instructions of the JLS and LKF cores.
+// Entries are written without branches, after TRACE_TRAP_PC is executed the ring stops moving
+// and only its oldest entry is overwritten until the trace is dumped.
+class TraceBuffer
+{
+private:
+    TraceEntry _entries[TRACE_INSTRUCTIONS];
+    uint32_t _index = 0;
+    uint32_t _step = 1;
+
+public:
+    // Entry of the instruction at pc, the core fills in the registers
+    TraceEntry* Next(Z80Environment* environment, uint16_t pc)
+    {
+        TraceEntry* entry = &this->_entries[this->_index & (TRACE_INSTRUCTIONS - 1)];
+        this->_index += this->_step;
+#ifdef TRACE_TRAP_PC
+        this->_step &= pc != TRACE_TRAP_PC;
+#endif
+
+        entry->PC = pc;
+        entry->Bytes[0] = environment->PeekByte(pc);
+        entry->Bytes[1] = environment->PeekByte(pc + 1);
+        entry->Bytes[2] = environment->PeekByte(pc + 2);
+        entry->Bytes[3] = environment->PeekByte(pc + 3);
+        entry->TStates = environment->TStates;
+        return entry;
+    }
+
+    bool IsTrapped() { return this->_step == 0; }
+
+    // Number of entries, and entry i of them with 0 as the oldest
+    int Count();
+    const TraceEntry* Get(int i);
+
+    // Writes the entries as text lines, oldest first
+    bool Save(zx::File* file);
+
+    // Starts a new trace after a dump
+    void Reset();
+};
+
+extern TraceBuffer Trace;
+
+#endif
+
+#endif
@@ -2,7 +2,6 @@
 #define __VIDEOCONTROLLER__
 
 #include <memory>
-#include <map>
 #include "fabgl.h"
 #include "Settings.h"
 #include "SpectrumScreenData.h"
@@ -10,6 +9,11 @@
 #define SPECTRUM_WIDTH_WITH_BORDER  36
 #define SPECTRUM_HEIGHT_WITH_BORDER 26
 
+// Mode 1 color pairs and glyphs expanded with these colors
+#define PALETTE_SIZE      32
+#define GLYPH_CACHE_SIZE  256
+#define DEFAULT_ATTRIBUTE 0
+
 using namespace std;
 
 class VideoController : public fabgl::VGADirectController
@@ -21,8 +25,10 @@ public:
     uint8_t IRAM_ATTR createRawPixel(uint8_t color);
     uint8_t* _fontData;
     uint8_t Characters[SCREEN_WIDTH * SCREEN_HEIGHT];
-    uint32_t* _defaultAttribute = nullptr;
-    uint32_t** Attributes;
+    uint8_t Attributes[SCREEN_WIDTH * SCREEN_HEIGHT]; // index in palette
+    uint8_t Glyphs[SCREEN_WIDTH * SCREEN_HEIGHT];     // index in _glyphs
+    uint32_t (*_glyphs)[16];                          // 8 rows of 8 pixels
+    SpectrumScreenData _screenshot;
     uint16_t _leftOffset = 24; 
     uint16_t _topOffset = 16;
     uint8_t cursor_x = 0;
@@ -35,6 +41,10 @@ public:
     uint16_t _borderHeight = 24;
     volatile uint32_t Frames = 0;
 
+    // Mode 1 text rows from row 1 shown over the top border in mode 2, in the same columns
+    uint8_t OverlayRows = 0;
+    uint8_t OverlayColumn = 0;
+
     VideoController(SpectrumScreenData* screenData);
     void Start(char const* modeline);
     void SetMode(uint8_t mode);
@@ -46,24 +56,47 @@ public:
     void ShowScreenshot();
     void ShowScreenshot(const uint8_t* screenshot, uint8_t borderColor);
     void SetAttribute(uint8_t x, uint8_t y, uint8_t foreColor, uint8_t backColor);
+    void Clear(uint16_t x, uint16_t y, uint16_t width, uint16_t height);
 
     // Mode 2
 
+protected:
+    void onSetupDMABuffer(lldesc_t volatile* buffer, bool isStartOfVertFrontPorch, 
+        int scan, bool isVisible, int visibleRow) override;
+
 private:
-    std::map<uint16_t, uint32_t*> _attrToAddr;
-    std::map<uint32_t*, uint16_t> _addrToAttr;
-    uint32_t* _spectrumAttributes;
+    uint8_t* _screenshotPixels;
+    uint16_t* _screenshotAttributes;
 
-    uint32_t* CreateAttribute(uint8_t foreColor, uint8_t backColor);
+    uint16_t _paletteColors[PALETTE_SIZE]; // foreColor << 8 | backColor
+    uint16_t _paletteUsage[PALETTE_SIZE];  // number of cells using the entry
+    uint32_t _palette[PALETTE_SIZE][16];
+    uint8_t _paletteLookup[64 * 64];       // 6-bit foreColor, 6-bit backColor
+    uint16_t _glyphKeys[GLYPH_CACHE_SIZE]; // attribute << 8 | character
+    uint16_t _glyphCount = 0;
+    uint16_t _glyphLimit = GLYPH_CACHE_SIZE * 3 / 4;
+
+    // DMA descriptors of odd scanlines, used for line doubling in mode 2
+    lldesc_t volatile* _oddScanlines[SCREEN_HEIGHT * 8 / 2];
+
+    uint8_t CreateAttribute(uint8_t foreColor, uint8_t backColor);
+    void setCellAttribute(int offset, uint8_t attribute);
     void InitAttribute(uint32_t* attribute, uint8_t foreColor, uint8_t backColor);
+    uint8_t getGlyph(uint8_t attribute, uint8_t character, bool canFlush);
+    bool findGlyph(uint16_t key, uint8_t* index);
+    void flushGlyphs();
     void cursorNext();
     void print(char* str);
     void print(const char* str, uint8_t foreColor, uint8_t backColor);
     void printChar(uint16_t x, uint16_t y, uint16_t ch);
     void printChar(uint16_t x, uint16_t y, uint16_t ch, uint8_t foreColor, uint8_t backColor);
-    void freeUnusedAttributes();
     void prepareDebugScreen();
     void showScreenshot(uint8_t* pixelData, uint16_t* attributes, uint8_t borderColor);
+    void setLineDoubling(bool enabled);
 };
 
+// Scanline of the Spectrum screen with border, as sent to VGA
+void DrawSpectrumLine(VideoController* controller, SpectrumScreenData* screenData, uint8_t borderColor,
+    uint8_t* dest, unsigned scaledLine);
+
 #endif
\ No newline at end of file
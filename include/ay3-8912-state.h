@@ -36,6 +36,7 @@ public:
 	void setRegisterData(uint8_t data);
 	uint8_t getRegisterData();
 
+    // Plays the registers on the sound generator, other instances only keep them
     void Initialize();
     void StopSound();
     void ResumeSound();
@@ -44,6 +45,8 @@ public:
 	void AttachSoundGenerator(WaveformGenerator* soundGenerator);
 
 private:
+	bool _isAudible = false;
+
 	void updated();
 };
 
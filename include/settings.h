@@ -7,7 +7,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 // CPU core selection
 //
-// one of the following MUST be defined:
+// all cores are linked, Scroll Lock switches between them at runtime
+// one of the following selects the core used at startup:
 // - CPU_LINKEFONG: use Lin Ke-Fong's core           https://github.com/anotherlin/z80emu
 // - CPU_JLSANCHEZ: use José Luis Sánchez's core     https://github.com/jsanchezv/z80cpp
 // - CPU_STEVECHECKOWAY: use Steve Checkoway's core  https://github.com/stevecheckoway/libzel
@@ -21,6 +22,50 @@
 // Do not undefine this. Current version doesn't support reading from flash
 #define SDCARD
 
+// Save screen to SD card as screenNNN.ppm every N frames after a snapshot load (F4 saves it once).
+// Hashes are compared with /golden/golden.txt, missing ones are added. Frames are copied to RAM and
+// written by a task, a frame is skipped while the previous one is still being written. At start the
+// snapshots named in /golden/list.txt are loaded one after another, each for 4 captures. test/golden
+// has such a set with its hashes at 50 frames, taken with CPU_JLS. LKF and ZEL match them, AW does
+// not match on scroll.z80.
+//#define CAPTURE_FRAMES 50
+
+// Skip iterations of tape edge sampling loops that cannot see an edge
+#define TAPE_FAST_FORWARD
+
+// Log where host time goes every N seconds, Num Lock shows the same values on screen
+#define PERF_LOG_SECONDS 10
+
+// Count executed opcodes, and T-states per 16 bytes of address space (PROFILER_PC_SHIFT, per address
+// would take 256K), on the JLS and LKF cores. Print Screen starts profiling and saves profNNN.csv
+// to SD card. Not compiled when undefined.
+//#define PROFILER
+
+// Keep the last N instructions (a power of 2) of the JLS and LKF cores, End shows them and saves
+// traceNNN.txt to SD card. Executing TRACE_TRAP_PC does the same at the end of that frame.
+//#define TRACE_INSTRUCTIONS 256
+//#define TRACE_TRAP_PC 0x0000
+
+// PC breakpoints and memory and port watchpoints (see Debugger.h), Home stops at the next instruction.
+// Breakpoints and watchpoints work with every core.
+//#define DEBUGGER
+
+// Run every .z80 and .sna of this SD card folder for BATCH_FRAMES frames at startup, on a headless
+// machine per CPU core, and write registers and a RAM hash of each to batch.csv (see BatchRunner.h).
+// Not compiled with DEBUGGER, PROFILER or TRACE_INSTRUCTIONS.
+//#define BATCH_RUNNER "/batch"
+
+// At startup, compress and decompress generated pages in the .z80 format, log mismatches and the
+// time per page. Not compiled when undefined.
+//#define PAGE_CODEC_TEST
+
+// GDB remote protocol, needs DEBUGGER. The device talks to GDB on UART GDB_UART at 115200 baud
+// ("target remote /dev/ttyUSB0"), the log is turned off when it is UART 0. Host builds listen on the
+// Unix socket GDB_SOCKET ("target remote <path>").
+//#define GDB_STUB
+#define GDB_UART 0
+#define GDB_SOCKET "/tmp/z80emu.sock"
+
 #define BEEPER
 #define BEEPER_PIN gpio_num_t::GPIO_NUM_25
 
@@ -0,0 +1,24 @@
+#ifndef __SNASNAPSHOT_INCLUDED__
+#define __SNASNAPSHOT_INCLUDED__
+
+#include <stdint.h>
+#include "File.h"
+#include "z80snapshot.h"
+
+using namespace std;
+
+#define SNA_HEADER_SIZE 27
+#define SNA_48K_SIZE (SNA_HEADER_SIZE + 0xC000)
+
+namespace zx
+{
+
+SnapshotModel GetSnaSnapshotModel(uint32_t fileSize);
+
+bool LoadSnaSnapshot(Machine* machine, File* file, uint8_t buffer1[0x4000]);
+bool ReadScreenFromSnaSnapshot(File* file, uint8_t screen[0x1B00], uint8_t* borderColor);
+bool SaveSnaSnapshot(File* file, uint8_t buffer1[0x4000]);
+
+}
+
+#endif
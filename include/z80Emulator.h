@@ -9,58 +9,97 @@
 #include "ClassProperties.h"
 #undef F
 
-struct z80Emulator
+// Registers of every core, REGISTER(TYPE, NAME) is expanded for each of them
+#define Z80_REGISTERS(REGISTER) \
+    REGISTER(uint8_t, A) REGISTER(uint8_t, F) REGISTER(uint8_t, B) REGISTER(uint8_t, C) \
+    REGISTER(uint8_t, D) REGISTER(uint8_t, E) REGISTER(uint8_t, H) REGISTER(uint8_t, L) \
+    REGISTER(uint8_t, I) REGISTER(uint8_t, R) \
+    REGISTER(uint16_t, AF) REGISTER(uint16_t, BC) REGISTER(uint16_t, DE) REGISTER(uint16_t, HL) \
+    REGISTER(uint16_t, AFx) REGISTER(uint16_t, BCx) REGISTER(uint16_t, DEx) REGISTER(uint16_t, HLx) \
+    REGISTER(uint16_t, IX) REGISTER(uint16_t, IY) REGISTER(uint16_t, SP) REGISTER(uint16_t, PC) \
+    REGISTER(uint8_t, IFF1) REGISTER(uint8_t, IFF2) REGISTER(uint8_t, IM)
+
+#define Z80_CORE_REGISTER(TYPE, NAME) \
+    virtual TYPE get_##NAME() = 0; virtual void set_##NAME(TYPE value) = 0;
+
+#define Z80_CORE_OVERRIDE(TYPE, NAME) \
+    TYPE get_##NAME() override; void set_##NAME(TYPE value) override;
+
+// One of the Z80 cores, each is in its z80Emulator_*.cpp.
+// A core keeps all its state, so several of them can run at once on different environments.
+class z80Core
 {
-private:
-    Z80Environment* _environment;
+public:
+    virtual ~z80Core() { }
 
-    uint32_t get_TStates() { return this->_environment->TStates; }
-    void set_TStates(uint32_t value) { this->_environment->TStates = value; }
+    virtual const char* Name() = 0;
 
-    uint8_t get_A(); void set_A(uint8_t);
-    uint8_t get_F(); void set_F(uint8_t);
-    uint8_t get_B(); void set_B(uint8_t);
-    uint8_t get_C(); void set_C(uint8_t);
-    uint8_t get_D(); void set_D(uint8_t);
-    uint8_t get_E(); void set_E(uint8_t);
-    uint8_t get_H(); void set_H(uint8_t);
-    uint8_t get_L(); void set_L(uint8_t);
+    virtual void setup(Z80Environment* environment) = 0;
+    virtual void reset() = 0;
+    // Runs at least number_cycles T-states and returns how many ran. Environment's TStates is the
+    // time in the frame, it goes on from where the previous call stopped.
+    virtual int emulate(int number_cycles) = 0;
+    virtual void interrupt() = 0;
 
-    uint8_t get_I(); void set_I(uint8_t);
-    uint8_t get_R(); void set_R(uint8_t);
+    // Opcode fetches (M1 cycles) of instructions since the last call, 0 if the core does not count them
+    virtual uint32_t takeFetchCount() { return 0; }
 
-    uint16_t get_AF(); void set_AF(uint16_t);
-    uint16_t get_BC(); void set_BC(uint16_t);
-    uint16_t get_DE(); void set_DE(uint16_t);
-    uint16_t get_HL(); void set_HL(uint16_t);
+    Z80_REGISTERS(Z80_CORE_REGISTER)
+};
 
-    uint16_t get_AFx(); void set_AFx(uint16_t);
-    uint16_t get_BCx(); void set_BCx(uint16_t);
-    uint16_t get_DEx(); void set_DEx(uint16_t);
-    uint16_t get_HLx(); void set_HLx(uint16_t);
+enum class Z80CoreType : uint8_t
+{
+    LinKeFong,
+    JLSanchez,
+    SteveCheckoway,
+    AndreWeissflog,
+    Count
+};
 
-    uint16_t get_IX(); void set_IX(uint16_t);
-    uint16_t get_IY(); void set_IY(uint16_t);
-    uint16_t get_SP(); void set_SP(uint16_t);
+z80Core* CreateCoreLKF();
+z80Core* CreateCoreJLS();
+z80Core* CreateCoreZEL();
+z80Core* CreateCoreAW();
 
-    uint16_t get_PC(); void set_PC(uint16_t);
+#define Z80_EMULATOR_REGISTER(TYPE, NAME) \
+    TYPE get_##NAME() { return this->_core->get_##NAME(); } \
+    void set_##NAME(TYPE value) { this->_core->set_##NAME(value); }
 
-    uint8_t get_IFF1(); void set_IFF1(uint8_t);
-    uint8_t get_IFF2(); void set_IFF2(uint8_t);
-    uint8_t get_IM(); void set_IM(uint8_t);
+// All cores are linked, one of them runs at a time and can be switched between frames
+struct z80Emulator
+{
+private:
+    Z80Environment* _environment;
+    // Created when selected
+    z80Core* _cores[(int)Z80CoreType::Count] = {};
+    z80Core* _core;
+    Z80CoreType _coreType;
+
+    uint32_t get_TStates() { return this->_environment->TStates; }
+    void set_TStates(uint32_t value) { this->_environment->TStates = value; }
+
+    Z80_REGISTERS(Z80_EMULATOR_REGISTER)
+
+    z80Core* createCore(Z80CoreType coreType);
 
 public:
     void setup(Z80Environment* environment);
-    void reset();
-    int emulate(int number_cycles);
-    void interrupt();
-    
+    void reset() { this->_core->reset(); }
+    int emulate(int number_cycles) { return this->_core->emulate(number_cycles); }
+    void interrupt() { this->_core->interrupt(); }
+    uint32_t TakeFetchCount() { return this->_core->takeFetchCount(); }
+
+    // Registers are carried over to the new core, call it between emulate() calls
+    void SelectCore(Z80CoreType coreType);
+    Z80CoreType GetCore() { return this->_coreType; }
+    const char* GetCoreName() { return this->_core->Name(); }
+
     CLASS(z80Emulator);
 
     PROPERTY(uint32_t, TStates);
 
     // 8 bit registers
-    PROPERTY(uint8_t, A); // Accumulator 
+    PROPERTY(uint8_t, A); // Accumulator
     PROPERTY(uint8_t, F); // Flags
     PROPERTY(uint8_t, B);
     PROPERTY(uint8_t, C);
@@ -98,15 +137,8 @@ public:
     PROPERTY(uint8_t, IFF2); // Interrupt flip-flop 2
     PROPERTY(uint8_t, IM);   // Interrupt mode
 
-    z80Emulator() : TStates(0),
-        A(this), F(this), B(this), C(this), D(this), E(this), H(this), L(this),
-        I(this), R(this), AF(this), BC(this), DE(this), HL(this),
-        AFx(this), BCx(this), DEx(this), HLx(this),
-        IX(this), IY(this), SP(this), PC(this), 
-        IFF1(this), IFF2(this), IM(this)
-    {
-    }
+    z80Emulator();
+    ~z80Emulator();
 };
 
 #endif
-
@@ -8,6 +8,7 @@
 #include "RamPage.h"
 #include "ClassProperties.h"
 #include "RamVideoPage.h"
+#include "ay3-8912-state.h"
 
 typedef struct 
 {
@@ -26,6 +27,8 @@ typedef struct
 } MemorySelect;
 
 class VideoController;
+class TapePlayer;
+class InputRecorder;
 
 class Z80Environment
 {
@@ -47,12 +50,41 @@ private:
 	SpectrumScreenData _shadowScreenData;
     RamVideoPage _ram7;
 
+    // Rest of the video pages of a headless machine
+    uint8_t* _ram5Data = nullptr;
+    uint8_t* _ram7Data = nullptr;
+
+    // Byte per RAM bank set by every write. A plain store to a fixed slot for banks 5 and 2
+    // keeps the write path short, written 256-byte blocks are found on demand by GetDirtyRange().
+    uint8_t _dirtyPages[8] = {};
+
+    // Last value written to port 0xFE, and to ports that are not emulated
+    uint8_t _portFE = 0xFF;
+    uint8_t _portData = 0;
+
+    uint8_t readPort(uint8_t portLow, uint8_t portHigh);
+
+    inline void markDirty(uint8_t pageNumber)
+    {
+        this->_dirtyPages[pageNumber] = 1;
+    }
+
 public:
+	// nullptr for a headless machine, which also has no sound, beeper or mouse
 	VideoController* Screen;
     RamPage* Rom[2];
     MemoryPage* Ram[8];
     MemorySelect MemoryState;
 
+    Sound::Ay3_8912_state Ay;
+
+    // Keyboard half-rows, bit 0 of row 0 is Caps Shift (port 0xFEFE), a zero bit is a pressed key
+    uint8_t KeyboardRows[8];
+
+    // Tape and input recording hooks, nullptr when the machine has none
+    TapePlayer* Tape = nullptr;
+    InputRecorder* Recorder = nullptr;
+
     // CPU Tstates elapsed in current frame
     uint32_t TStates;
 
@@ -60,10 +92,34 @@ public:
     PROPERTY(uint8_t, BorderColor);
 
     Z80Environment(VideoController* screen);
+    ~Z80Environment();
 
+    // Machine on screen, with the RAM that is statically allocated for it
     void Initialize();
+    // Machine without screen, all its RAM is allocated from the heap, false if it does not fit
+    bool InitializeHeadless();
+
+    // Sound, keyboard, ports and frame time at power on
+    void Reset();
 
 	void SetState(uint8_t memoryState);
+    // Shows the screen that MemoryState selects, after paging is set without a port write
+    void SelectScreen();
+
+    // RAM bank, or nullptr if it is not available in this build
+    MemoryPage* GetRamPage(uint8_t pageNumber);
+
+    // Memory written by WriteByte() since ClearDirty(). GetDirtyPages() has a bit per RAM bank.
+    // GetDirtyRange() finds the next range of 256-byte blocks at or after offset of a written bank
+    // that differ from reference, a copy of the bank made at ClearDirty(), false if there is none.
+    uint8_t GetDirtyPages();
+    bool GetDirtyRange(uint8_t pageNumber, const uint8_t reference[0x4000], uint16_t* offset, uint16_t* size);
+    void ClearDirty();
+
+    // Reads without stopping on watchpoints, for everything other than the CPU
+    uint8_t PeekByte(uint16_t address);
+    // Writes without stopping on watchpoints or marking dirty blocks, for the debugger
+    void PokeByte(uint16_t address, uint8_t data);
     uint8_t ReadByte(uint16_t address);
 	uint16_t ReadWord(uint16_t address);
 	void WriteByte(uint16_t address, uint8_t data);
@@ -3,8 +3,6 @@
 
 #include <stdint.h>
 
-extern uint8_t indata[];
-
 enum {
 	ZX_KEY_SHIFT = 0,
 	ZX_KEY_Z,
@@ -57,9 +55,11 @@ enum {
 	ZX_KEY_LAST
 };
 
-extern const uint8_t keyaddr[ZX_KEY_LAST];
+// Keyboard half-row (0 for port 0xFEFE to 7 for 0x7FFE) and bit of each key
+extern const uint8_t keyrow[ZX_KEY_LAST];
 extern const uint8_t keybuf[ZX_KEY_LAST];
 
-bool OnKey(uint32_t scanCode, bool isKeyUp);
+// Updates the rows of Z80Environment::KeyboardRows, false if the key is not on the Spectrum
+bool OnKey(uint8_t keyboardRows[8], uint32_t scanCode, bool isKeyUp);
 
 #endif
@@ -2,18 +2,49 @@
 #define __Z80SNAPSHOT_INCLUDED__
 
 #include <stdint.h>
+#include "settings.h"
 #include "File.h"
 
 using namespace std;
 
+class Machine;
+
+// Main header and the start of the additional header of versions 2 and 3
+#define Z80_HEADER_SIZE 36
+
 namespace zx
 {
 
-bool LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t buffer2[0x4000]);
+enum class SnapshotModel : uint8_t
+{
+    Unknown,
+    Spectrum48K,
+    Spectrum128K,
+    NotRead
+};
+
+SnapshotModel GetZ80SnapshotModel(uint8_t* header, uint16_t length);
+
+// Loads into the machine, the other functions work on the machine on screen
+bool LoadZ80Snapshot(Machine* machine, File* file, uint8_t buffer1[0x4000]);
 bool LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000]);
+bool ReadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t screen[0x1B00], uint8_t* borderColor);
 bool LoadScreenshot(File* file, uint8_t buffer1[0x4000]);
 bool SaveZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t buffer2[0x4000]);
 
+// Registers and paging in the .z80 header format
+void SaveZ80State(uint8_t state[Z80_HEADER_SIZE]);
+void LoadZ80State(uint8_t state[Z80_HEADER_SIZE]);
+
+// Page in .z80 compression, returns false if it does not fit into capacity or is not smaller than the page
+bool CompressPageToBuffer(uint8_t page[0x4000], uint8_t* output, uint16_t capacity, uint16_t* size);
+void DecompressPageFromBuffer(uint8_t* data, uint16_t size, uint8_t page[0x4000]);
+
+#ifdef PAGE_CODEC_TEST
+// Compresses and decompresses generated pages, logs mismatches and the time per page. False on a mismatch.
+bool TestPageCodec(uint8_t buffer1[0x4000], uint8_t buffer2[0x4000]);
+#endif
+
 }
 
 #endif
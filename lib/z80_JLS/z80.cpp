@@ -879,6 +879,7 @@ void Z80::execute(void) {
 
     opCode = Z80opsImpl->fetchOpcode(REG_PC);
     regR++;
+    fetchCount++;
 
 #ifdef WITH_BREAKPOINT_SUPPORT
     if (breakpointEnabled && prefixOpcode == 0) {
@@ -2259,6 +2260,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
         { /* Subconjunto de instrucciones */
             opCode = Z80opsImpl->fetchOpcode(REG_PC++);
             regR++;
+            fetchCount++;
             decodeDDFD(opCode, regIX);
             break;
         }
@@ -2365,6 +2367,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
         case 0xED: /*Subconjunto de instrucciones*/
             opCode = Z80opsImpl->fetchOpcode(REG_PC++);
             regR++;
+            fetchCount++;
             decodeED(opCode);
             break;
         case 0xEE: /* XOR n */
@@ -2454,6 +2457,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
         case 0xFD: /* Subconjunto de instrucciones */
             opCode = Z80opsImpl->fetchOpcode(REG_PC++);
             regR++;
+            fetchCount++;
             decodeDDFD(opCode, regIY);
             break;
         case 0xFE: /* CP n */
@@ -2472,6 +2476,7 @@ void Z80::decodeOpcode(uint8_t opCode) {
 void Z80::decodeCB(void) {
     uint8_t opCode = Z80opsImpl->fetchOpcode(REG_PC++);
     regR++;
+    fetchCount++;
 
     switch (opCode) {
         case 0x00:
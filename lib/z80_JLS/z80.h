@@ -147,6 +147,9 @@ private:
     uint8_t regR;
     // *R7 -- Refresco de memoria -- 1 bit* (bit superior de R)
     bool regRbit7;
+    // Extracciones de opcode (M1) de las instrucciones, sin las interrupciones
+    // Opcode fetches (M1) of instructions, interrupts are not counted
+    uint32_t fetchCount = 0;
     //Flip-flops de interrupción
     bool ffIFF1 = false;
     bool ffIFF2 = false;
@@ -309,6 +312,9 @@ public:
     uint8_t getRegR(void) const { return regRbit7 ? regR | SIGN_MASK : regR & 0x7f; }
     void setRegR(uint8_t value) { regR = value & 0x7f; regRbit7 = (value > 0x7f); }
 
+    uint32_t getFetchCount(void) const { return fetchCount; }
+    void setFetchCount(uint32_t value) { fetchCount = value; }
+
     // Acceso al registro oculto MEMPTR
     // Hidden register MEMPTR (known as WZ at Zilog doc?)
     uint16_t getMemPtr(void) const { return REG_WZ; }
@@ -238,6 +238,7 @@ int Z80Emulate (Z80_STATE *state, int number_cycles, void *context)
         state->status = 0;
 	elapsed_cycles = 0;
 	pc = state->pc;
+        Z80_ON_INSTRUCTION(pc);
         Z80_FETCH_BYTE(pc, opcode);
         state->pc = pc + 1;
 
@@ -253,10 +254,10 @@ static int emulate (Z80_STATE * state,
 	int elapsed_cycles, int number_cycles, 
 	void *context)
 {
-        int	pc, r;
+        int	pc, r, r_start;
 
         pc = state->pc;
-        r = state->r & 0x7f;
+        r = r_start = state->r & 0x7f;
         goto start_emulation;
 
         for ( ; ; ) {   
@@ -264,6 +265,7 @@ static int emulate (Z80_STATE * state,
                 void    **registers; 
                 int     instruction;
 
+                Z80_ON_INSTRUCTION(pc);
                 Z80_FETCH_BYTE(pc, opcode);
                 pc++;
 
@@ -447,8 +449,9 @@ emulate_next_instruction:
 
                                 else {
 
+                                        Z80_COUNT_FETCHES(r - r_start);
                                         state->r = A;
-                                        r = A & 0x7f;
+                                        r = r_start = A & 0x7f;
 
                                 }
 
@@ -2611,6 +2614,7 @@ emulate_next_instruction:
 
 stop_emulation:
 
+        Z80_COUNT_FETCHES(r - r_start);
         state->r = (state->r & 0x80) | (r & 0x7f);
         state->pc = pc & 0xffff;
 
@@ -12,6 +12,7 @@
 
 #include <stdint.h>
 #include "z80emu.h"
+#include "settings.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -85,47 +86,76 @@ extern "C" {
  *
  *      instruction     Type of the currently executing instruction, see
  *                      instructions.h for a list.
+ *
+ * Z80_COUNT_FETCHES() gets the number of opcode fetches (R register
+ * increments) of the instructions emulated, when emulation stops and before
+ * LD R, A.
+ *
+ * Z80_ON_INSTRUCTION() is called with the address of each instruction before
+ * its opcode is fetched, only when the emulator keeps a trace
+ * (TRACE_INSTRUCTIONS in settings.h).
  */
 
+/* Callbacks get the environment, so that several emulators can run at once. */
+
 typedef struct CONTEXT {
-	uint8_t(*readbyte)(uint16_t);
-	uint16_t(*readword)(uint16_t);
-	void(*writebyte)(uint16_t, uint8_t);
-	void(*writeword)(uint16_t, uint16_t);
-	uint8_t(*input)(uint8_t, uint8_t);
-	void(*output)(uint8_t, uint8_t, uint8_t);
+	void* environment;
+	uint8_t(*readbyte)(void*, uint16_t);
+	uint16_t(*readword)(void*, uint16_t);
+	void(*writebyte)(void*, uint16_t, uint8_t);
+	void(*writeword)(void*, uint16_t, uint16_t);
+	uint8_t(*input)(void*, uint8_t, uint8_t);
+	void(*output)(void*, uint8_t, uint8_t, uint8_t);
+	uint32_t fetches;
+#ifdef TRACE_INSTRUCTIONS
+	void(*instruction)(void*, void*, uint16_t, int);
+#endif
 } CONTEXT;
 
 #define Z80_READ_BYTE(address, x)                          \
 {                                                          \
-        (x) = ((CONTEXT*)context)->readbyte(address);      \
+        (x) = ((CONTEXT*)context)->readbyte(((CONTEXT*)context)->environment, address); \
 }
 
 #define Z80_WRITE_BYTE(address, x)                         \
 {                                                          \
-        ((CONTEXT*)context)->writebyte(address, x);        \
+        ((CONTEXT*)context)->writebyte(((CONTEXT*)context)->environment, address, x); \
 }
 
 #define Z80_READ_WORD(address, x)                          \
 {                                                          \
-        (x) = ((CONTEXT*)context)->readword(address);      \
+        (x) = ((CONTEXT*)context)->readword(((CONTEXT*)context)->environment, address); \
 }
 
 #define Z80_WRITE_WORD(address, x)                         \
 {                                                          \
-        ((CONTEXT*)context)->writeword(address, x);        \
+        ((CONTEXT*)context)->writeword(((CONTEXT*)context)->environment, address, x); \
 }
 
 #define Z80_INPUT_BYTE(portLow, portHigh, x)               \
 {                                                          \
-        (x) = ((CONTEXT*)context)->input(portLow, portHigh); \
+        (x) = ((CONTEXT*)context)->input(((CONTEXT*)context)->environment, portLow, portHigh); \
 }
 
 #define Z80_OUTPUT_BYTE(portLow, portHigh, x)              \
 {                                                          \
-        ((CONTEXT*)context)->output(portLow, portHigh, x); \
+        ((CONTEXT*)context)->output(((CONTEXT*)context)->environment, portLow, portHigh, x); \
 }                                                                      
 
+#define Z80_COUNT_FETCHES(n)                               \
+{                                                          \
+        ((CONTEXT*)context)->fetches += (n);               \
+}
+
+#ifdef TRACE_INSTRUCTIONS
+#define Z80_ON_INSTRUCTION(address)                        \
+{                                                          \
+        ((CONTEXT*)context)->instruction(((CONTEXT*)context)->environment, state, (address) & 0xffff, elapsed_cycles); \
+}
+#else
+#define Z80_ON_INSTRUCTION(address)
+#endif
+
 #define Z80_FETCH_BYTE(address, x)		Z80_READ_BYTE((address), (x))
 
 #define Z80_FETCH_WORD(address, x)		Z80_READ_WORD((address), (x))
@@ -61,6 +61,9 @@ typedef struct Z80_t
 	void (*WriteIO)(word, byte, Z80);
 	void (*InterruptComplete)(Z80);
 	void (*ControlFlow)(word, word, ControlFlowType, Z80);
+
+	/* Not used by the core, lets callbacks find their emulator */
+	void *user_data;
 } Z80_t;
 
 #ifdef __cplusplus
@@ -0,0 +1,212 @@
+#include "settings.h"
+
+#ifdef BATCH_RUNNER
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "BatchRunner.h"
+#include "Machine.h"
+#include "z80snapshot.h"
+#include "snasnapshot.h"
+
+using namespace zx;
+
+BatchRunner Batch;
+
+static bool hasExtension(const char* fileName, const char* extension)
+{
+    const char* fileExtension = strrchr(fileName, '.');
+    return fileExtension != nullptr && strcasecmp(fileExtension, extension) == 0;
+}
+
+bool BatchRunner::Run(SemaphoreHandle_t sdCardMutex, const char* folder, const char* resultFileName,
+    uint8_t buffer[0x4000])
+{
+    this->_sdCardMutex = sdCardMutex;
+    this->_buffer = buffer;
+    this->_folderName = folder;
+    this->_passed = 0;
+    this->_failed = 0;
+    memset(this->_loads, 0, sizeof(this->_loads));
+    memset(this->_loadTime, 0, sizeof(this->_loadTime));
+
+    if (f_opendir(&this->_folder, folder) != FR_OK)
+    {
+        ESP_LOGE(TAG, "Batch folder %s not found", folder);
+        return false;
+    }
+
+    this->_results.open(resultFileName, ios_base::out);
+    if (!this->_results.is_open())
+    {
+        f_closedir(&this->_folder);
+        return false;
+    }
+
+    const char* header = "name,frames,pc,sp,af,hash\n";
+    this->_results.write((uint8_t*)header, strlen(header));
+
+    int64_t startTime = esp_timer_get_time();
+    this->_caller = xTaskGetCurrentTaskHandle();
+    int taskCount = 0;
+    for (int i = 0; i < BATCH_TASKS; i++)
+    {
+        if (xTaskCreatePinnedToCore(workerMain, "batch", 8192, this, 1, nullptr, i) == pdPASS)
+        {
+            taskCount++;
+        }
+    }
+
+    // Workers take the mutex for each snapshot
+    xSemaphoreGive(this->_sdCardMutex);
+    for (int i = 0; i < taskCount; i++)
+    {
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+    }
+    xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+
+    this->_results.close();
+    f_closedir(&this->_folder);
+
+    ESP_LOGI(TAG, "Batch of %d snapshots, %d failed, on %d tasks in %d ms", this->_passed + this->_failed,
+        this->_failed, taskCount, (int)((esp_timer_get_time() - startTime) / 1000));
+    ESP_LOGI(TAG, "Batch loads: %d .z80 in %d us, %d .sna in %d us on average",
+        this->_loads[0], this->_loads[0] > 0 ? (int)(this->_loadTime[0] / this->_loads[0]) : 0,
+        this->_loads[1], this->_loads[1] > 0 ? (int)(this->_loadTime[1] / this->_loads[1]) : 0);
+    return taskCount != 0;
+}
+
+void BatchRunner::workerMain(void* parameter)
+{
+    BatchRunner* runner = (BatchRunner*)parameter;
+    runner->work();
+    xTaskNotifyGive(runner->_caller);
+    vTaskDelete(nullptr);
+}
+
+void BatchRunner::work()
+{
+    Machine* machine = new Machine();
+    if (!machine->InitializeHeadless())
+    {
+        ESP_LOGE(TAG, "Not enough memory for a batch machine");
+        delete machine;
+        return;
+    }
+
+    Z80Environment& environment = machine->Environment;
+    z80Emulator& cpu = machine->Cpu;
+    char fileName[256];
+    char path[sizeof(SDCARD_PATH) + 512];
+    while (true)
+    {
+        xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+        if (!this->next(fileName))
+        {
+            xSemaphoreGive(this->_sdCardMutex);
+            break;
+        }
+
+        // Banks a snapshot does not load are the same for every snapshot, whichever task runs it
+        machine->Reset();
+        memset(this->_buffer, 0, 0x4000);
+        for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+        {
+            MemoryPage* page = environment.GetRamPage(pageNumber);
+            if (page != nullptr)
+            {
+                page->FromBuffer(this->_buffer);
+            }
+        }
+
+        snprintf(path, sizeof(path), SDCARD_PATH "%s/%s", this->_folderName, fileName);
+        bool isSna = hasExtension(fileName, ".sna");
+        bool isLoaded = false;
+        int64_t loadStartTime = esp_timer_get_time();
+        File file;
+        file.open(path, ios_base::in);
+        if (file.is_open())
+        {
+            isLoaded = isSna
+                ? LoadSnaSnapshot(machine, &file, this->_buffer)
+                : LoadZ80Snapshot(machine, &file, this->_buffer);
+            file.close();
+        }
+        if (isLoaded)
+        {
+            this->_loads[isSna]++;
+            this->_loadTime[isSna] += esp_timer_get_time() - loadStartTime;
+        }
+        xSemaphoreGive(this->_sdCardMutex);
+
+        if (!isLoaded)
+        {
+            ESP_LOGW(TAG, "Batch snapshot %s not loaded", fileName);
+            this->writeResult(fileName, 0, 0, 0, 0, 0);
+            continue;
+        }
+
+        for (int frame = 0; frame < BATCH_FRAMES; frame++)
+        {
+            machine->RunFrame();
+        }
+
+        uint32_t hash = 2166136261u;
+        for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+        {
+            MemoryPage* page = environment.GetRamPage(pageNumber);
+            if (page == nullptr)
+            {
+                continue;
+            }
+
+            for (uint32_t offset = 0; offset < 0x4000; offset++)
+            {
+                hash = (hash ^ page->ReadByte(offset)) * 16777619u;
+            }
+        }
+
+        this->writeResult(fileName, BATCH_FRAMES, cpu.PC, cpu.SP, cpu.AF, hash);
+    }
+
+    delete machine;
+}
+
+bool BatchRunner::next(char* fileName)
+{
+    FILINFO fileInfo;
+    while (f_readdir(&this->_folder, &fileInfo) == FR_OK && fileInfo.fname[0] != 0)
+    {
+        if ((fileInfo.fattrib & (AM_DIR | AM_HID | AM_SYS)) == 0
+            && (hasExtension(fileInfo.fname, ".z80") || hasExtension(fileInfo.fname, ".sna")))
+        {
+            strcpy(fileName, fileInfo.fname);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void BatchRunner::writeResult(const char* fileName, uint32_t frames, uint16_t pc, uint16_t sp, uint16_t af, uint32_t hash)
+{
+    char line[300];
+    size_t length = snprintf(line, sizeof(line), "%s,%u,%04X,%04X,%04X,%08X\n", fileName, frames, pc, sp, af, hash);
+    xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+    this->_results.write((uint8_t*)line, length);
+    if (frames != 0)
+    {
+        this->_passed++;
+    }
+    else
+    {
+        this->_failed++;
+    }
+    xSemaphoreGive(this->_sdCardMutex);
+}
+
+#endif
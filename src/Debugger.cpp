@@ -0,0 +1,216 @@
+#include "settings.h"
+
+#ifdef DEBUGGER
+
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "Debugger.h"
+
+static const char* _stopReasonNames[] = { "", "Break", "Step", "Breakpoint", "Read", "Write", "Input", "Output" };
+
+Debugger Debug;
+
+bool Debugger::SetBreakpoint(uint16_t address)
+{
+    if (this->_breakpoints == nullptr)
+    {
+        this->_breakpoints = (uint8_t*)calloc(0x10000 >> 3, 1);
+        if (this->_breakpoints == nullptr)
+        {
+            ESP_LOGE(TAG, "Not enough memory for breakpoints");
+            return false;
+        }
+    }
+
+    if (!this->IsBreakpoint(address))
+    {
+        this->_breakpoints[address >> 3] |= 1 << (address & 0x07);
+        this->_breakpointCount++;
+        this->update();
+    }
+    return true;
+}
+
+void Debugger::ClearBreakpoint(uint16_t address)
+{
+    if (this->IsBreakpoint(address))
+    {
+        this->_breakpoints[address >> 3] &= ~(1 << (address & 0x07));
+        this->_breakpointCount--;
+        this->update();
+    }
+}
+
+bool Debugger::SetWatchpoint(uint16_t start, uint16_t end, uint8_t types)
+{
+    if (this->_watchpointCount >= DEBUGGER_WATCHPOINTS || start > end || types == 0)
+    {
+        return false;
+    }
+
+    Watchpoint* watchpoint = &this->_watchpoints[this->_watchpointCount++];
+    watchpoint->Start = start;
+    watchpoint->End = end;
+    watchpoint->Types = types;
+    this->update();
+    return true;
+}
+
+void Debugger::ClearWatchpoint(uint16_t start, uint16_t end, uint8_t types)
+{
+    for (int i = 0; i < this->_watchpointCount; i++)
+    {
+        Watchpoint* watchpoint = &this->_watchpoints[i];
+        if (watchpoint->Start == start && watchpoint->End == end && watchpoint->Types == types)
+        {
+            this->_watchpoints[i] = this->_watchpoints[--this->_watchpointCount];
+            this->update();
+            return;
+        }
+    }
+}
+
+void Debugger::ClearWatchpoints()
+{
+    this->_watchpointCount = 0;
+    this->update();
+}
+
+void Debugger::ClearAll()
+{
+    free(this->_breakpoints);
+    this->_breakpoints = nullptr;
+    this->_breakpointCount = 0;
+    this->ClearWatchpoints();
+}
+
+void Debugger::Break()
+{
+    this->_isBreakPending = true;
+    this->update();
+}
+
+void Debugger::Resume(bool step)
+{
+    this->_stopReason = StopReason::None;
+    this->_isBreakPending = false;
+    this->_isStepping = step;
+    // The instruction at the stop runs even if it has a breakpoint
+    this->_isResuming = true;
+    this->update();
+}
+
+const char* Debugger::GetStopReasonName()
+{
+    return _stopReasonNames[(int)this->_stopReason];
+}
+
+bool Debugger::OnInstruction(uint16_t pc)
+{
+    if (this->_stopReason != StopReason::None)
+    {
+        // Watchpoint in the previous instruction
+        return true;
+    }
+
+    if (this->_isResuming)
+    {
+        this->_isResuming = false;
+        return false;
+    }
+
+    if (this->_isStepping)
+    {
+        this->_stopReason = StopReason::Step;
+    }
+    else if (this->_isBreakPending)
+    {
+        this->_stopReason = StopReason::Break;
+    }
+    else if (this->IsBreakpoint(pc))
+    {
+        this->_stopReason = StopReason::Breakpoint;
+    }
+    else
+    {
+        return false;
+    }
+
+    this->_stopAddress = pc;
+    this->_isStepping = false;
+    this->_isBreakPending = false;
+    this->update();
+    return true;
+}
+
+void Debugger::onAccess(WatchType type, uint16_t address)
+{
+    if (this->_stopReason != StopReason::None)
+    {
+        return;
+    }
+
+    for (int i = 0; i < this->_watchpointCount; i++)
+    {
+        Watchpoint* watchpoint = &this->_watchpoints[i];
+        if ((watchpoint->Types & type) != 0 && address >= watchpoint->Start && address <= watchpoint->End)
+        {
+            switch (type)
+            {
+            case WatchRead:
+                this->_stopReason = StopReason::Read;
+                break;
+            case WatchWrite:
+                this->_stopReason = StopReason::Write;
+                break;
+            case WatchInput:
+                this->_stopReason = StopReason::Input;
+                break;
+            case WatchOutput:
+                this->_stopReason = StopReason::Output;
+                break;
+            }
+            this->_stopAddress = address;
+            return;
+        }
+    }
+}
+
+void Debugger::update()
+{
+    this->ReadSlots = 0;
+    this->WriteSlots = 0;
+    this->IsWatchingPorts = false;
+    for (int i = 0; i < this->_watchpointCount; i++)
+    {
+        Watchpoint* watchpoint = &this->_watchpoints[i];
+        uint8_t slots = 0;
+        for (int slot = watchpoint->Start >> 14; slot <= watchpoint->End >> 14; slot++)
+        {
+            slots |= 1 << slot;
+        }
+
+        if ((watchpoint->Types & WatchRead) != 0)
+        {
+            this->ReadSlots |= slots;
+        }
+        if ((watchpoint->Types & WatchWrite) != 0)
+        {
+            this->WriteSlots |= slots;
+        }
+        if ((watchpoint->Types & (WatchInput | WatchOutput)) != 0)
+        {
+            this->IsWatchingPorts = true;
+        }
+    }
+
+    this->_isArmed = this->_breakpointCount != 0 || this->_watchpointCount != 0
+        || this->_isStepping || this->_isBreakPending;
+    if (!this->_isArmed)
+    {
+        this->_isResuming = false;
+    }
+}
+
+#endif
@@ -0,0 +1,362 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "DirectoryIndex.h"
+#include "snasnapshot.h"
+
+// Names pool of a page grows by this step
+#define NAMES_STEP 1024
+
+using namespace zx;
+
+// First 4 characters in lower case, so that most comparisons do not need the names
+static uint32_t makeSortKey(const char* name)
+{
+    uint32_t key = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        key <<= 8;
+        if (*name != '\0')
+        {
+            key |= (uint8_t)tolower((uint8_t)*name);
+            name++;
+        }
+    }
+
+    return key;
+}
+
+// Parent folder first, then folders, then files, each alphabetically
+static int compareEntries(const DirectoryEntry* entry1, const char* name1, const DirectoryEntry* entry2, const char* name2)
+{
+    int flags1 = entry1->Flags & (ENTRY_PARENT | ENTRY_FOLDER);
+    int flags2 = entry2->Flags & (ENTRY_PARENT | ENTRY_FOLDER);
+    if (flags1 != flags2)
+    {
+        return flags2 - flags1;
+    }
+
+    if (entry1->SortKey != entry2->SortKey)
+    {
+        return entry1->SortKey < entry2->SortKey ? -1 : 1;
+    }
+
+    return strcasecmp(name1, name2);
+}
+
+static bool hasExtension(const TCHAR* name, const char* extension)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(&name[length - 4], extension) == 0;
+}
+
+static DirectoryEntry* _sortEntries;
+static const char* _sortNames;
+
+static int slotCompare(const void* a, const void* b)
+{
+    uint8_t slot1 = *(uint8_t*)a;
+    uint8_t slot2 = *(uint8_t*)b;
+    return compareEntries(&_sortEntries[slot1], &_sortNames[slot1 * DIRECTORY_NAME_SIZE],
+        &_sortEntries[slot2], &_sortNames[slot2 * DIRECTORY_NAME_SIZE]);
+}
+
+void DirectoryIndex::Initialize(uint16_t pageSize, uint8_t* workBuffer, uint32_t workBufferSize)
+{
+    uint32_t maxPageSize = workBufferSize / DIRECTORY_NAME_SIZE;
+    if (maxPageSize > 256)
+    {
+        maxPageSize = 256;
+    }
+    if (pageSize > maxPageSize)
+    {
+        ESP_LOGE(TAG, "Directory page of %u entries cut to %u", pageSize, (unsigned)maxPageSize);
+        pageSize = maxPageSize;
+    }
+
+    this->_pageSize = pageSize;
+    this->_workBuffer = workBuffer;
+    this->_entries = (DirectoryEntry*)malloc(pageSize * sizeof(DirectoryEntry));
+    this->_candidates = (DirectoryEntry*)malloc(pageSize * sizeof(DirectoryEntry));
+    this->_order = (uint8_t*)malloc(pageSize);
+}
+
+bool DirectoryIndex::IsValid(const char* path)
+{
+    return this->_isValid && strcmp(this->_path, path) == 0;
+}
+
+void DirectoryIndex::Invalidate()
+{
+    this->_count = 0;
+    this->_pageStart = 0;
+    this->_totalCount = 0;
+    this->_isValid = false;
+}
+
+bool DirectoryIndex::Load(const char* path)
+{
+    this->Invalidate();
+
+    strncpy(this->_path, path, sizeof(this->_path) - 1);
+    this->_path[sizeof(this->_path) - 1] = '\0';
+
+    return this->loadPage(nullptr, nullptr, true);
+}
+
+bool DirectoryIndex::LoadNextPage()
+{
+    if (!this->_isValid || !this->HasNextPage() || this->_count == 0)
+    {
+        return false;
+    }
+
+    // Page is rebuilt in place, so the cursor is copied first
+    DirectoryEntry cursor = this->_entries[this->_count - 1];
+    char cursorName[DIRECTORY_NAME_SIZE];
+    strcpy(cursorName, this->GetName(this->_count - 1));
+    return this->loadPage(&cursor, cursorName, true);
+}
+
+bool DirectoryIndex::LoadPreviousPage()
+{
+    if (!this->_isValid || !this->HasPreviousPage() || this->_count == 0)
+    {
+        return false;
+    }
+
+    DirectoryEntry cursor = this->_entries[0];
+    char cursorName[DIRECTORY_NAME_SIZE];
+    strcpy(cursorName, this->GetName(0));
+    return this->loadPage(&cursor, cursorName, false);
+}
+
+// Candidates are kept in a heap with the one furthest from the cursor on top
+void DirectoryIndex::addCandidate(DirectoryEntry* entry, const char* name, uint16_t* heapCount, int8_t sign)
+{
+    uint8_t* heap = this->_order;
+    uint16_t count = *heapCount;
+    uint16_t position;
+
+    if (count < this->_pageSize)
+    {
+        // New slot, sift up
+        uint8_t slot = count;
+        this->_candidates[slot] = *entry;
+        strcpy(this->workName(slot), name);
+
+        position = count;
+        while (position > 0)
+        {
+            uint16_t parent = (position - 1) / 2;
+            if (sign * compareEntries(&this->_candidates[heap[parent]], this->workName(heap[parent]),
+                &this->_candidates[slot], this->workName(slot)) >= 0)
+            {
+                break;
+            }
+            heap[position] = heap[parent];
+            position = parent;
+        }
+        heap[position] = slot;
+        *heapCount = count + 1;
+        return;
+    }
+
+    // Full, replace the top if the new one is closer to the cursor
+    uint8_t top = heap[0];
+    if (sign * compareEntries(entry, name, &this->_candidates[top], this->workName(top)) >= 0)
+    {
+        return;
+    }
+
+    this->_candidates[top] = *entry;
+    strcpy(this->workName(top), name);
+
+    // Sift down
+    position = 0;
+    while (true)
+    {
+        uint16_t child = position * 2 + 1;
+        if (child >= count)
+        {
+            break;
+        }
+        if (child + 1 < count
+            && sign * compareEntries(&this->_candidates[heap[child + 1]], this->workName(heap[child + 1]),
+                &this->_candidates[heap[child]], this->workName(heap[child])) > 0)
+        {
+            child++;
+        }
+        if (sign * compareEntries(&this->_candidates[heap[child]], this->workName(heap[child]),
+            &this->_candidates[top], this->workName(top)) <= 0)
+        {
+            break;
+        }
+        heap[position] = heap[child];
+        position = child;
+    }
+    heap[position] = top;
+}
+
+bool DirectoryIndex::loadPage(const DirectoryEntry* cursor, const char* cursorName, bool isForward)
+{
+    int8_t sign = isForward ? 1 : -1;
+    uint16_t heapCount = 0;
+    uint32_t totalCount = 0;
+    uint32_t skippedCount = 0;
+
+    FF_DIR folder;
+    FILINFO fileInfo;
+    FRESULT fr = f_opendir(&folder, (const TCHAR*)this->_path);
+    if (fr != FR_OK)
+    {
+        this->Invalidate();
+        return false;
+    }
+
+    DirectoryEntry entry;
+
+    // Subfolders start with the parent folder
+    bool isParentPending = strcmp(this->_path, "/") != 0 && this->_path[0] != '\0';
+
+    while (true)
+    {
+        const char* name;
+        if (isParentPending)
+        {
+            isParentPending = false;
+            name = "..";
+            entry.Flags = ENTRY_FOLDER | ENTRY_PARENT;
+            entry.Model = SnapshotModel::NotRead;
+            entry.SortKey = 0;
+            entry.Size = 0;
+            entry.Date = 0;
+            entry.Time = 0;
+        }
+        else
+        {
+            fr = f_readdir(&folder, &fileInfo);
+            if (fr != FR_OK || fileInfo.fname[0] == 0)
+            {
+                break;
+            }
+
+            name = fileInfo.fname;
+            if (fileInfo.fattrib & (AM_HID | AM_SYS))
+            {
+                continue;
+            }
+
+            if (strlen(name) >= DIRECTORY_NAME_SIZE)
+            {
+                ESP_LOGI(TAG, "Name too long: %s", name);
+                continue;
+            }
+
+            if (fileInfo.fattrib & AM_DIR)
+            {
+                entry.Flags = ENTRY_FOLDER;
+                entry.Model = SnapshotModel::NotRead;
+            }
+            else if (hasExtension(name, ".z80") || hasExtension(name, ".tap")
+                || hasExtension(name, ".tzx")
+                || hasExtension(name, ".rzx"))
+            {
+                entry.Flags = 0;
+                entry.Model = SnapshotModel::NotRead;
+            }
+            else if (hasExtension(name, ".sna"))
+            {
+                // Model of .sna is known from the size
+                entry.Flags = 0;
+                entry.Model = GetSnaSnapshotModel(fileInfo.fsize);
+            }
+            else
+            {
+                continue;
+            }
+
+            entry.SortKey = makeSortKey(name);
+            entry.Size = fileInfo.fsize;
+            entry.Date = fileInfo.fdate;
+            entry.Time = fileInfo.ftime;
+        }
+
+        totalCount++;
+        if (cursor != nullptr
+            && sign * compareEntries(&entry, name, cursor, cursorName) <= 0)
+        {
+            // Before the cursor in the direction of paging
+            skippedCount++;
+            continue;
+        }
+
+        this->addCandidate(&entry, name, &heapCount, sign);
+    }
+
+    f_closedir(&folder);
+
+    if (fr != FR_OK)
+    {
+        this->Invalidate();
+        return false;
+    }
+
+    // Sort the page
+    _sortEntries = this->_candidates;
+    _sortNames = (const char*)this->_workBuffer;
+    qsort(this->_order, heapCount, 1, slotCompare);
+
+    // Copy names into the pool of the page
+    uint32_t namesSize = 0;
+    for (int i = 0; i < heapCount; i++)
+    {
+        namesSize += strlen(this->workName(this->_order[i])) + 1;
+    }
+    if (namesSize > this->_namesCapacity)
+    {
+        uint32_t capacity = (namesSize + NAMES_STEP - 1) / NAMES_STEP * NAMES_STEP;
+        char* names = (char*)realloc(this->_names, capacity);
+        if (names == nullptr)
+        {
+            ESP_LOGE(TAG, "Not enough memory for directory page");
+            this->Invalidate();
+            return false;
+        }
+        this->_names = names;
+        this->_namesCapacity = capacity;
+    }
+
+    uint32_t nameOffset = 0;
+    for (int i = 0; i < heapCount; i++)
+    {
+        uint8_t slot = this->_order[i];
+        const char* name = this->workName(slot);
+        uint32_t nameSize = strlen(name) + 1;
+
+        this->_entries[i] = this->_candidates[slot];
+        this->_entries[i].NameOffset = nameOffset;
+        memcpy(&this->_names[nameOffset], name, nameSize);
+        nameOffset += nameSize;
+    }
+
+    this->_count = heapCount;
+    this->_totalCount = totalCount;
+    if (isForward)
+    {
+        this->_pageStart = skippedCount;
+    }
+    else
+    {
+        this->_pageStart = totalCount - skippedCount - heapCount;
+    }
+
+    ESP_LOGI(TAG, "Directory page %d-%d of %d", this->_pageStart, this->_pageStart + this->_count, this->_totalCount);
+
+    this->_isValid = true;
+    return true;
+}
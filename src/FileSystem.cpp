@@ -1,18 +1,36 @@
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_vfs_fat.h"
+#include "sdmmc_cmd.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "settings.h"
 #include "FileSystem.h"
 #include "Emulator.h"
 #include "ps2Input.h"
 #include "z80main.h"
+#include "Machine.h"
 #include "z80snapshot.h"
+#include "snasnapshot.h"
 #include "ScreenArea.h"
 #include "errorReadingFile.h"
 #include "File.h"
+#include "FrameCapture.h"
+#include "DirectoryIndex.h"
+#include "PreviewCache.h"
+#include "TapeLoader.h"
+#include "TapePlayer.h"
+#include "RewindBuffer.h"
+#include "InputRecorder.h"
+#include "Profiler.h"
+#include "TraceBuffer.h"
+#include "BatchRunner.h"
 
 using namespace zx;
 
@@ -23,22 +41,82 @@ using namespace zx;
 #define MAX_LFN 90
 #define FORE_COLOR (DEBUG_BAND_COLORS >> 8)
 #define BACK_COLOR (DEBUG_BAND_COLORS & 0xFF)
+#define MAX_PATH (sizeof(SDCARD_PATH) + DIRECTORY_PATH_SIZE + DIRECTORY_NAME_SIZE + 1)
+#define FILES_PER_PAGE ((DEBUG_ROWS - 1) * FILE_COLUMNS)
+// Names of a page are sorted in _buffer16K_2, 171 of them take 15561 bytes
+static_assert(FILES_PER_PAGE * DIRECTORY_NAME_SIZE <= 0x4000, "Directory page does not fit into _buffer16K_2");
+
+// Previews for the selection and these neighbours in the direction of movement are loaded ahead
+#define PREFETCH_AHEAD 2
+#define PREFETCH_BEHIND 1
 
 extern VideoController* Screen;
 extern ScreenArea DebugScreen;
 
-typedef TCHAR FileName[MAX_LFN + 1];
-
-static FileName* _fileNames = (FileName*)_buffer16K_2;
+static DirectoryIndex _index;
+static PreviewCache _previews;
+
+// Preview loader task does all SD card reads while files are browsed
+static TaskHandle_t _previewLoaderTask;
+static SemaphoreHandle_t _previewMutex;
+static SemaphoreHandle_t _sdCardMutex;
+static volatile uint32_t _previewRequest = 0;
+static volatile int16_t _previewSelection = -1;
+static volatile int8_t _previewDirection = 1;
+static volatile bool _isPreviewLoaded = false;
+static volatile bool _isPreviewFailed = false;
+static volatile int16_t _previewFillIndex;
+static PreviewRecord* _loaderRecord;
+static uint8_t _loaderBuffer[0x400];
+static TCHAR _loaderPath[MAX_PATH];
+
+static void previewLoaderTaskMain(void* unused);
 static int16_t _selectedFile = 0;
 static int16_t _fileCount;
 static bool _loadingSnapshot = false;
 static bool _savingSnapshot = false;
 static char* _snapshotName = ((char*)_buffer16K_1) + MAX_LFN;
 
-static char _rootFolder[MAX_LFN];
+static char _rootFolder[MAX_PATH];
 static int _rootFolderLength;
 
+// Folder being browsed, as a path on the SD card
+static char _folder[DIRECTORY_PATH_SIZE];
+
+static int _captureIndex = 0;
+
+// Capture task renders and writes a copy of the screen taken at the end of a frame
+static TaskHandle_t _captureTask;
+static SpectrumScreenData _capturedScreen = { nullptr, nullptr };
+static uint8_t _capturedBorderColor;
+static volatile bool _isCapturePending = false;
+static uint8_t _captureBuffer[CAPTURE_BUFFER_SIZE];
+#ifdef CAPTURE_FRAMES
+// Golden set: list.txt names its snapshots, golden.txt keeps hashes per snapshot and frames since it was loaded
+#define GOLDEN_FOLDER "/golden"
+// Captures compared for each snapshot of the list
+#define GOLDEN_CAPTURES 4
+static uint32_t _framesSinceLoad = 0;
+static uint32_t _capturedFrame;
+static char _loadedSnapshot[MAX_PATH] = "boot";
+static char _capturedSnapshot[MAX_PATH];
+static int _goldenPassed = 0;
+static int _goldenFailed = 0;
+// Lines of list.txt loaded so far
+#define GOLDEN_NONE -1
+#define GOLDEN_DONE -2
+static int _goldenLine = 0;
+static char _goldenPath[MAX_PATH];
+#endif
+static void captureTaskMain(void* unused);
+static int _recordingIndex = 0;
+#ifdef PROFILER
+static int _profileIndex = 0;
+#endif
+#ifdef TRACE_INSTRUCTIONS
+static int _traceIndex = 0;
+#endif
+
 static esp_vfs_fat_sdmmc_mount_config_t _mount_config;
 static sdmmc_host_t _host = SDSPI_HOST_DEFAULT();
 static sdspi_device_config_t _slot_config;
@@ -50,7 +128,9 @@ void FileSystemInitialize()
 
     _mount_config = {
         .format_if_mount_failed = false,
-        .max_files = 1,
+        // Inserted tape is open in the loader and in the player, next to snapshots, previews
+        // and a screen capture written by its task
+        .max_files = 5,
         .allocation_unit_size = 16 * 1024
     };
 
@@ -72,11 +152,17 @@ void FileSystemInitialize()
     _slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
     _slot_config.gpio_cs = PIN_NUM_CS;
     _slot_config.host_id = hostID;
-}
 
-static FRESULT mount()
-{
-	return esp_vfs_fat_sdspi_mount(SDCARD_PATH, &_host, &_slot_config, &_mount_config, &_card) == ESP_OK ? FR_OK : FR_NOT_READY;
+    _previews.Initialize(SDCARD_PATH "/.previews");
+    _index.Initialize(FILES_PER_PAGE, _buffer16K_2, 0x4000);
+    _loaderRecord = (PreviewRecord*)malloc(sizeof(PreviewRecord));
+    _previewMutex = xSemaphoreCreateMutex();
+    _sdCardMutex = xSemaphoreCreateMutex();
+    Tape.Initialize(_sdCardMutex);
+    Player.Initialize(_sdCardMutex);
+    Recorder.Initialize(_sdCardMutex, _buffer16K_1, _buffer16K_2);
+    xTaskCreate(previewLoaderTaskMain, "previewLoader", 4096, nullptr, 1, &_previewLoaderTask);
+    xTaskCreate(captureTaskMain, "capture", 4096, nullptr, 1, &_captureTask);
 }
 
 static void unmount()
@@ -88,43 +174,87 @@ static void unmount()
 	}
 }
 
+// SD card stays mounted, it is mounted again only after it was removed or replaced
+static FRESULT mount()
+{
+	if (_card != nullptr)
+	{
+		if (sdmmc_get_status(_card) == ESP_OK)
+		{
+			return FR_OK;
+		}
+
+		ESP_LOGI(TAG, "SD card removed");
+		unmount();
+		_index.Invalidate();
+	}
+
+	if (esp_vfs_fat_sdspi_mount(SDCARD_PATH, &_host, &_slot_config, &_mount_config, &_card) != ESP_OK)
+	{
+		_card = nullptr;
+		return FR_NOT_READY;
+	}
+
+	return FR_OK;
+}
+
+// Next free <prefix>NNN<extension> on the SD card, searched from index. Caller holds the SD card mutex,
+// false when all 1000 names are used.
+static bool nextFreeName(char* fileName, const char* prefix, const char* extension, int* index)
+{
+	File file;
+	while (*index < 1000)
+	{
+		sprintf(fileName, SDCARD_PATH "/%s%03d%s", prefix, (*index)++, extension);
+		file.open(fileName, ios_base::in);
+		if (!file.is_open())
+		{
+			return true;
+		}
+		file.close();
+	}
+
+	// Searched again from the start next time, in case some were deleted
+	*index = 0;
+	ESP_LOGE(TAG, "No free name for %s%s, all 1000 are used", prefix, extension);
+	return false;
+}
+
 static void GetFileCoord(uint16_t fileIndex, uint8_t* x, uint8_t* y)
 {
 	*x = fileIndex / (DEBUG_ROWS - 1) * (FILE_COLUMNWIDTH + 1);
 	*y = 1 + fileIndex % (DEBUG_ROWS - 1);
 }
 
-static TCHAR* GetFileName(TCHAR* fileName)
+static bool hasExtension(const TCHAR* fileName, const char* extension)
+{
+	const TCHAR* fileExtension = strrchr(fileName, '.');
+	return fileExtension != nullptr && strcasecmp(fileExtension, extension) == 0;
+}
+
+static TCHAR* GetFilePath(TCHAR* result, const TCHAR* fileName)
 {
-	TCHAR* result = (TCHAR*)_buffer16K_1;
     strncpy(result, _rootFolder, _rootFolderLength);
 	strncpy(result + _rootFolderLength, fileName, MAX_LFN);
 
     return result;
 }
 
-static TCHAR* FileExtension(TCHAR* fileName)
+static TCHAR* GetFileName(TCHAR* fileName)
 {
-	TCHAR* result = (TCHAR*)_buffer16K_1;
-	memcpy(result, fileName, MAX_LFN);
-	result[MAX_LFN] = '\0';
-
-	result[MAX_LFN - 1] = '\0';
-	char* extension = strrchr(result, '.');
-    if (extension != nullptr)
-    {
-        for(int i = 0; extension[i]; i++)
-        {
-            extension[i] = tolower(extension[i]);
-        }
-    }
-    else
-    {
-    	result[0] = '\0';
-        extension = result;
-    }
+	return GetFilePath((TCHAR*)_buffer16K_1, fileName);
+}
 
-    return extension;
+static void setRootFolder(const char* folder)
+{
+	strcpy(_rootFolder, SDCARD_PATH);
+	strcat(_rootFolder, folder);
+	_rootFolderLength = strlen(_rootFolder);
+	if (_rootFolder[_rootFolderLength - 1] != '/')
+	{
+		_rootFolder[_rootFolderLength++] = '/';
+		_rootFolder[_rootFolderLength] = '\0';
+	}
 }
 
 static TCHAR* TruncateFileName(TCHAR* fileName)
@@ -143,96 +273,360 @@ static TCHAR* TruncateFileName(TCHAR* fileName)
 	return result;
 }
 
+static TCHAR* GetDisplayName(uint16_t fileIndex)
+{
+	DirectoryEntry* entry = _index.GetEntry(fileIndex);
+	TCHAR* name = (TCHAR*)_index.GetName(fileIndex);
+	if ((entry->Flags & ENTRY_FOLDER) == 0)
+	{
+		return TruncateFileName(name);
+	}
+
+	// Folders are shown with a slash in front, and without removing extension
+	TCHAR* result = (TCHAR*)_buffer16K_1;
+	if (entry->Flags & ENTRY_PARENT)
+	{
+		strcpy(result, name);
+	}
+	else
+	{
+		result[0] = '/';
+		strncpy(&result[1], name, FILE_COLUMNWIDTH - 1);
+		result[FILE_COLUMNWIDTH] = '\0';
+	}
+
+	return result;
+}
+
 static void noScreenshot()
 {
 	// Error reading selected file
 	Screen->ShowScreenshot(errorReadingFile, 0);
 }
 
-static void SetSelection(uint8_t selectedFile)
+// Decodes preview from .scr file with the same name, or from the snapshot itself, in the loader task
+static bool readPreview(TCHAR* fileName, DirectoryEntry* entry, PreviewRecord* record)
 {
-	if (_fileCount == 0)
+	File file;
+
+	// Try to open file with the same name and .SCR extension
+	TCHAR* scrFileName = (TCHAR*)_loaderBuffer;
+	strncpy(scrFileName, fileName, MAX_PATH);
+	TCHAR* extension = strrchr(scrFileName, '.');
+	if (extension != nullptr)
 	{
-		return;
+		strncpy(extension, ".scr", 5);
+		file.open(scrFileName, ios_base::in);
+		if (file.is_open())
+		{
+			bool result = file.read(record->Screen, PREVIEW_SIZE) == PREVIEW_SIZE;
+			record->BorderColor = 0;
+			file.close();
+			return result;
+		}
 	}
 
-	_selectedFile = selectedFile;
+	if (entry->Model == SnapshotModel::Unknown)
+	{
+		return false;
+	}
 
-	uint8_t x, y;
-	GetFileCoord(selectedFile, &x, &y);
-	for (uint8_t i = x; i < x + FILE_COLUMNWIDTH; i++)
+	bool result = false;
+	file.open(fileName, ios_base::in);
+	if (file.is_open() && hasExtension(fileName, ".tap"))
 	{
-		DebugScreen.SetAttribute(i, y, BACK_COLOR, FORE_COLOR); // inverse
+		// Loading screen of the tape, if there is one
+		result = TapeLoader::ReadScreen(&file, record->Screen);
+		record->BorderColor = 0;
+		file.close();
 	}
+	else if (file.is_open() && (hasExtension(fileName, ".tzx") || hasExtension(fileName, ".rzx")))
+	{
+		// Tape and input recording have no preview
+		file.close();
+	}
+	else if (file.is_open())
+	{
+		if (entry->Model == SnapshotModel::NotRead)
+		{
+			size_t bytesRead = file.read(_loaderBuffer, Z80_HEADER_SIZE);
+			entry->Model = GetZ80SnapshotModel(_loaderBuffer, bytesRead);
+			file.seek(0, ios_base::beg);
+		}
 
-	FRESULT fr;
+		// Screen decoding needs only the header and one chunk of the buffer
+		if (entry->Model == SnapshotModel::Unknown)
+		{
+			result = false;
+		}
+		else if (hasExtension(fileName, ".sna"))
+		{
+			result = ReadScreenFromSnaSnapshot(&file, record->Screen, &record->BorderColor);
+		}
+		else
+		{
+			result = ReadScreenFromZ80Snapshot(&file, _loaderBuffer, record->Screen, &record->BorderColor);
+		}
+		file.close();
+	}
 
-	// Show screenshot for the selected file
-	fr = mount();
-	if (fr == FR_OK)
+	return result;
+}
+
+// Loads preview for one file into RAM, returns false if it is not available
+static bool loadPreview(int16_t fileIndex, bool isCacheOnly)
+{
+	// Directory index can be reloaded only while the SD card is not in use
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	if (fileIndex < 0 || fileIndex >= _index.Count())
 	{
-		File file;
-		bool scrFileFound = false;
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	DirectoryEntry* entry = _index.GetEntry(fileIndex);
+	if (entry->Flags & ENTRY_FOLDER)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	GetFilePath(_loaderPath, _index.GetName(fileIndex));
+	PreviewKey key;
+	PreviewCache::MakeKey(_loaderPath, entry, &key);
 
-		TCHAR* fileName = GetFileName(_fileNames[selectedFile]);
+	xSemaphoreTake(_previewMutex, portMAX_DELAY);
+	bool isLoaded = _previews.Find(&key) != nullptr;
+	xSemaphoreGive(_previewMutex);
+	if (isLoaded)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return true;
+	}
 
-		// Try to open file with the same name and .SCR extension
-		TCHAR* scrFileName = (TCHAR*)&_buffer16K_1[_rootFolderLength + MAX_LFN + 1];
-		strncpy(scrFileName, fileName, MAX_LFN + 1);
-		TCHAR* extension = strrchr(scrFileName, '.');
-		if (extension != nullptr)
+	bool result;
+	if (isCacheOnly)
+	{
+		// Only make sure the cache file has it
+		result = _previews.Contains(&key);
+		if (!result)
+		{
+			_loaderRecord->Key = key;
+			result = readPreview(_loaderPath, entry, _loaderRecord) && _previews.Store(_loaderRecord);
+		}
+	}
+	else
+	{
+		result = _previews.Read(&key, _loaderRecord);
+		if (!result)
 		{
-			strncpy(extension, ".scr", 5);
-			file.open(scrFileName, ios_base::in);
-			if (file.is_open())
+			_loaderRecord->Key = key;
+			result = readPreview(_loaderPath, entry, _loaderRecord);
+			if (result)
 			{
-				if (!LoadScreenshot(&file, _buffer16K_1))
-				{
-					noScreenshot();
-				}
-				file.close();
-				scrFileFound = true;
+				_previews.Store(_loaderRecord);
 			}
 		}
+	}
+	xSemaphoreGive(_sdCardMutex);
+
+	if (result && !isCacheOnly)
+	{
+		xSemaphoreTake(_previewMutex, portMAX_DELAY);
+		_previews.Put(_loaderRecord);
+		xSemaphoreGive(_previewMutex);
+	}
+
+	return result;
+}
+
+static void previewLoaderTaskMain(void* unused)
+{
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-		if (!scrFileFound)
+		// Each new request cancels whatever is left from the previous one
+		uint32_t request;
+		do
 		{
-			file.open(fileName, ios_base::in);
-			if (file.is_open())
+			request = _previewRequest;
+			int16_t selection = _previewSelection;
+			int8_t direction = _previewDirection;
+			if (selection < 0)
 			{
-				if (!LoadScreenFromZ80Snapshot(&file, _buffer16K_1))
-				{
-					noScreenshot();
-				}
-				file.close();
-                _ay3_8912.Clear();
+				break;
 			}
-		}
 
-		unmount();
+			bool result = loadPreview(selection, false);
+			if (request != _previewRequest)
+			{
+				// Selection moved on while loading
+				continue;
+			}
+
+			if (result)
+			{
+				_isPreviewLoaded = true;
+			}
+			else
+			{
+				_isPreviewFailed = true;
+			}
+
+			for (int i = 1; i <= PREFETCH_AHEAD && request == _previewRequest; i++)
+			{
+				loadPreview(selection + direction * i, false);
+			}
+			for (int i = 1; i <= PREFETCH_BEHIND && request == _previewRequest; i++)
+			{
+				loadPreview(selection - direction * i, false);
+			}
+
+			// Fill the cache file with missing previews while nothing else is needed
+			while (_previewFillIndex < _index.Count() && request == _previewRequest)
+			{
+				loadPreview(_previewFillIndex++, true);
+			}
+		} while (request != _previewRequest);
+	}
+}
+
+static void requestPreview(int16_t selectedFile, int8_t direction)
+{
+	_previewSelection = selectedFile;
+	_previewDirection = direction;
+	_previewRequest++;
+	xTaskNotifyGive(_previewLoaderTask);
+}
+
+static void stopPreviewLoader()
+{
+	_previewSelection = -1;
+	_previewRequest++;
+}
+
+// Shows preview of the selected file from RAM, returns false if it is not loaded yet
+static bool showPreview(int16_t selectedFile)
+{
+	if (selectedFile >= _index.Count())
+	{
+		return false;
+	}
+
+	PreviewKey key;
+	TCHAR* fileName = GetFileName((TCHAR*)_index.GetName(selectedFile));
+	PreviewCache::MakeKey(fileName, _index.GetEntry(selectedFile), &key);
+
+	xSemaphoreTake(_previewMutex, portMAX_DELAY);
+	PreviewRecord* record = _previews.Find(&key);
+	if (record != nullptr)
+	{
+		Screen->ShowScreenshot(record->Screen, record->BorderColor);
+	}
+	xSemaphoreGive(_previewMutex);
+
+	return record != nullptr;
+}
+
+static void SetSelection(uint8_t selectedFile, int8_t direction)
+{
+	if (_fileCount == 0)
+	{
+		return;
+	}
+
+	_selectedFile = selectedFile;
+
+	uint8_t x, y;
+	GetFileCoord(selectedFile, &x, &y);
+	for (uint8_t i = x; i < x + FILE_COLUMNWIDTH; i++)
+	{
+		DebugScreen.SetAttribute(i, y, BACK_COLOR, FORE_COLOR); // inverse
 	}
+
+	// Preview is shown from RAM, or later when the loader task has read it
+	_isPreviewLoaded = false;
+	_isPreviewFailed = false;
+	showPreview(selectedFile);
+	requestPreview(selectedFile, direction);
+}
+
+#ifdef CAPTURE_FRAMES
+// Before loading, the file name is in the buffer used for loading
+static void onSnapshotLoad(const TCHAR* fileName)
+{
+	// Frames since the load are whole frames in FLASH phase
+	_framesSinceLoad = 0;
+	Spectrum.Environment.TStates = 0;
+	zx_resetFlash();
+	strncpy(_loadedSnapshot, fileName + _rootFolderLength, sizeof(_loadedSnapshot) - 1);
+	_loadedSnapshot[sizeof(_loadedSnapshot) - 1] = '\0';
 }
+#endif
 
 static void loadSnapshot(const TCHAR* fileName)
 {
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
 	FRESULT fr = mount();
-	if (fr == FR_OK)
+	if (fr == FR_OK && hasExtension(fileName, ".tap"))
+	{
+		// Tape stays open, ROM loads it with LOAD "", custom loaders get the signal
+		Tape.Insert(fileName);
+		Player.Insert(fileName);
+	}
+	else if (fr == FR_OK && hasExtension(fileName, ".tzx"))
+	{
+		// Played as a signal from LOAD "" or F6
+		Tape.Eject();
+		Player.Insert(fileName);
+	}
+	else if (fr == FR_OK && hasExtension(fileName, ".rzx"))
+	{
+		// Snapshot is loaded at the end of the frame, when playback starts
+#ifdef CAPTURE_FRAMES
+		onSnapshotLoad(fileName);
+#endif
+		Recorder.Play(fileName);
+	}
+	else if (fr == FR_OK)
 	{
+		Recorder.Stop();
+#ifdef CAPTURE_FRAMES
+		onSnapshotLoad(fileName);
+#endif
+
 		File file;
 		file.open(fileName, ios_base::in);
 		if (file.is_open())
 		{
-			LoadZ80Snapshot(&file, _buffer16K_1, _buffer16K_2);
+			// File name is in the buffer used for loading
+			bool isSna = hasExtension(fileName, ".sna");
+			int64_t startTime = esp_timer_get_time();
+
+			bool result;
+			if (isSna)
+			{
+				result = LoadSnaSnapshot(&Spectrum, &file, _buffer16K_1);
+			}
+			else
+			{
+				result = LoadZ80Snapshot(&Spectrum, &file, _buffer16K_1);
+			}
 			file.close();
-		}
+			Rewind.NewKeyframe();
 
-		unmount();
+			ESP_LOGI(TAG, "%s snapshot %s in %d ms", isSna ? ".sna" : ".z80",
+				result ? "loaded" : "failed", (int)((esp_timer_get_time() - startTime) / 1000));
+		}
 	}
+	xSemaphoreGive(_sdCardMutex);
 }
 
 static bool saveSnapshot(const TCHAR* fileName)
 {
 	bool result = false;
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
 	FRESULT fr = mount();
 	if (fr == FR_OK)
 	{
@@ -240,33 +634,28 @@ static bool saveSnapshot(const TCHAR* fileName)
 		file.open(fileName, ios_base::out);
 		if (file.is_open())
 		{
-			result = SaveZ80Snapshot(&file, _buffer16K_1, _buffer16K_2);
+			if (hasExtension(fileName, ".sna"))
+			{
+				result = SaveSnaSnapshot(&file, _buffer16K_2);
+			}
+			else
+			{
+				result = SaveZ80Snapshot(&file, _buffer16K_1, _buffer16K_2);
+			}
 			file.close();
 		}
 
-		unmount();
+		// New file is not in the index yet
+		_index.Invalidate();
 	}
+	xSemaphoreGive(_sdCardMutex);
 
 	return result;
 }
 
-static int fileCompare(const void* a, const void* b)
-{
-	TCHAR* file1 = (TCHAR*)_buffer16K_1;
-	for (int i = 0; i <= MAX_LFN; i++){
-		file1[i] = tolower(((TCHAR*)a)[i]);
-	}
-
-	TCHAR* file2 = (TCHAR*)&_buffer16K_1[MAX_LFN + 2];
-	for (int i = 0; i <= MAX_LFN; i++){
-		file2[i] = tolower(((TCHAR*)b)[i]);
-	}
-
-	return strncmp(file1, file2, MAX_LFN + 1);
-}
-
 bool saveSnapshotSetup(const char* path)
 {
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
 	string rootFolder = string(SDCARD_PATH);
 	rootFolder.append(path);
 	strcpy(_rootFolder, rootFolder.c_str());
@@ -278,14 +667,12 @@ bool saveSnapshotSetup(const char* path)
 	showTitle("Save snapshot. ENTER, ESC, BS");
 
 	FRESULT fr = mount();
+	xSemaphoreGive(_sdCardMutex);
 	if (fr != FR_OK)
 	{
 		return false;
 	}
 
-	// Unmount file system
-	unmount();
-
 	DebugScreen.PrintAt(0, 2, "Enter file name:");
 	DebugScreen.SetCursorPosition(0, 3);
 	DebugScreen.ShowCursor();
@@ -327,7 +714,10 @@ bool saveSnapshotLoop()
 		DebugScreen.HideCursor();
 		DebugScreen.PrintAt(0, 5, "Saving...                  ");
         fileName = GetFileName(_snapshotName);
-		strcat(fileName,".z80");
+		if (!hasExtension(fileName, ".sna") && !hasExtension(fileName, ".z80"))
+		{
+			strcat(fileName,".z80");
+		}
 		if (saveSnapshot(fileName))
 		{
 			_savingSnapshot = false;
@@ -368,72 +758,14 @@ bool saveSnapshotLoop()
 	return true;
 }
 
-bool loadSnapshotSetup(const char* path)
+static void showFiles()
 {
-	string rootFolder = string(SDCARD_PATH);
-	rootFolder.append(path);
-	strcpy(_rootFolder, rootFolder.c_str());
-    _rootFolderLength = rootFolder.length();
-
-	saveState();
-
 	DebugScreen.SetPrintAttribute(0x3F10); // white on blue
 	DebugScreen.Clear();
 
-	showTitle("Loading files, please wait...");
-
-	FRESULT fr = mount();
-	if (fr != FR_OK)
-	{
-		return false;
-	}
-
-	uint8_t maxFileCount = (DEBUG_ROWS - 1) * FILE_COLUMNS;
-	_fileCount = 0;
-	bool result = true;
-
-	FF_DIR folder;
-	FILINFO fileInfo;
-	fr = f_opendir(&folder, (const TCHAR*) "/");
-	if (fr == FR_OK)
-	{
-        int fileIndex = 0;
-		while (fileIndex < maxFileCount)
-		{
-			fr = f_readdir(&folder, &fileInfo);
-			if (fr != FR_OK || fileInfo.fname[0] == 0)
-			{
-				result = _fileCount > 0;
-				break;
-			}
-
-            if (fileInfo.fattrib & AM_DIR)
-            {
-                continue;
-            }
-
-            // *.z80
-            if (strncmp(FileExtension((TCHAR*)fileInfo.fname), ".z80", 4) != 0)
-            {
-                continue;
-            }
-
-			memcpy(_fileNames[fileIndex], fileInfo.fname, MAX_LFN + 1);
-
-			_fileCount++;
-            fileIndex++;
-		}
-	}
-	else
-	{
-		result = false;
-	}
-
-	// Sort files alphabetically
+	_fileCount = _index.Count();
 	if (_fileCount > 0)
 	{
-		qsort(_fileNames, _fileCount, MAX_LFN + 1, fileCompare);
-
         for (int y = 1; y < DEBUG_ROWS; y++)
         {
             DebugScreen.PrintAt(FILE_COLUMNWIDTH, y, "\xB3"); // │
@@ -444,26 +776,137 @@ bool loadSnapshotSetup(const char* path)
         for (int fileIndex = 0; fileIndex < _fileCount; fileIndex++)
         {
             GetFileCoord(fileIndex, &x, &y);
-            DebugScreen.PrintAt(x, y, TruncateFileName(_fileNames[fileIndex]));
+            DebugScreen.PrintAt(x, y, GetDisplayName(fileIndex));
         }
 
-        SetSelection(_selectedFile);	
+		if (_selectedFile >= _fileCount)
+		{
+			_selectedFile = _fileCount - 1;
+		}
+		_previewFillIndex = 0;
+        SetSelection(_selectedFile, 1);
     }
 
-	// Unmount file system
-	unmount();
-
-	if (result)
+	char* title = (char*)_buffer16K_1;
+	uint32_t pageCount = (_index.TotalCount() + FILES_PER_PAGE - 1) / FILES_PER_PAGE;
+	if (pageCount > 1)
 	{
-		_loadingSnapshot = true;
+		sprintf(title, "Load %d/%d. ENTER, ESC, BS, PGUP, PGDN",
+			_index.PageStart() / FILES_PER_PAGE + 1, pageCount);
 	}
-
-	showTitle("Load snapshot. ENTER, ESC, \x18, \x19, \x1A, \x1B"); // ↑, ↓, →, ←
-
-	return result;
+	else
+	{
+		strcpy(title, "Load snapshot. ENTER, ESC, BS, \x18, \x19, \x1A, \x1B"); // ↑, ↓, →, ←
+	}
+	showTitle(title);
 }
 
-bool loadSnapshotLoop()
+// Reads the page of the folder, or the first page if page is 0
+static bool loadPage(int8_t page)
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	bool result;
+	if (page > 0)
+	{
+		result = _index.LoadNextPage();
+	}
+	else if (page < 0)
+	{
+		result = _index.LoadPreviousPage();
+	}
+	else
+	{
+		setRootFolder(_folder);
+		result = mount() == FR_OK && _index.Load(_folder);
+	}
+	xSemaphoreGive(_sdCardMutex);
+
+	return result;
+}
+
+static bool openFolder(const char* name)
+{
+	char* separator = strrchr(_folder, '/');
+	if (strcmp(name, "..") == 0)
+	{
+		if (separator != nullptr && separator != _folder)
+		{
+			*separator = '\0';
+		}
+		else
+		{
+			strcpy(_folder, "/");
+		}
+	}
+	else if (strlen(_folder) + strlen(name) + 2 < sizeof(_folder))
+	{
+		if (strcmp(_folder, "/") != 0)
+		{
+			strcat(_folder, "/");
+		}
+		strcat(_folder, name);
+	}
+
+	_selectedFile = 0;
+	if (!loadPage(0))
+	{
+		// Folder is gone, start from the root
+		strcpy(_folder, "/");
+		if (!loadPage(0))
+		{
+			return false;
+		}
+	}
+
+	showFiles();
+	return true;
+}
+
+bool loadSnapshotSetup(const char* path)
+{
+	saveState();
+
+	DebugScreen.SetPrintAttribute(0x3F10); // white on blue
+	DebugScreen.Clear();
+
+	showTitle("Loading files, please wait...");
+
+	if (_folder[0] == '\0')
+	{
+		strncpy(_folder, path, sizeof(_folder) - 1);
+	}
+
+	// Wait for the preview loader to finish with the previous folder
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	FRESULT fr = mount();
+	bool result = fr == FR_OK;
+
+	// Directory is read only when it changed or the SD card was replaced
+	if (result && !_index.IsValid(_folder))
+	{
+		setRootFolder(_folder);
+		result = _index.Load(_folder);
+		if (!result)
+		{
+			strcpy(_folder, "/");
+			result = _index.Load(_folder);
+		}
+	}
+	setRootFolder(_folder);
+	xSemaphoreGive(_sdCardMutex);
+
+	if (!result || _index.TotalCount() == 0)
+	{
+		return false;
+	}
+
+	showFiles();
+	_loadingSnapshot = true;
+
+	return true;
+}
+
+bool loadSnapshotLoop()
 {
 	if (!_loadingSnapshot)
 	{
@@ -471,12 +914,40 @@ bool loadSnapshotLoop()
 	}
 
 	int32_t scanCode = Ps2_GetScancode();
-	if (scanCode == 0 || (scanCode & 0xFF00) == 0xF000)
+	if (scanCode == 0)
+	{
+		// Preview of the selected file was read by the loader task
+		if (_isPreviewLoaded)
+		{
+			_isPreviewLoaded = false;
+			showPreview(_selectedFile);
+			Spectrum.Environment.Ay.Clear();
+		}
+		else if (_isPreviewFailed)
+		{
+			_isPreviewFailed = false;
+			if (_selectedFile < _fileCount && (_index.GetEntry(_selectedFile)->Flags & ENTRY_FOLDER))
+			{
+				// Folders have no preview
+				memset(_buffer16K_1, 0, PREVIEW_SIZE);
+				Screen->ShowScreenshot(_buffer16K_1, 0);
+			}
+			else
+			{
+				noScreenshot();
+			}
+		}
+		return true;
+	}
+
+	if ((scanCode & 0xFF00) == 0xF000)
 	{
 		return true;
 	}
 
 	uint8_t previousSelection = _selectedFile;
+	int8_t direction = 1;
+	int8_t page = 0;
 
 	scanCode &= 0xFFFF;
 	switch (scanCode)
@@ -486,6 +957,12 @@ bool loadSnapshotLoop()
 		{
 			_selectedFile--;
 		}
+		else if (_index.HasPreviousPage())
+		{
+			page = -1;
+			_selectedFile = FILES_PER_PAGE - 1;
+		}
+		direction = -1;
 		break;
 
 	case KEY_DOWNARROW:
@@ -493,6 +970,11 @@ bool loadSnapshotLoop()
 		{
 			_selectedFile++;
 		}
+		else if (_index.HasNextPage())
+		{
+			page = 1;
+			_selectedFile = 0;
+		}
 		break;
 
 	case KEY_LEFTARROW:
@@ -500,6 +982,12 @@ bool loadSnapshotLoop()
 		{
 			_selectedFile -= DEBUG_ROWS - 1;
 		}
+		else if (_index.HasPreviousPage())
+		{
+			page = -1;
+			_selectedFile += (DEBUG_ROWS - 1) * (FILE_COLUMNS - 1);
+		}
+		direction = -1;
 		break;
 
 	case KEY_RIGHTARROW:
@@ -507,21 +995,73 @@ bool loadSnapshotLoop()
 		{
 			_selectedFile += DEBUG_ROWS - 1;
 		}
+		else if (_index.HasNextPage())
+		{
+			page = 1;
+			_selectedFile %= DEBUG_ROWS - 1;
+		}
 		break;
 
+	case KEY_PGUP:
+		if (_index.HasPreviousPage())
+		{
+			page = -1;
+		}
+		direction = -1;
+		break;
+
+	case KEY_PGDN:
+		if (_index.HasNextPage())
+		{
+			page = 1;
+		}
+		break;
+
+	case KEY_BACKSPACE:
+		if (strcmp(_folder, "/") != 0)
+		{
+			openFolder("..");
+		}
+		return true;
+
 	case KEY_ENTER:
 	case KEY_KP_ENTER:
-		loadSnapshot(GetFileName(_fileNames[_selectedFile]));
+		if (_index.GetEntry(_selectedFile)->Flags & ENTRY_FOLDER)
+		{
+			openFolder(_index.GetName(_selectedFile));
+			return true;
+		}
+
+		stopPreviewLoader();
+		loadSnapshot(GetFileName((TCHAR*)_index.GetName(_selectedFile)));
 		_loadingSnapshot = false;
 		restoreState();
 		return false;
 
 	case KEY_ESC:
+		stopPreviewLoader();
 		_loadingSnapshot = false;
 		restoreState();
 		return false;
 	}
 
+	if (page != 0)
+	{
+		// Page of a large folder is read in one pass over the folder
+		DebugScreen.SetPrintAttribute(0x3F10); // white on blue
+		showTitle("Loading files, please wait...");
+		if (!loadPage(page) && !loadPage(0))
+		{
+			stopPreviewLoader();
+			_loadingSnapshot = false;
+			restoreState();
+			return false;
+		}
+
+		showFiles();
+		return true;
+	}
+
 	if (previousSelection == _selectedFile)
 	{
 		return true;
@@ -534,16 +1074,18 @@ bool loadSnapshotLoop()
 		DebugScreen.SetAttribute(i, y, FORE_COLOR, BACK_COLOR);
 	}
 
-	SetSelection(_selectedFile);
+	SetSelection(_selectedFile, direction);
 
 	return true;
 }
 
 bool ReadFromFile(const char* fileName, uint8_t* buffer, size_t size)
 {
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
 	FRESULT fr = mount();
 	if (fr != FR_OK)
 	{
+		xSemaphoreGive(_sdCardMutex);
 		return false;
 	}
 
@@ -561,8 +1103,347 @@ bool ReadFromFile(const char* fileName, uint8_t* buffer, size_t size)
         result = (bytesRead == size);
         file.close();
     }
-
-	unmount();
+	xSemaphoreGive(_sdCardMutex);
 
     return result;
-}
\ No newline at end of file
+}
+
+bool StartInputRecording()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	FRESULT fr = mount();
+	if (fr != FR_OK)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	char fileName[32];
+	if (!nextFreeName(fileName, "input", ".rzx", &_recordingIndex))
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	bool result = Recorder.Record(fileName);
+	xSemaphoreGive(_sdCardMutex);
+
+	return result;
+}
+
+void StopInputRecording()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	Recorder.Stop();
+	xSemaphoreGive(_sdCardMutex);
+}
+
+#ifdef CAPTURE_FRAMES
+static void checkGoldenHash(const char* snapshot, uint32_t frame, uint32_t hash)
+{
+	// "<frame> <hash> <snapshot>" lines, missing ones are added
+	char line[MAX_PATH + 24];
+	File file;
+	file.open(SDCARD_PATH GOLDEN_FOLDER "/golden.txt", ios_base::in);
+	while (file.is_open() && file.getline(line, sizeof(line)))
+	{
+		uint32_t goldenFrame;
+		uint32_t goldenHash;
+		int nameOffset;
+		if (sscanf(line, "%u %x %n", &goldenFrame, &goldenHash, &nameOffset) != 2
+			|| goldenFrame != frame || strcmp(line + nameOffset, snapshot) != 0)
+		{
+			continue;
+		}
+
+		file.close();
+		if (hash == goldenHash)
+		{
+			_goldenPassed++;
+			ESP_LOGI(TAG, "Golden %s frame %u matches (%d passed, %d failed)",
+				snapshot, frame, _goldenPassed, _goldenFailed);
+		}
+		else
+		{
+			_goldenFailed++;
+			ESP_LOGE(TAG, "Golden %s frame %u hash %08x, expected %08x (%d passed, %d failed)",
+				snapshot, frame, hash, goldenHash, _goldenPassed, _goldenFailed);
+		}
+		return;
+	}
+	file.close();
+	file.clear();
+
+	file.open(SDCARD_PATH GOLDEN_FOLDER "/golden.txt", ios_base::out | ios_base::app);
+	if (file.is_open())
+	{
+		size_t length = sprintf(line, "%u %08x %s\n", frame, hash, snapshot);
+		if (file.write((uint8_t*)line, length) == length)
+		{
+			ESP_LOGI(TAG, "Golden %s frame %u recorded", snapshot, frame);
+		}
+		file.close();
+	}
+}
+#endif
+
+static void saveCapturedScreen()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	FRESULT fr = mount();
+	if (fr != FR_OK)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		ESP_LOGE(TAG, "Cannot save screen to SD card");
+		return;
+	}
+
+	char fileName[32];
+	if (!nextFreeName(fileName, "screen", ".ppm", &_captureIndex))
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return;
+	}
+
+	File file;
+	bool result = false;
+	uint32_t hash;
+	file.open(fileName, ios_base::out);
+	if (file.is_open())
+	{
+		result = CaptureFrame(Screen, &_capturedScreen, _capturedBorderColor, &file, _captureBuffer, &hash);
+		file.close();
+	}
+
+	if (result)
+	{
+		ESP_LOGI(TAG, "Saved %s, hash %08x", fileName, hash);
+#ifdef CAPTURE_FRAMES
+		if (_capturedFrame != 0)
+		{
+			checkGoldenHash(_capturedSnapshot, _capturedFrame, hash);
+		}
+#endif
+	}
+	else
+	{
+		ESP_LOGE(TAG, "Cannot save %s", fileName);
+	}
+	xSemaphoreGive(_sdCardMutex);
+}
+
+static void captureTaskMain(void* unused)
+{
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		saveCapturedScreen();
+		_isCapturePending = false;
+	}
+}
+
+// Frame since the snapshot was loaded, 0 when the hash is not compared
+static bool startScreenCapture(uint32_t frame)
+{
+	if (_isCapturePending)
+	{
+		return false;
+	}
+
+	if (_capturedScreen.Pixels == nullptr)
+	{
+		_capturedScreen.Pixels = (uint8_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8);
+		_capturedScreen.Attributes = (uint16_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * sizeof(uint16_t));
+		if (_capturedScreen.Pixels == nullptr || _capturedScreen.Attributes == nullptr)
+		{
+			ESP_LOGE(TAG, "Not enough memory for screen capture");
+			free(_capturedScreen.Pixels);
+			free(_capturedScreen.Attributes);
+			_capturedScreen.Pixels = nullptr;
+			_capturedScreen.Attributes = nullptr;
+			return false;
+		}
+	}
+
+	// Copy takes a few microseconds, rendering and writing happen in the capture task
+	memcpy(_capturedScreen.Pixels, Screen->Settings->Pixels, SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8);
+	memcpy(_capturedScreen.Attributes, Screen->Settings->Attributes, SPECTRUM_WIDTH * SPECTRUM_HEIGHT * sizeof(uint16_t));
+	_capturedBorderColor = *Screen->BorderColor;
+#ifdef CAPTURE_FRAMES
+	_capturedFrame = frame;
+	strcpy(_capturedSnapshot, _loadedSnapshot);
+#endif
+	_isCapturePending = true;
+	xTaskNotifyGive(_captureTask);
+	return true;
+}
+
+bool SaveScreenCapture()
+{
+	return startScreenCapture(0);
+}
+
+#ifdef CAPTURE_FRAMES
+// Loads the snapshot of the next line of list.txt, after the last one logs the result of the set
+static void loadNextGolden()
+{
+	strcpy(_goldenPath, SDCARD_PATH GOLDEN_FOLDER "/");
+	char* name = _goldenPath + strlen(_goldenPath);
+	bool isFound = false;
+
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	if (mount() == FR_OK)
+	{
+		File file;
+		file.open(SDCARD_PATH GOLDEN_FOLDER "/list.txt", ios_base::in);
+		int line = 0;
+		while (file.is_open() && file.getline(name, MAX_PATH - (name - _goldenPath)))
+		{
+			name[strcspn(name, "\r")] = '\0';
+			if (name[0] != '\0' && line++ == _goldenLine)
+			{
+				isFound = true;
+				break;
+			}
+		}
+		file.close();
+	}
+	xSemaphoreGive(_sdCardMutex);
+
+	if (isFound)
+	{
+		_goldenLine++;
+		setRootFolder(GOLDEN_FOLDER);
+		loadSnapshot(_goldenPath);
+	}
+	else if (_goldenLine > 0)
+	{
+		ESP_LOGI(TAG, "Golden set of %d snapshots done, %d passed, %d failed",
+			_goldenLine, _goldenPassed, _goldenFailed);
+		_goldenLine = GOLDEN_DONE;
+	}
+	else
+	{
+		_goldenLine = GOLDEN_NONE;
+	}
+}
+
+void ScreenCaptureOnFrame()
+{
+	if (_goldenLine == GOLDEN_DONE)
+	{
+		// Last snapshot of the set goes on without captures
+		return;
+	}
+
+	if (_goldenLine == 0 || (_goldenLine > 0 && _framesSinceLoad == GOLDEN_CAPTURES * CAPTURE_FRAMES))
+	{
+		loadNextGolden();
+		if (_goldenLine != GOLDEN_NONE)
+		{
+			// Frames are counted from the next one
+			return;
+		}
+	}
+
+	_framesSinceLoad++;
+	if (_framesSinceLoad % CAPTURE_FRAMES != 0)
+	{
+		return;
+	}
+
+	if (_isCapturePending)
+	{
+		// SD card is slower than CAPTURE_FRAMES frames
+		ESP_LOGW(TAG, "Frame %u not captured, previous capture is still being written", _framesSinceLoad);
+		return;
+	}
+
+	startScreenCapture(_framesSinceLoad);
+}
+#endif
+
+#ifdef PROFILER
+bool SaveProfile()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	FRESULT fr = mount();
+	if (fr != FR_OK)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	char fileName[32];
+	if (!nextFreeName(fileName, "prof", ".csv", &_profileIndex))
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	File file;
+	bool result = false;
+	file.open(fileName, ios_base::out);
+	if (file.is_open())
+	{
+		result = Profile.Save(&file);
+		file.close();
+		if (result)
+		{
+			ESP_LOGI(TAG, "Saved %s", fileName);
+		}
+	}
+	Profile.Stop();
+	xSemaphoreGive(_sdCardMutex);
+
+	return result;
+}
+#endif
+
+#ifdef TRACE_INSTRUCTIONS
+bool SaveTrace()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	FRESULT fr = mount();
+	if (fr != FR_OK)
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	char fileName[32];
+	if (!nextFreeName(fileName, "trace", ".txt", &_traceIndex))
+	{
+		xSemaphoreGive(_sdCardMutex);
+		return false;
+	}
+
+	File file;
+	bool result = false;
+	file.open(fileName, ios_base::out);
+	if (file.is_open())
+	{
+		result = Trace.Save(&file);
+		file.close();
+		if (result)
+		{
+			ESP_LOGI(TAG, "Saved %s", fileName);
+		}
+	}
+	xSemaphoreGive(_sdCardMutex);
+
+	return result;
+}
+#endif
+
+#ifdef BATCH_RUNNER
+bool RunBatch()
+{
+	xSemaphoreTake(_sdCardMutex, portMAX_DELAY);
+	bool result = mount() == FR_OK
+		&& Batch.Run(_sdCardMutex, BATCH_RUNNER, SDCARD_PATH "/batch.csv", _buffer16K_1);
+	xSemaphoreGive(_sdCardMutex);
+
+	return result;
+}
+#endif
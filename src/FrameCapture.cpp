@@ -0,0 +1,49 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "settings.h"
+#include "FrameCapture.h"
+
+bool zx::CaptureFrame(VideoController* screen, SpectrumScreenData* screenData, uint8_t borderColor,
+    File* file, uint8_t buffer[CAPTURE_BUFFER_SIZE], uint32_t* hash)
+{
+    uint8_t* line = buffer;
+    uint8_t* rgb = &buffer[SCREEN_WIDTH * 8];
+
+    size_t bytesToWrite = sprintf((char*)rgb, "P6\n%d %d\n255\n", CAPTURE_WIDTH, CAPTURE_HEIGHT);
+    if (file->write(rgb, bytesToWrite) != bytesToWrite)
+    {
+        return false;
+    }
+
+    uint32_t frameHash = 2166136261u;
+    bytesToWrite = CAPTURE_WIDTH * 3;
+    for (unsigned y = 0; y < CAPTURE_HEIGHT; y++)
+    {
+        // Same path as VGA output, where every pixel is doubled
+        DrawSpectrumLine(screen, screenData, borderColor, line, y);
+
+        uint8_t* dest = rgb;
+        for (int x = 0; x < CAPTURE_WIDTH; x++)
+        {
+            // Raw pixel: VSync-HSync-B1-B0-G1-G0-R1-R0
+            uint8_t pixel = VGA_PIXELINROW(line, x * 2);
+            *dest++ = (pixel & 0x03) * 85;
+            *dest++ = ((pixel >> 2) & 0x03) * 85;
+            *dest++ = ((pixel >> 4) & 0x03) * 85;
+        }
+
+        for (uint8_t* value = rgb; value < dest; value++)
+        {
+            frameHash = (frameHash ^ *value) * 16777619u;
+        }
+
+        if (file->write(rgb, bytesToWrite) != bytesToWrite)
+        {
+            return false;
+        }
+    }
+
+    *hash = frameHash;
+    return true;
+}
@@ -0,0 +1,547 @@
+#include "settings.h"
+
+#ifdef GDB_STUB
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "driver/uart.h"
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "esp_log.h"
+
+#include "GdbStub.h"
+#include "Debugger.h"
+#include "z80main.h"
+
+/*
+ Packets are "$<data>#<checksum>", acknowledged with '+'. Ctrl-C (0x03) stops emulation.
+
+ ?               Stop reason, stops emulation if it runs
+ g, G            Read or write all registers, 16-bit little endian each
+ p, P            Read or write one register
+ m, M            Read or write memory
+ c, s            Continue or step, the stop reply is sent when emulation stops
+ Z0-4, z0-4      Set or clear a breakpoint (0, 1) or write, read and access watchpoint (2, 3, 4)
+ D, k            Detach, breakpoints and watchpoints are cleared and emulation continues
+ */
+
+#define GDB_REGISTERS 13
+
+extern Z80Environment& Environment;
+
+GdbStub Gdb;
+
+static uint32_t parseHex(const char** text)
+{
+    uint32_t value = 0;
+    while (true)
+    {
+        char c = **text;
+        if (c >= '0' && c <= '9')
+        {
+            value = (value << 4) | (c - '0');
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            value = (value << 4) | (c - 'a' + 10);
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            value = (value << 4) | (c - 'A' + 10);
+        }
+        else
+        {
+            return value;
+        }
+        (*text)++;
+    }
+}
+
+// Register value from 4 hex digits, low byte first
+static uint16_t parseRegister(const char* text)
+{
+    char digits[5] = { text[2], text[3], text[0], text[1], 0 };
+    const char* value = digits;
+    return parseHex(&value);
+}
+
+#ifdef ESP_PLATFORM
+bool GdbStub::open()
+{
+    uart_config_t config = {};
+    config.baud_rate = GDB_UART_BAUD_RATE;
+    config.data_bits = UART_DATA_8_BITS;
+    config.parity = UART_PARITY_DISABLE;
+    config.stop_bits = UART_STOP_BITS_1;
+    config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    config.source_clk = UART_SCLK_APB;
+    if (uart_driver_install((uart_port_t)GDB_UART, GDB_PACKET_SIZE * 2, 0, 0, nullptr, 0) != ESP_OK
+        || uart_param_config((uart_port_t)GDB_UART, &config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot open UART %d for GDB", GDB_UART);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Waiting for GDB on UART %d", GDB_UART);
+    if (GDB_UART == UART_NUM_0)
+    {
+        // Log lines would break packets
+        esp_log_level_set("*", ESP_LOG_NONE);
+    }
+    return true;
+}
+
+bool GdbStub::accept()
+{
+    size_t length = 0;
+    return uart_get_buffered_data_len((uart_port_t)GDB_UART, &length) == ESP_OK && length > 0;
+}
+
+int GdbStub::receive(char* buffer, int size)
+{
+    // A UART does not notice when GDB goes away, it detaches with D or k
+    int count = uart_read_bytes((uart_port_t)GDB_UART, (uint8_t*)buffer, size, 0);
+    return count < 0 ? 0 : count;
+}
+
+void GdbStub::send(const char* data, int length)
+{
+    uart_write_bytes((uart_port_t)GDB_UART, data, length);
+}
+
+void GdbStub::close()
+{
+}
+#else
+bool GdbStub::open()
+{
+    this->_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->_listener < 0)
+    {
+        return false;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, GDB_SOCKET, sizeof(address.sun_path) - 1);
+    unlink(GDB_SOCKET);
+    if (bind(this->_listener, (sockaddr*)&address, sizeof(address)) != 0
+        || listen(this->_listener, 1) != 0
+        || fcntl(this->_listener, F_SETFL, O_NONBLOCK) != 0)
+    {
+        ESP_LOGE(TAG, "Cannot listen for GDB on %s", GDB_SOCKET);
+        ::close(this->_listener);
+        this->_listener = -1;
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Waiting for GDB on %s", GDB_SOCKET);
+    return true;
+}
+
+bool GdbStub::accept()
+{
+    if (this->_listener < 0)
+    {
+        return false;
+    }
+
+    this->_client = ::accept(this->_listener, nullptr, nullptr);
+    return this->_client >= 0;
+}
+
+int GdbStub::receive(char* buffer, int size)
+{
+    ssize_t count = recv(this->_client, buffer, size, MSG_DONTWAIT);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    return count <= 0 ? -1 : (int)count;
+}
+
+void GdbStub::send(const char* data, int length)
+{
+    ::send(this->_client, data, length, MSG_NOSIGNAL);
+}
+
+void GdbStub::close()
+{
+    ::close(this->_client);
+    this->_client = -1;
+}
+#endif
+
+bool GdbStub::Initialize()
+{
+    return this->open();
+}
+
+bool GdbStub::Poll()
+{
+    if (!this->_isConnected)
+    {
+        if (!this->accept())
+        {
+            return false;
+        }
+
+        // GDB expects a stopped target
+        this->_isConnected = true;
+        this->_isInPacket = false;
+        this->_checksumLeft = 0;
+        this->_isRunning = false;
+        Debug.Break();
+        ESP_LOGI(TAG, "GDB connected");
+    }
+
+    char buffer[256];
+    while (true)
+    {
+        int count = this->receive(buffer, sizeof(buffer));
+        if (count == 0)
+        {
+            break;
+        }
+        if (count < 0)
+        {
+            this->disconnect();
+            return false;
+        }
+
+        for (int i = 0; i < count && this->_isConnected; i++)
+        {
+            this->onByte(buffer[i]);
+        }
+        if (!this->_isConnected)
+        {
+            // Detached
+            return false;
+        }
+    }
+
+    if (this->_isRunning && Debug.IsStopped())
+    {
+        this->replyStop();
+        this->_isRunning = false;
+    }
+
+    return Debug.IsStopped();
+}
+
+void GdbStub::disconnect()
+{
+    this->close();
+    this->_isConnected = false;
+
+    Debug.ClearAll();
+    if (Debug.IsStopped())
+    {
+        Debug.Resume();
+    }
+    ESP_LOGI(TAG, "GDB disconnected");
+}
+
+void GdbStub::onByte(char c)
+{
+    if (this->_checksumLeft > 0)
+    {
+        // The checksum is not checked, a socket or a short cable does not lose data
+        if (--this->_checksumLeft == 0)
+        {
+            this->send("+", 1);
+            this->_packet[this->_length] = '\0';
+            this->onPacket();
+        }
+        return;
+    }
+
+    if (this->_isInPacket)
+    {
+        if (c == '#')
+        {
+            this->_isInPacket = false;
+            this->_checksumLeft = 2;
+        }
+        else if (this->_length < GDB_PACKET_SIZE - 1)
+        {
+            this->_packet[this->_length++] = c;
+        }
+        return;
+    }
+
+    if (c == '$')
+    {
+        this->_isInPacket = true;
+        this->_length = 0;
+    }
+    else if (c == 0x03 && !Debug.IsStopped())
+    {
+        Debug.Break();
+    }
+}
+
+void GdbStub::onPacket()
+{
+    char buffer[GDB_PACKET_SIZE];
+    const char* text = &this->_packet[1];
+
+    switch (this->_packet[0])
+    {
+    case '?':
+        if (Debug.IsStopped())
+        {
+            this->replyStop();
+        }
+        else
+        {
+            Debug.Break();
+            this->_isRunning = true;
+        }
+        break;
+
+    case 'g':
+        this->readRegisters(buffer);
+        this->reply(buffer);
+        break;
+
+    case 'G':
+        for (int i = 0; i < GDB_REGISTERS && strlen(text) >= 4; i++, text += 4)
+        {
+            this->writeRegister(i, parseRegister(text));
+        }
+        this->reply("OK");
+        break;
+
+    case 'p':
+    {
+        int number = parseHex(&text);
+        if (number >= GDB_REGISTERS)
+        {
+            this->reply("E01");
+            break;
+        }
+        this->readRegisters(buffer);
+        buffer[number * 4 + 4] = '\0';
+        this->reply(&buffer[number * 4]);
+        break;
+    }
+
+    case 'P':
+    {
+        int number = parseHex(&text);
+        if (number >= GDB_REGISTERS || *text != '=' || strlen(text) < 5)
+        {
+            this->reply("E01");
+            break;
+        }
+        this->writeRegister(number, parseRegister(text + 1));
+        this->reply("OK");
+        break;
+    }
+
+    case 'm':
+    {
+        uint16_t address = parseHex(&text);
+        text++;
+        uint32_t length = parseHex(&text);
+        if (length > (GDB_PACKET_SIZE - 1) / 2)
+        {
+            length = (GDB_PACKET_SIZE - 1) / 2;
+        }
+        for (uint32_t i = 0; i < length; i++)
+        {
+            sprintf(&buffer[i * 2], "%02x", Environment.PeekByte(address + i));
+        }
+        buffer[length * 2] = '\0';
+        this->reply(buffer);
+        break;
+    }
+
+    case 'M':
+    {
+        uint16_t address = parseHex(&text);
+        text++;
+        uint32_t length = parseHex(&text);
+        text++;
+        for (uint32_t i = 0; i < length && strlen(text) >= 2; i++, text += 2)
+        {
+            char digits[3] = { text[0], text[1], 0 };
+            const char* value = digits;
+            Environment.PokeByte(address + i, parseHex(&value));
+        }
+        this->reply("OK");
+        break;
+    }
+
+    case 'c':
+    case 's':
+        if (*text != '\0')
+        {
+            Z80cpu.PC = parseHex(&text);
+        }
+        Debug.Resume(this->_packet[0] == 's');
+        this->_isRunning = true;
+        break;
+
+    case 'Z':
+    case 'z':
+        this->reply(this->breakpoint(this->_packet[0] == 'Z') ? "OK" : "E01");
+        break;
+
+    case 'D':
+        this->reply("OK");
+        this->disconnect();
+        break;
+
+    case 'k':
+        this->disconnect();
+        break;
+
+    case 'H':
+        this->reply("OK");
+        break;
+
+    case 'q':
+        if (strncmp(text, "Supported", 9) == 0)
+        {
+            sprintf(buffer, "PacketSize=%x", GDB_PACKET_SIZE);
+            this->reply(buffer);
+        }
+        else if (strcmp(text, "Attached") == 0)
+        {
+            this->reply("1");
+        }
+        else
+        {
+            this->reply("");
+        }
+        break;
+
+    default:
+        this->reply("");
+        break;
+    }
+}
+
+void GdbStub::reply(const char* data)
+{
+    char buffer[GDB_PACKET_SIZE + 4];
+    uint8_t checksum = 0;
+    for (const char* c = data; *c != '\0'; c++)
+    {
+        checksum += *c;
+    }
+
+    int length = snprintf(buffer, sizeof(buffer), "$%s#%02x", data, checksum);
+    this->send(buffer, length);
+}
+
+void GdbStub::replyStop()
+{
+    char buffer[32];
+    switch (Debug.GetStopReason())
+    {
+    case StopReason::Write:
+        sprintf(buffer, "T05watch:%04x;", Debug.GetStopAddress());
+        break;
+    case StopReason::Read:
+        sprintf(buffer, "T05rwatch:%04x;", Debug.GetStopAddress());
+        break;
+    default:
+        sprintf(buffer, "S05");
+        break;
+    }
+    this->reply(buffer);
+}
+
+void GdbStub::readRegisters(char* buffer)
+{
+    uint16_t registers[GDB_REGISTERS] =
+    {
+        Z80cpu.AF, Z80cpu.BC, Z80cpu.DE, Z80cpu.HL, Z80cpu.SP, Z80cpu.PC, Z80cpu.IX, Z80cpu.IY,
+        Z80cpu.AFx, Z80cpu.BCx, Z80cpu.DEx, Z80cpu.HLx, (uint16_t)((Z80cpu.I << 8) | Z80cpu.R)
+    };
+
+    for (int i = 0; i < GDB_REGISTERS; i++)
+    {
+        sprintf(&buffer[i * 4], "%02x%02x", registers[i] & 0xFF, registers[i] >> 8);
+    }
+}
+
+void GdbStub::writeRegister(int number, uint16_t value)
+{
+    switch (number)
+    {
+    case 0: Z80cpu.AF = value; break;
+    case 1: Z80cpu.BC = value; break;
+    case 2: Z80cpu.DE = value; break;
+    case 3: Z80cpu.HL = value; break;
+    case 4: Z80cpu.SP = value; break;
+    case 5: Z80cpu.PC = value; break;
+    case 6: Z80cpu.IX = value; break;
+    case 7: Z80cpu.IY = value; break;
+    case 8: Z80cpu.AFx = value; break;
+    case 9: Z80cpu.BCx = value; break;
+    case 10: Z80cpu.DEx = value; break;
+    case 11: Z80cpu.HLx = value; break;
+    case 12:
+        Z80cpu.I = value >> 8;
+        Z80cpu.R = value & 0xFF;
+        break;
+    }
+}
+
+// "type,address,kind" of Z and z packets
+bool GdbStub::breakpoint(bool isSet)
+{
+    const char* text = &this->_packet[1];
+    int type = parseHex(&text);
+    text++;
+    uint16_t address = parseHex(&text);
+    text++;
+    uint32_t length = parseHex(&text);
+    // Ranges past the end of memory stop at 0xFFFF
+    uint32_t last = length > 1 ? address + length - 1 : address;
+    uint16_t end = last > 0xFFFF ? 0xFFFF : last;
+
+    uint8_t types;
+    switch (type)
+    {
+    case 0:
+    case 1:
+        if (!isSet)
+        {
+            Debug.ClearBreakpoint(address);
+            return true;
+        }
+        return Debug.SetBreakpoint(address);
+    case 2:
+        types = WatchWrite;
+        break;
+    case 3:
+        types = WatchRead;
+        break;
+    case 4:
+        types = WatchRead | WatchWrite;
+        break;
+    default:
+        return false;
+    }
+
+    if (!isSet)
+    {
+        Debug.ClearWatchpoint(address, end, types);
+        return true;
+    }
+    return Debug.SetWatchpoint(address, end, types);
+}
+
+#endif
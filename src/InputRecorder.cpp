@@ -0,0 +1,397 @@
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "InputRecorder.h"
+#include "z80snapshot.h"
+#include "Machine.h"
+#include "RewindBuffer.h"
+
+using namespace std;
+
+/*
+ .rzx file starts with a header, followed by blocks
+
+ Offset  Length  Description
+ ---------------------------
+ 0       4       "RZX!"
+ 4       1       Major version, 0
+ 5       1       Minor version, 13
+ 6       4       Flags
+
+ Each block starts with an ID byte and a 4-byte length that includes these 5 bytes.
+
+ ID      Description
+ ---------------------------
+ 0x10    Creator: name (20), major version (2), minor version (2)
+ 0x30    Snapshot: flags (4), extension (4), length (4), snapshot
+ 0x80    Input recording: frame count (4), reserved (1), T-states at start (4), flags (4), frames
+
+ Each frame is a fetch counter (2), number of port reads (2) and the values of the reads.
+ 0xFFFF reads means the same values as in the previous frame.
+
+ Frames are the frames of this emulator. The fetch counter is the number of opcode fetches of
+ the frame as counted by the core, or 0 for the cores that do not count them. A recording only
+ replays exactly on the core it was recorded with, on playback a different fetch count is reported
+ once as a desync.
+ Compressed blocks and snapshots other than .z80 are not supported.
+ */
+
+#define RZX_HEADER_SIZE 10
+#define RZX_BLOCK_HEADER_SIZE 5
+#define RZX_CREATOR_SIZE 29
+#define RZX_SNAPSHOT_HEADER_SIZE 17
+#define RZX_INPUT_HEADER_SIZE 18
+#define RZX_SAME_INPUTS 0xFFFF
+
+// Flags of snapshot and input blocks
+#define RZX_EXTERNAL 0x01
+#define RZX_COMPRESSED 0x02
+
+InputRecorder Recorder;
+
+static void putWord(uint8_t* buffer, uint16_t value)
+{
+    buffer[0] = value & 0xFF;
+    buffer[1] = value >> 8;
+}
+
+static void putDword(uint8_t* buffer, uint32_t value)
+{
+    putWord(buffer, value & 0xFFFF);
+    putWord(buffer + 2, value >> 16);
+}
+
+static uint16_t getWord(uint8_t* buffer)
+{
+    return buffer[0] | (buffer[1] << 8);
+}
+
+static uint32_t getDword(uint8_t* buffer)
+{
+    return getWord(buffer) | (getWord(buffer + 2) << 16);
+}
+
+void InputRecorder::Initialize(SemaphoreHandle_t sdCardMutex, uint8_t buffer1[0x4000], uint8_t buffer2[0x4000])
+{
+    this->_sdCardMutex = sdCardMutex;
+    this->_buffer1 = buffer1;
+    this->_buffer2 = buffer2;
+}
+
+bool InputRecorder::Record(const char* fileName)
+{
+    this->Stop();
+
+    this->_file.open(fileName, ios_base::out);
+    if (!this->_file.is_open())
+    {
+        return false;
+    }
+
+    uint8_t header[RZX_HEADER_SIZE + RZX_CREATOR_SIZE] = { 'R', 'Z', 'X', '!', 0, 13 };
+    uint8_t* creator = &header[RZX_HEADER_SIZE];
+    creator[0] = 0x10;
+    putDword(&creator[1], RZX_CREATOR_SIZE);
+    strncpy((char*)&creator[RZX_BLOCK_HEADER_SIZE], "esp32-z80emu", 20);
+    putWord(&creator[25], 1);
+
+    if (this->_file.write(header, sizeof(header)) != sizeof(header))
+    {
+        this->_file.close();
+        return false;
+    }
+
+    this->_state = RecordPending;
+    ESP_LOGI(TAG, "Recording input to %s", fileName);
+    return true;
+}
+
+bool InputRecorder::Play(const char* fileName)
+{
+    this->Stop();
+
+    this->_file.open(fileName, ios_base::in);
+    if (!this->_file.is_open())
+    {
+        return false;
+    }
+
+    uint8_t header[RZX_HEADER_SIZE];
+    if (this->_file.read(header, RZX_HEADER_SIZE) != RZX_HEADER_SIZE
+        || memcmp(header, "RZX!", 4) != 0)
+    {
+        ESP_LOGE(TAG, "Invalid .rzx file");
+        this->_file.close();
+        return false;
+    }
+
+    this->_state = PlayPending;
+    ESP_LOGI(TAG, "Playing input from %s", fileName);
+    return true;
+}
+
+void InputRecorder::Stop()
+{
+    if (this->_state == Idle)
+    {
+        return;
+    }
+
+    if (this->_state == Recording)
+    {
+        // Length and frame count of the input block
+        this->_file.clear();
+        uint32_t endPosition = this->_file.tellp();
+        uint8_t buffer[4];
+        putDword(buffer, endPosition - this->_blockPosition);
+        this->_file.seek(this->_blockPosition + 1, ios_base::beg);
+        this->_file.write(buffer, 4);
+        putDword(buffer, this->_frameCount);
+        this->_file.write(buffer, 4);
+
+        ESP_LOGI(TAG, "Recorded %d frames", this->_frameCount);
+    }
+    else if (this->_state == Playing)
+    {
+        ESP_LOGI(TAG, "Playback stopped, %d frames left", this->_frameCount);
+    }
+
+    this->_file.close();
+    this->_state = Idle;
+}
+
+void InputRecorder::OnFrame(uint32_t fetchCount)
+{
+    if (this->_state == Idle)
+    {
+        return;
+    }
+
+    xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+
+    bool result = false;
+    switch (this->_state)
+    {
+    case RecordPending:
+        result = this->startRecording();
+        break;
+    case Recording:
+        result = this->writeFrame(fetchCount);
+        break;
+    case PlayPending:
+        result = this->startPlayback();
+        break;
+    case Playing:
+        result = this->readFrame(fetchCount);
+        break;
+    default:
+        break;
+    }
+
+    if (!result)
+    {
+        this->Stop();
+    }
+
+    xSemaphoreGive(this->_sdCardMutex);
+}
+
+bool InputRecorder::startRecording()
+{
+    // Snapshot block, its lengths are known after the snapshot is written
+    uint32_t snapshotPosition = this->_file.tellp();
+    uint8_t header[RZX_INPUT_HEADER_SIZE] = { 0x30 };
+    memcpy(&header[9], "z80", 4);
+    if (this->_file.write(header, RZX_SNAPSHOT_HEADER_SIZE) != RZX_SNAPSHOT_HEADER_SIZE
+        || !zx::SaveZ80Snapshot(&this->_file, this->_buffer1, this->_buffer2))
+    {
+        return false;
+    }
+
+    uint32_t endPosition = this->_file.tellp();
+    putDword(&header[1], endPosition - snapshotPosition);
+    putDword(&header[13], endPosition - snapshotPosition - RZX_SNAPSHOT_HEADER_SIZE);
+    if (!this->_file.seek(snapshotPosition, ios_base::beg)
+        || this->_file.write(header, RZX_SNAPSHOT_HEADER_SIZE) != RZX_SNAPSHOT_HEADER_SIZE
+        || !this->_file.seek(0, ios_base::end))
+    {
+        return false;
+    }
+
+    // Input block, length and frame count are written when recording stops
+    this->_blockPosition = endPosition;
+    memset(header, 0, RZX_INPUT_HEADER_SIZE);
+    header[0] = 0x80;
+    if (this->_file.write(header, RZX_INPUT_HEADER_SIZE) != RZX_INPUT_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    this->_frameCount = 0;
+    this->_current = 0;
+    this->_inputCount[0] = 0;
+    this->_inputCount[1] = RZX_SAME_INPUTS;
+    this->_isOverflow = false;
+    this->_state = Recording;
+    return true;
+}
+
+bool InputRecorder::writeFrame(uint32_t fetchCount)
+{
+    if (this->_isOverflow)
+    {
+        ESP_LOGE(TAG, "More than %d port reads in a frame", RZX_MAX_FRAME_INPUTS);
+        return false;
+    }
+
+    uint8_t* inputs = this->_inputs[this->_current];
+    uint16_t count = this->_inputCount[this->_current];
+    uint8_t previous = this->_current ^ 1;
+    bool isSame = count == this->_inputCount[previous]
+        && memcmp(inputs, this->_inputs[previous], count) == 0;
+
+    uint8_t header[4];
+    putWord(&header[0], fetchCount > 0xFFFF ? 0xFFFF : fetchCount);
+    putWord(&header[2], isSame ? RZX_SAME_INPUTS : count);
+    if (this->_file.write(header, 4) != 4
+        || (!isSame && this->_file.write(inputs, count) != count))
+    {
+        return false;
+    }
+
+    this->_frameCount++;
+    this->_current = previous;
+    this->_inputCount[this->_current] = 0;
+    return true;
+}
+
+bool InputRecorder::startPlayback()
+{
+    this->_file.seek(0, ios_base::end);
+    uint32_t size = this->_file.tellg();
+
+    // Snapshot and input blocks, other blocks are skipped
+    bool isSnapshotLoaded = false;
+    uint32_t position = RZX_HEADER_SIZE;
+    uint8_t header[RZX_INPUT_HEADER_SIZE];
+    while (true)
+    {
+        this->_file.clear();
+        if (position + RZX_INPUT_HEADER_SIZE > size
+            || !this->_file.seek(position, ios_base::beg)
+            || this->_file.read(header, RZX_BLOCK_HEADER_SIZE) != RZX_BLOCK_HEADER_SIZE)
+        {
+            ESP_LOGE(TAG, "No input recording in .rzx");
+            return false;
+        }
+
+        uint32_t blockLength = getDword(&header[1]);
+        if (blockLength < RZX_BLOCK_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        if (header[0] == 0x30 && !isSnapshotLoaded)
+        {
+            if (this->_file.read(&header[5], 12) != 12)
+            {
+                return false;
+            }
+
+            uint32_t flags = getDword(&header[5]);
+            if ((flags & (RZX_EXTERNAL | RZX_COMPRESSED)) != 0 || strncasecmp((char*)&header[9], "z80", 3) != 0)
+            {
+                ESP_LOGE(TAG, "Snapshot in .rzx is not supported");
+                return false;
+            }
+
+            if (!zx::LoadZ80Snapshot(&Spectrum, &this->_file, this->_buffer1))
+            {
+                return false;
+            }
+            Rewind.NewKeyframe();
+            isSnapshotLoaded = true;
+        }
+        else if (header[0] == 0x80)
+        {
+            if (this->_file.read(&header[5], 13) != 13)
+            {
+                return false;
+            }
+
+            if ((getDword(&header[14]) & RZX_COMPRESSED) != 0)
+            {
+                ESP_LOGE(TAG, "Compressed input recording is not supported");
+                return false;
+            }
+            break;
+        }
+
+        position += blockLength;
+    }
+
+    this->_frameCount = getDword(&header[5]);
+    this->_current = 0;
+    this->_inputCount[0] = 0;
+    this->_inputIndex = 0;
+    this->_isDesync = false;
+    this->_state = Playing;
+
+    // Port reads of the first frame, the frame that ended is not part of the recording
+    this->_fetchCount = 0;
+    return this->readFrame(0);
+}
+
+bool InputRecorder::readFrame(uint32_t fetchCount)
+{
+    if (fetchCount != 0 && this->_fetchCount != 0 && fetchCount != this->_fetchCount && !this->_isDesync)
+    {
+        ESP_LOGE(TAG, "Playback out of sync, %u opcode fetches instead of %u, %d frames left",
+            fetchCount, this->_fetchCount, this->_frameCount);
+        this->_isDesync = true;
+    }
+
+    if (this->_inputIndex != this->_inputCount[this->_current] || this->_isDesync)
+    {
+        if (!this->_isDesync)
+        {
+            ESP_LOGE(TAG, "Playback out of sync, %d frames left", this->_frameCount);
+        }
+        this->_isDesync = true;
+    }
+
+    if (this->_frameCount == 0)
+    {
+        // End of recording
+        return false;
+    }
+
+    uint8_t header[4];
+    if (this->_file.read(header, 4) != 4)
+    {
+        return false;
+    }
+
+    this->_fetchCount = getWord(&header[0]);
+    uint16_t count = getWord(&header[2]);
+    if (count != RZX_SAME_INPUTS)
+    {
+        if (count > RZX_MAX_FRAME_INPUTS)
+        {
+            ESP_LOGE(TAG, "More than %d port reads in a frame", RZX_MAX_FRAME_INPUTS);
+            return false;
+        }
+
+        if (this->_file.read(this->_inputs[this->_current], count) != count)
+        {
+            return false;
+        }
+        this->_inputCount[this->_current] = count;
+    }
+
+    this->_frameCount--;
+    this->_inputIndex = 0;
+    return true;
+}
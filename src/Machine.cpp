@@ -0,0 +1,31 @@
+#include "settings.h"
+#include "Machine.h"
+
+bool Machine::InitializeHeadless()
+{
+    if (!this->Environment.InitializeHeadless())
+    {
+        return false;
+    }
+
+    this->Cpu.setup(&this->Environment);
+    this->Reset();
+    return true;
+}
+
+void Machine::Reset()
+{
+    this->Environment.Reset();
+    this->Cpu.reset();
+}
+
+void Machine::RunFrame()
+{
+    while (this->Environment.TStates < TSTATES_PER_FRAME)
+    {
+        this->Cpu.emulate(TSTATES_PER_FRAME - this->Environment.TStates);
+    }
+
+    this->Environment.TStates -= TSTATES_PER_FRAME;
+    this->Cpu.interrupt();
+}
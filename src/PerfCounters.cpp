@@ -0,0 +1,59 @@
+#include "esp_log.h"
+
+#include "settings.h"
+#include "PerfCounters.h"
+
+PerfCounters Perf;
+
+void PerfCounters::OnFrame()
+{
+    uint32_t now = Cycles();
+    if (this->_lastFrame != 0)
+    {
+        this->_elapsed += now - this->_lastFrame;
+    }
+    this->_lastFrame = now;
+    this->_frames++;
+
+    if (this->_elapsed >= PERF_LOG_SECONDS * PERF_CYCLES_PER_SECOND)
+    {
+        this->update();
+    }
+}
+
+void PerfCounters::update()
+{
+    // Interrupt counters are only read here, they keep running
+    uint64_t interruptCycles = 0;
+    for (int core = 0; core < PERF_CORES; core++)
+    {
+        uint32_t cycles = this->_interruptCycles[core];
+        interruptCycles += (uint32_t)(cycles - this->_lastInterruptCycles[core]);
+        this->_lastInterruptCycles[core] = cycles;
+    }
+    this->_cycles[(int)PerfCounter::Scanline] = interruptCycles;
+
+    for (int i = 0; i < (int)PerfCounter::Count; i++)
+    {
+        this->Values.Permille[i] = (uint16_t)(this->_cycles[i] * 1000 / this->_elapsed);
+        this->_cycles[i] = 0;
+    }
+
+    this->Values.TStatesPerFrame = this->_tstates / this->_frames;
+    this->Values.FramesPerSecond = (uint16_t)(this->_frames * PERF_CYCLES_PER_SECOND / this->_elapsed);
+
+    uint16_t* permille = this->Values.Permille;
+    ESP_LOGI(TAG, "Host time: emulate %d.%d%% (audio %d.%d%%), scanline %d.%d%%, input %d.%d%%, rewind %d.%d%%, idle %d.%d%%; %d T-states/frame, %d fps",
+        permille[(int)PerfCounter::Emulate] / 10, permille[(int)PerfCounter::Emulate] % 10,
+        permille[(int)PerfCounter::Audio] / 10, permille[(int)PerfCounter::Audio] % 10,
+        permille[(int)PerfCounter::Scanline] / 10, permille[(int)PerfCounter::Scanline] % 10,
+        permille[(int)PerfCounter::Input] / 10, permille[(int)PerfCounter::Input] % 10,
+        permille[(int)PerfCounter::Rewind] / 10, permille[(int)PerfCounter::Rewind] % 10,
+        permille[(int)PerfCounter::Idle] / 10, permille[(int)PerfCounter::Idle] % 10,
+        this->Values.TStatesPerFrame, this->Values.FramesPerSecond);
+
+    this->_elapsed = 0;
+    this->_tstates = 0;
+    this->_frames = 0;
+    this->_isUpdated = true;
+}
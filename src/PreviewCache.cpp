@@ -0,0 +1,126 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "PreviewCache.h"
+
+#define PREVIEW_MAGIC 0x31565250 // "PRV1"
+
+using namespace zx;
+
+void PreviewCache::Initialize(const char* fileName)
+{
+    this->_fileName = fileName;
+    for (int i = 0; i < PREVIEW_LRU_SIZE; i++)
+    {
+        this->_records[i] = (PreviewRecord*)malloc(sizeof(PreviewRecord));
+        this->_records[i]->Key.Magic = 0;
+        this->_lastUsed[i] = 0;
+    }
+}
+
+void PreviewCache::MakeKey(const char* path, DirectoryEntry* entry, PreviewKey* key)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261;
+    for (const char* character = path; *character != '\0'; character++)
+    {
+        hash = (hash ^ (uint8_t)*character) * 16777619;
+    }
+
+    key->Magic = PREVIEW_MAGIC;
+    key->PathHash = hash;
+    key->Size = entry->Size;
+    key->Date = entry->Date;
+    key->Time = entry->Time;
+}
+
+PreviewRecord* PreviewCache::Find(PreviewKey* key)
+{
+    for (int i = 0; i < PREVIEW_LRU_SIZE; i++)
+    {
+        if (memcmp(&this->_records[i]->Key, key, sizeof(PreviewKey)) == 0)
+        {
+            this->_lastUsed[i] = ++this->_useCounter;
+            return this->_records[i];
+        }
+    }
+
+    return nullptr;
+}
+
+bool PreviewCache::readSlot(PreviewKey* key, PreviewRecord* record, bool keyOnly)
+{
+    File file;
+    file.open(this->_fileName, ios_base::in);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    bool result = false;
+    uint32_t slot = key->PathHash % PREVIEW_CACHE_SLOTS;
+    if (file.seek(slot * sizeof(PreviewRecord), ios_base::beg))
+    {
+        size_t size = keyOnly ? sizeof(PreviewKey) : sizeof(PreviewRecord);
+        result = file.read((uint8_t*)record, size) == size
+            && memcmp(&record->Key, key, sizeof(PreviewKey)) == 0;
+    }
+
+    file.close();
+    return result;
+}
+
+bool PreviewCache::Read(PreviewKey* key, PreviewRecord* record)
+{
+    return this->readSlot(key, record, false);
+}
+
+bool PreviewCache::Contains(PreviewKey* key)
+{
+    PreviewKey slotKey;
+    return this->readSlot(key, (PreviewRecord*)&slotKey, true);
+}
+
+PreviewRecord* PreviewCache::Put(PreviewRecord* record)
+{
+    int oldest = 0;
+    for (int i = 1; i < PREVIEW_LRU_SIZE; i++)
+    {
+        if (this->_lastUsed[i] < this->_lastUsed[oldest])
+        {
+            oldest = i;
+        }
+    }
+
+    this->_lastUsed[oldest] = ++this->_useCounter;
+    memcpy(this->_records[oldest], record, sizeof(PreviewRecord));
+    return this->_records[oldest];
+}
+
+bool PreviewCache::Store(PreviewRecord* record)
+{
+    File file;
+    file.open(this->_fileName, ios_base::in | ios_base::out);
+    if (!file.is_open())
+    {
+        // First preview, create the file
+        file.open(this->_fileName, ios_base::out);
+        if (!file.is_open())
+        {
+            return false;
+        }
+    }
+
+    bool result = false;
+    uint32_t slot = record->Key.PathHash % PREVIEW_CACHE_SLOTS;
+    file.seekp(slot * sizeof(PreviewRecord), ios_base::beg);
+    if (!file.bad())
+    {
+        result = file.write((uint8_t*)record, sizeof(PreviewRecord)) == sizeof(PreviewRecord);
+    }
+
+    file.close();
+    return result;
+}
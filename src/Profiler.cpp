@@ -0,0 +1,92 @@
+#include "settings.h"
+
+#ifdef PROFILER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "Profiler.h"
+
+using namespace std;
+
+static const char* _tableNames[(int)OpcodeTable::Count] = { "", "CB", "ED", "DD", "FD", "DDCB", "FDCB" };
+
+Profiler Profile;
+
+bool Profiler::Start()
+{
+    this->Stop();
+
+    this->_opcodes = (uint32_t (*)[256])calloc((int)OpcodeTable::Count * 256, sizeof(uint32_t));
+    this->_tstates = (uint32_t*)calloc(PROFILER_PC_BUCKETS, sizeof(uint32_t));
+    if (this->_opcodes == nullptr || this->_tstates == nullptr)
+    {
+        ESP_LOGE(TAG, "Not enough memory for profiler");
+        this->Stop();
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Profiler started");
+    return true;
+}
+
+void Profiler::Stop()
+{
+    free(this->_opcodes);
+    free(this->_tstates);
+    this->_opcodes = nullptr;
+    this->_tstates = nullptr;
+}
+
+bool Profiler::Save(zx::File* file)
+{
+    if (!this->IsRunning())
+    {
+        return false;
+    }
+
+    char line[32];
+    size_t length = sprintf(line, "type,key,value\n");
+    if (file->write((uint8_t*)line, length) != length)
+    {
+        return false;
+    }
+
+    for (int table = 0; table < (int)OpcodeTable::Count; table++)
+    {
+        for (int opcode = 0; opcode < 256; opcode++)
+        {
+            uint32_t count = this->_opcodes[table][opcode];
+            if (count == 0)
+            {
+                continue;
+            }
+
+            length = sprintf(line, "opcode,%s%02X,%u\n", _tableNames[table], opcode, count);
+            if (file->write((uint8_t*)line, length) != length)
+            {
+                return false;
+            }
+        }
+    }
+
+    for (int bucket = 0; bucket < PROFILER_PC_BUCKETS; bucket++)
+    {
+        uint32_t tstates = this->_tstates[bucket];
+        if (tstates == 0)
+        {
+            continue;
+        }
+
+        length = sprintf(line, "pc,%04X,%u\n", bucket << PROFILER_PC_SHIFT, tstates);
+        if (file->write((uint8_t*)line, length) != length)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif
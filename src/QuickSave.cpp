@@ -0,0 +1,135 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "settings.h"
+#include "QuickSave.h"
+#include "z80Environment.h"
+
+using namespace zx;
+
+extern Z80Environment& Environment;
+
+QuickSave QuickSaves;
+
+void QuickSave::Initialize(uint8_t pageBuffer[0x4000], uint8_t outputBuffer[0x4000])
+{
+    this->_pageBuffer = pageBuffer;
+    this->_outputBuffer = outputBuffer;
+}
+
+// Returns the previous page if it is the same, or a new one
+QuickSavePage* QuickSave::savePage(uint8_t pageNumber, QuickSavePage* previous)
+{
+    Environment.GetRamPage(pageNumber)->ToBuffer(this->_pageBuffer);
+
+    uint8_t* data = this->_outputBuffer;
+    uint16_t size;
+    if (!CompressPageToBuffer(this->_pageBuffer, this->_outputBuffer, 0x4000, &size))
+    {
+        data = this->_pageBuffer;
+        size = 0x4000;
+    }
+
+    if (previous != nullptr && previous->Size == size && memcmp(previous->Data, data, size) == 0)
+    {
+        previous->RefCount++;
+        return previous;
+    }
+
+    QuickSavePage* page = (QuickSavePage*)malloc(sizeof(QuickSavePage) + size);
+    if (page == nullptr)
+    {
+        return nullptr;
+    }
+
+    page->RefCount = 1;
+    page->Size = size;
+    memcpy(page->Data, data, size);
+    return page;
+}
+
+void QuickSave::releasePage(QuickSavePage* page)
+{
+    if (page != nullptr && --page->RefCount == 0)
+    {
+        free(page);
+    }
+}
+
+bool QuickSave::Save(uint8_t slot)
+{
+    int64_t startTime = esp_timer_get_time();
+
+    QuickSaveSlot* previous = this->_lastSaved >= 0 ? &this->_slots[this->_lastSaved] : nullptr;
+    QuickSavePage* pages[8] = {};
+    for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+    {
+        if (Environment.GetRamPage(pageNumber) == nullptr)
+        {
+            continue;
+        }
+
+        pages[pageNumber] = this->savePage(pageNumber, previous != nullptr ? previous->Pages[pageNumber] : nullptr);
+        if (pages[pageNumber] == nullptr)
+        {
+            ESP_LOGE(TAG, "Not enough memory for quick save");
+            for (int i = 0; i < pageNumber; i++)
+            {
+                this->releasePage(pages[i]);
+            }
+            return false;
+        }
+    }
+
+    // Pages shared with the old state of this slot are kept by the new one
+    QuickSaveSlot* quickSaveSlot = &this->_slots[slot];
+    for (int i = 0; i < 8; i++)
+    {
+        this->releasePage(quickSaveSlot->Pages[i]);
+        quickSaveSlot->Pages[i] = pages[i];
+    }
+
+    SaveZ80State(quickSaveSlot->State);
+    quickSaveSlot->IsUsed = true;
+    this->_lastSaved = slot;
+
+    ESP_LOGI(TAG, "Quick save to slot %d in %d us", slot, (int)(esp_timer_get_time() - startTime));
+    return true;
+}
+
+bool QuickSave::Load(uint8_t slot)
+{
+    QuickSaveSlot* quickSaveSlot = &this->_slots[slot];
+    if (!quickSaveSlot->IsUsed)
+    {
+        return false;
+    }
+
+    int64_t startTime = esp_timer_get_time();
+
+    for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+    {
+        QuickSavePage* page = quickSaveSlot->Pages[pageNumber];
+        if (page == nullptr)
+        {
+            continue;
+        }
+
+        if (page->Size == 0x4000)
+        {
+            Environment.GetRamPage(pageNumber)->FromBuffer(page->Data);
+        }
+        else
+        {
+            DecompressPageFromBuffer(page->Data, page->Size, this->_pageBuffer);
+            Environment.GetRamPage(pageNumber)->FromBuffer(this->_pageBuffer);
+        }
+    }
+
+    LoadZ80State(quickSaveSlot->State);
+
+    ESP_LOGI(TAG, "Quick load from slot %d in %d us", slot, (int)(esp_timer_get_time() - startTime));
+    return true;
+}
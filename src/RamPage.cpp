@@ -28,6 +28,11 @@ void RamPage::FromBuffer(void* buffer)
     memcpy(this->_data, buffer, 0x4000);
 }
 
+void RamPage::FromBuffer(void* buffer, uint16_t offset, uint16_t size)
+{
+    memcpy(this->_data + offset, buffer, size);
+}
+
 void RamPage::ToBuffer(void* buffer)
 {
     memcpy(buffer, this->_data, 0x4000);
@@ -59,6 +59,34 @@ void RamVideoPage::FromBuffer(void* data)
     memcpy(this->_data, &((uint8_t*)data)[0x1B00], 0x2500);
 }
 
+void RamVideoPage::FromBuffer(void* buffer, uint16_t offset, uint16_t size)
+{
+    uint8_t* data = (uint8_t*)buffer;
+    uint32_t end = offset + size;
+
+    // Screen pixels
+    if (offset < 0x1800)
+    {
+        uint16_t count = (end < 0x1800 ? end : 0x1800) - offset;
+        memcpy(&this->_videoRam->Pixels[offset], data, count);
+        data += count;
+        offset += count;
+    }
+
+    // Screen Attributes
+    for (; offset < end && offset < 0x1B00; offset++)
+    {
+        this->_videoRam->Attributes[offset - (uint16_t)0x1800] = Z80Environment::FromSpectrumColor(*data);
+        data++;
+    }
+
+    // The rest
+    if (offset < end)
+    {
+        memcpy(&this->_data[offset - (uint16_t)0x1B00], data, end - offset);
+    }
+}
+
 void RamVideoPage::ToBuffer(void* buffer)
 {
     uint8_t* data = (uint8_t*)buffer;
@@ -0,0 +1,339 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "settings.h"
+#include "RewindBuffer.h"
+#include "z80Environment.h"
+
+using namespace zx;
+
+extern Z80Environment& Environment;
+
+RewindBuffer Rewind;
+
+static void xorPage(uint8_t* page, uint8_t* other)
+{
+    for (int i = 0; i < 0x4000; i++)
+    {
+        page[i] ^= other[i];
+    }
+}
+
+void RewindBuffer::Initialize(uint8_t pageBuffer[0x4000], uint8_t deltaBuffer[0x4000])
+{
+    this->_pageBuffer = pageBuffer;
+    this->_deltaBuffer = deltaBuffer;
+    this->_budget = heap_caps_get_free_size(MALLOC_CAP_8BIT) / REWIND_HEAP_DIVISOR;
+    ESP_LOGI(TAG, "Rewind budget %u bytes", this->_budget);
+}
+
+void RewindBuffer::OnFrame()
+{
+    this->_frames++;
+    if (this->_isCapturing)
+    {
+        this->continueCapture();
+    }
+    else if (this->_frames >= REWIND_INTERVAL_FRAMES)
+    {
+        this->_frames = 0;
+        this->startCapture();
+    }
+}
+
+void RewindBuffer::NewKeyframe()
+{
+    this->cancelCapture();
+    this->_keyframe = -1;
+}
+
+void RewindBuffer::readPage(RewindPage* page, uint8_t* buffer)
+{
+    if (page->Size == 0x4000)
+    {
+        memcpy(buffer, page->Data, 0x4000);
+    }
+    else
+    {
+        DecompressPageFromBuffer(page->Data, page->Size, buffer);
+    }
+}
+
+bool RewindBuffer::storePage(RewindCapture* capture, uint8_t pageNumber, uint8_t* data)
+{
+    // Page captured again after it was written
+    if (capture->Pages[pageNumber] != nullptr)
+    {
+        this->_captureBytes -= sizeof(RewindPage) + capture->Pages[pageNumber]->Size;
+        this->freePage(capture, pageNumber);
+    }
+
+    uint8_t* source = this->_deltaBuffer;
+    uint16_t size;
+    if (!CompressPageToBuffer(data, this->_deltaBuffer, 0x4000, &size))
+    {
+        source = data;
+        size = 0x4000;
+    }
+
+    uint32_t allocationSize = sizeof(RewindPage) + size;
+    if (this->_captureBytes + allocationSize > this->_budget)
+    {
+        // Would not fit even without older captures, which are kept
+        ESP_LOGE(TAG, "Rewind capture does not fit in %u bytes", this->_budget);
+        return false;
+    }
+
+    RewindPage* page;
+    while ((page = (RewindPage*)malloc(allocationSize)) == nullptr)
+    {
+        if (!this->canDropOldest(capture))
+        {
+            ESP_LOGE(TAG, "Not enough memory for rewind");
+            return false;
+        }
+
+        this->dropOldest();
+    }
+
+    page->Size = size;
+    memcpy(page->Data, source, size);
+    capture->Pages[pageNumber] = page;
+    capture->PageMask |= 1 << pageNumber;
+    this->_usedBytes += allocationSize;
+    this->_captureBytes += allocationSize;
+    return true;
+}
+
+void RewindBuffer::freePage(RewindCapture* capture, uint8_t pageNumber)
+{
+    RewindPage* page = capture->Pages[pageNumber];
+    if (page != nullptr)
+    {
+        this->_usedBytes -= sizeof(RewindPage) + page->Size;
+        free(page);
+        capture->Pages[pageNumber] = nullptr;
+    }
+}
+
+void RewindBuffer::freeCapture(RewindCapture* capture)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        this->freePage(capture, i);
+    }
+}
+
+// Keyframe of a capture has to stay
+bool RewindBuffer::canDropOldest(RewindCapture* capture)
+{
+    return this->_count > 0 && (capture->IsKeyframe || this->_first != this->_keyframe);
+}
+
+// Drops the oldest keyframe with the captures that depend on it
+bool RewindBuffer::dropOldest()
+{
+    if (this->_count == 0)
+    {
+        return false;
+    }
+
+    do
+    {
+        if (this->_first == this->_keyframe)
+        {
+            this->_keyframe = -1;
+        }
+
+        this->freeCapture(&this->_captures[this->_first]);
+        this->_first = (this->_first + 1) % REWIND_CAPTURES;
+        this->_count--;
+    } while (this->_count > 0 && !this->_captures[this->_first].IsKeyframe);
+
+    return true;
+}
+
+void RewindBuffer::startCapture()
+{
+    this->_dirtySinceKeyframe |= Environment.GetDirtyPages();
+    Environment.ClearDirty();
+
+    if (this->_count == REWIND_CAPTURES)
+    {
+        this->dropOldest();
+    }
+
+    uint8_t index = this->indexOf(this->_count);
+    bool isKeyframe = this->_keyframe < 0
+        || (index + REWIND_CAPTURES - this->_keyframe) % REWIND_CAPTURES >= REWIND_KEYFRAME_INTERVAL;
+
+    RewindCapture* capture = &this->_captures[index];
+    capture->IsKeyframe = isKeyframe;
+    capture->PageMask = 0;
+    memset(capture->Pages, 0, sizeof(capture->Pages));
+
+    this->_pendingPages = isKeyframe ? 0xFF : this->_dirtySinceKeyframe;
+    this->_isCapturing = true;
+    this->_captureFrames = 0;
+    this->_captureBytes = 0;
+    this->_longestSlice = 0;
+    this->continueCapture();
+}
+
+void RewindBuffer::cancelCapture()
+{
+    if (this->_isCapturing)
+    {
+        this->freeCapture(&this->_captures[this->indexOf(this->_count)]);
+        this->_isCapturing = false;
+    }
+}
+
+bool RewindBuffer::capturePage(RewindCapture* capture, uint8_t pageNumber)
+{
+    Environment.GetRamPage(pageNumber)->ToBuffer(this->_pageBuffer);
+    if (!capture->IsKeyframe)
+    {
+        // Unchanged bytes become zeros
+        this->readPage(this->_captures[this->_keyframe].Pages[pageNumber], this->_deltaBuffer);
+        xorPage(this->_pageBuffer, this->_deltaBuffer);
+    }
+
+    return this->storePage(capture, pageNumber, this->_pageBuffer);
+}
+
+bool RewindBuffer::continueCapture()
+{
+    int64_t startTime = esp_timer_get_time();
+    uint8_t index = this->indexOf(this->_count);
+    RewindCapture* capture = &this->_captures[index];
+
+    // Pages written since the previous frame are captured (again)
+    uint8_t dirtyPages = Environment.GetDirtyPages();
+    Environment.ClearDirty();
+    this->_dirtySinceKeyframe |= dirtyPages;
+    this->_pendingPages |= dirtyPages;
+    this->_captureFrames++;
+
+    bool isLastFrame = this->_captureFrames >= REWIND_CAPTURE_MAX_FRAMES;
+    for (uint8_t pageNumber = 0; pageNumber < 8 && this->_pendingPages != 0; pageNumber++)
+    {
+        uint8_t pageBit = 1 << pageNumber;
+        if ((this->_pendingPages & pageBit) == 0)
+        {
+            continue;
+        }
+
+        if (!isLastFrame && esp_timer_get_time() - startTime >= REWIND_SLICE_MICROS)
+        {
+            break;
+        }
+
+        this->_pendingPages &= ~pageBit;
+        if (Environment.GetRamPage(pageNumber) == nullptr)
+        {
+            continue;
+        }
+
+        if (!this->capturePage(capture, pageNumber))
+        {
+            this->cancelCapture();
+            return false;
+        }
+    }
+
+    uint32_t slice = (uint32_t)(esp_timer_get_time() - startTime);
+    if (slice > this->_longestSlice)
+    {
+        this->_longestSlice = slice;
+    }
+
+    if (this->_pendingPages != 0)
+    {
+        return true;
+    }
+
+    // Memory is as captured, the state goes with it
+    SaveZ80State(capture->State);
+    while (this->_usedBytes > this->_budget)
+    {
+        if (!this->canDropOldest(capture))
+        {
+            ESP_LOGE(TAG, "Rewind capture does not fit next to its keyframe in %u bytes", this->_budget);
+            this->cancelCapture();
+            return false;
+        }
+
+        this->dropOldest();
+    }
+
+    this->_isCapturing = false;
+    this->_count++;
+    if (capture->IsKeyframe)
+    {
+        this->_keyframe = index;
+        this->_dirtySinceKeyframe = 0;
+    }
+
+    ESP_LOGD(TAG, "Rewind capture %s, %d bytes used, %d frames, longest %d us", capture->IsKeyframe ? "keyframe" : "delta",
+        this->_usedBytes, this->_captureFrames, this->_longestSlice);
+    return true;
+}
+
+bool RewindBuffer::StepBack()
+{
+    this->cancelCapture();
+    if (this->_count == 0)
+    {
+        return false;
+    }
+
+    uint8_t index = this->indexOf(this->_count - 1);
+    RewindCapture* capture = &this->_captures[index];
+
+    uint8_t keyframeIndex = index;
+    while (!this->_captures[keyframeIndex].IsKeyframe)
+    {
+        keyframeIndex = (keyframeIndex + REWIND_CAPTURES - 1) % REWIND_CAPTURES;
+    }
+    RewindCapture* keyframe = &this->_captures[keyframeIndex];
+
+    for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+    {
+        if (keyframe->Pages[pageNumber] == nullptr)
+        {
+            continue;
+        }
+
+        this->readPage(keyframe->Pages[pageNumber], this->_pageBuffer);
+        if (capture != keyframe && capture->Pages[pageNumber] != nullptr)
+        {
+            this->readPage(capture->Pages[pageNumber], this->_deltaBuffer);
+            xorPage(this->_pageBuffer, this->_deltaBuffer);
+        }
+
+        Environment.GetRamPage(pageNumber)->FromBuffer(this->_pageBuffer);
+    }
+
+    LoadZ80State(capture->State);
+    Environment.ClearDirty();
+
+    // Memory is now as in the capture, which is removed
+    if (capture->IsKeyframe)
+    {
+        this->_keyframe = -1;
+        this->_dirtySinceKeyframe = 0;
+    }
+    else
+    {
+        this->_dirtySinceKeyframe = capture->PageMask;
+    }
+
+    this->freeCapture(capture);
+    this->_count--;
+    this->_frames = 0;
+    return true;
+}
@@ -14,15 +14,7 @@ ScreenArea::ScreenArea(VideoController* videoController,
 void ScreenArea::Clear()
 {
     this->HideCursor();
-    for (int y = this->_yOffset; y < this->_yOffset + this->_Height; y++)
-    {
-        for (int x = this->_xOffset; x < this->_xOffset + this->_Width; x++)
-        {
-            int i = y * SCREEN_WIDTH + x;
-            this->_videoController->Characters[i] = ' ';
-            this->_videoController->Attributes[i] = this->_videoController->_defaultAttribute;
-        }
-    }
+    this->_videoController->Clear(this->_xOffset, this->_yOffset, this->_Width, this->_Height);
 }
 
 void ScreenArea::SetPrintAttribute(uint16_t attribute)
@@ -0,0 +1,232 @@
+#include <string.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "TapeLoader.h"
+#include "z80main.h"
+#include "z80Environment.h"
+
+using namespace std;
+
+/*
+ .tap file is a sequence of blocks, as saved by SA-BYTES
+
+ Offset  Length  Description
+ ---------------------------
+ 0       2       Length of the block without these 2 bytes
+ 2       1       Flag, 0x00 for headers, 0xFF for data
+ 3       [0]     Data
+ ...     1       Checksum, XOR of the flag and all data bytes
+ */
+
+// Block with 6912 bytes of data, most likely a loading screen
+#define SCREEN_BLOCK_LENGTH (0x1B00 + 2)
+#define SCREEN_SEARCH_BLOCKS 8
+
+extern Z80Environment& Environment;
+
+TapeLoader Tape;
+
+void TapeLoader::Initialize(SemaphoreHandle_t sdCardMutex)
+{
+    this->_sdCardMutex = sdCardMutex;
+}
+
+bool TapeLoader::Insert(const char* fileName)
+{
+    this->Eject();
+
+    this->_file.open(fileName, ios_base::in);
+    if (!this->_file.is_open())
+    {
+        return false;
+    }
+
+    this->_file.seek(0, ios_base::end);
+    this->_size = this->_file.tellg();
+    this->_position = 0;
+    this->_isInserted = true;
+
+    ESP_LOGI(TAG, "Tape inserted, %d bytes", this->_size);
+    return true;
+}
+
+void TapeLoader::Eject()
+{
+    if (this->_isInserted)
+    {
+        this->_file.close();
+        this->_isInserted = false;
+    }
+}
+
+// 128K editor ROM has other code at this address
+bool TapeLoader::isLoadRoutine()
+{
+    return Environment.PeekByte(LD_BYTES) == 0x14        // INC D
+        && Environment.PeekByte(LD_BYTES + 1) == 0x08    // EX AF,AF'
+        && Environment.PeekByte(LD_BYTES + 2) == 0x15    // DEC D
+        && Environment.PeekByte(LD_BYTES + 3) == 0xF3;   // DI
+}
+
+bool TapeLoader::LoadBytes()
+{
+    if (!this->_isInserted || !this->isLoadRoutine())
+    {
+        return false;
+    }
+
+    xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+    bool result = this->loadBlock();
+    xSemaphoreGive(this->_sdCardMutex);
+
+    return result;
+}
+
+bool TapeLoader::loadBlock()
+{
+    uint8_t header[3];
+    if (this->_position + sizeof(header) > this->_size)
+    {
+        // End of tape, ROM waits for a signal until BREAK
+        ESP_LOGI(TAG, "End of tape");
+        return false;
+    }
+
+    this->_file.clear();
+    if (!this->_file.seek(this->_position, ios_base::beg)
+        || this->_file.read(header, sizeof(header)) != sizeof(header))
+    {
+        return false;
+    }
+
+    uint16_t blockLength = header[0] | (header[1] << 8);
+    uint32_t blockEnd = this->_position + 2 + blockLength;
+    if (blockLength == 0 || blockEnd > this->_size)
+    {
+        ESP_LOGE(TAG, "Invalid tape block at %d", this->_position);
+        this->_position = this->_size;
+        return false;
+    }
+
+    // Next trap gets the following block, whatever happens to this one
+    this->_position = blockEnd;
+
+    uint8_t flag = header[2];
+    uint16_t flagAndMode = Z80cpu.AFx;
+    bool isLoad = (flagAndMode & 0x01) != 0;
+    uint16_t address = Z80cpu.IX;
+    uint16_t length = Z80cpu.DE;
+    uint8_t parity = flag;
+    uint8_t lastByte = flag;
+    bool isSuccess = false;
+
+    if (flag == (flagAndMode >> 8))
+    {
+        // Bytes after the flag, the last one is the checksum
+        uint16_t available = blockLength - 1;
+        uint16_t count = length < available ? length : available;
+        uint16_t done = 0;
+        bool isVerified = true;
+        while (done < count && isVerified)
+        {
+            uint16_t chunkSize = count - done;
+            if (chunkSize > TAPE_CHUNK_SIZE)
+            {
+                chunkSize = TAPE_CHUNK_SIZE;
+            }
+
+            if (this->_file.read(this->_chunk, chunkSize) != chunkSize)
+            {
+                return false;
+            }
+
+            for (int i = 0; i < chunkSize; i++)
+            {
+                uint8_t value = this->_chunk[i];
+                if (isLoad)
+                {
+                    Environment.WriteByte(address, value);
+                }
+                else if (Environment.PeekByte(address) != value)
+                {
+                    // VERIFY stops at the first difference
+                    isVerified = false;
+                    break;
+                }
+
+                parity ^= value;
+                lastByte = value;
+                address++;
+                done++;
+            }
+        }
+
+        if (isVerified && done == length && available > length)
+        {
+            uint8_t checksum;
+            if (this->_file.read(&checksum, 1) != 1)
+            {
+                return false;
+            }
+
+            parity ^= checksum;
+            lastByte = checksum;
+            isSuccess = (parity == 0);
+        }
+
+        length -= done;
+    }
+
+    ESP_LOGI(TAG, "Tape block, flag %02X, %d bytes, %s", flag, blockLength, isSuccess ? "loaded" : "failed");
+
+    // Registers as LD-BYTES leaves them
+    Z80cpu.IX = address;
+    Z80cpu.DE = length;
+    Z80cpu.H = parity;
+    Z80cpu.L = lastByte;
+    if (isSuccess)
+    {
+        // LD A,H; CP 01 with H = 0
+        Z80cpu.A = 0;
+        Z80cpu.F = 0x93;
+    }
+    else
+    {
+        // No carry
+        Z80cpu.A = parity;
+        Z80cpu.F = 0x00;
+    }
+
+    // SA/LD-RET restores the border, checks BREAK and returns to the caller of LD-BYTES
+    Z80cpu.PC = SA_LD_RET;
+    return true;
+}
+
+bool TapeLoader::ReadScreen(zx::File* file, uint8_t screen[0x1B00])
+{
+    file->seek(0, ios_base::end);
+    uint32_t size = file->tellg();
+
+    uint32_t position = 0;
+    uint8_t header[3];
+    for (int i = 0; i < SCREEN_SEARCH_BLOCKS && position + sizeof(header) <= size; i++)
+    {
+        if (!file->seek(position, ios_base::beg)
+            || file->read(header, sizeof(header)) != sizeof(header))
+        {
+            return false;
+        }
+
+        uint16_t blockLength = header[0] | (header[1] << 8);
+        if (blockLength == SCREEN_BLOCK_LENGTH && header[2] == 0xFF
+            && position + 2 + blockLength <= size)
+        {
+            return file->read(screen, 0x1B00) == 0x1B00;
+        }
+
+        position += 2 + blockLength;
+    }
+
+    return false;
+}
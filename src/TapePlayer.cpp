@@ -0,0 +1,773 @@
+#include <string.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "TapePlayer.h"
+#include "z80main.h"
+#include "z80Environment.h"
+
+using namespace std;
+
+/*
+ .tzx file starts with "ZXTape!", 0x1A and the version, followed by blocks with an ID byte.
+ Blocks that make a signal:
+
+ ID      Description
+ ---------------------------
+ 0x10    Standard speed data: pause, length, data as in .tap
+ 0x11    Turbo speed data: own timings of pilot, sync and bits
+ 0x12    Pure tone: pulse length and count
+ 0x13    Pulse sequence: up to 255 pulses of any length
+ 0x14    Pure data: bits only
+ 0x15    Direct recording: one bit per sample is the level of the signal
+ 0x20    Pause, 0 stops the tape
+
+ .tap blocks are played as standard speed data with a pause of 1 second.
+ */
+
+#define TZX_HEADER_SIZE 10
+
+// ROM timings
+#define PILOT_PULSE 2168
+#define PILOT_HEADER_PULSES 8063
+#define PILOT_DATA_PULSES 3223
+#define SYNC1_PULSE 667
+#define SYNC2_PULSE 735
+#define ZERO_PULSE 855
+#define ONE_PULSE 1710
+#define TAP_PAUSE_MS 1000
+
+// INC B; RET Z; LD A,xx; IN A,(FE); RRA; RET NC; XOR C; AND 20h; JR Z,loop
+// as LD-SAMPLE in ROM, and in many custom loaders
+#define EDGE_LOOP_SIZE 13
+#define EDGE_LOOP_TSTATES 59
+#define EDGE_LOOP_SAMPLE 27
+#define EDGE_LOOP_IN_OFFSET 6
+static const int16_t EdgeLoop[EDGE_LOOP_SIZE] = { 0x04, 0xC8, 0x3E, -1, 0xDB, 0xFE, 0x1F, 0xD0, 0xA9, 0xE6, 0x20, 0x28, 0xF3 };
+
+extern Z80Environment& Environment;
+
+TapePlayer Player;
+
+void TapePlayer::Initialize(SemaphoreHandle_t sdCardMutex)
+{
+    this->_sdCardMutex = sdCardMutex;
+}
+
+// Caller holds the SD card mutex
+bool TapePlayer::Insert(const char* fileName)
+{
+    this->Eject();
+
+    this->_file.open(fileName, ios_base::in);
+    if (!this->_file.is_open())
+    {
+        return false;
+    }
+
+    this->_file.seek(0, ios_base::end);
+    this->_size = this->_file.tellg();
+
+    uint8_t header[TZX_HEADER_SIZE];
+    this->_isTzx = this->_size >= TZX_HEADER_SIZE
+        && this->_file.seek(0, ios_base::beg)
+        && this->_file.read(header, TZX_HEADER_SIZE) == TZX_HEADER_SIZE
+        && memcmp(header, "ZXTape!\x1A", 8) == 0;
+
+    this->_bufferStart = this->_isTzx ? TZX_HEADER_SIZE : 0;
+    this->_bufferLength = 0;
+    this->_bufferIndex = 0;
+    this->_stage = BlockStart;
+    this->_level = 0;
+    this->_signal = 0;
+    this->_pausedRemaining = 0;
+    this->_loopCount = 0;
+    this->_isInserted = true;
+
+    ESP_LOGI(TAG, "Tape inserted, %s, %d bytes", this->_isTzx ? "TZX" : "TAP", this->_size);
+    return true;
+}
+
+void TapePlayer::Eject()
+{
+    if (this->_isInserted)
+    {
+        this->_file.close();
+        this->_isInserted = false;
+        this->_isPlaying = false;
+    }
+}
+
+void TapePlayer::seekTo(uint32_t position)
+{
+    if (position >= this->_bufferStart && position <= this->_bufferStart + this->_bufferLength)
+    {
+        this->_bufferIndex = position - this->_bufferStart;
+    }
+    else
+    {
+        this->_bufferStart = position;
+        this->_bufferLength = 0;
+        this->_bufferIndex = 0;
+    }
+}
+
+bool TapePlayer::readByte(uint8_t* value)
+{
+    if (this->_bufferIndex >= this->_bufferLength)
+    {
+        uint32_t position = this->_bufferStart + this->_bufferLength;
+        if (position >= this->_size)
+        {
+            return false;
+        }
+
+        uint32_t length = this->_size - position;
+        if (length > TAPE_BUFFER_SIZE)
+        {
+            length = TAPE_BUFFER_SIZE;
+        }
+
+        xSemaphoreTake(this->_sdCardMutex, portMAX_DELAY);
+        this->_file.clear();
+        bool isRead = this->_file.seek(position, ios_base::beg)
+            && this->_file.read(this->_buffer, length) == length;
+        xSemaphoreGive(this->_sdCardMutex);
+
+        if (!isRead)
+        {
+            return false;
+        }
+
+        this->_bufferStart = position;
+        this->_bufferLength = length;
+        this->_bufferIndex = 0;
+    }
+
+    *value = this->_buffer[this->_bufferIndex++];
+    return true;
+}
+
+bool TapePlayer::readWord(uint16_t* value)
+{
+    uint8_t low;
+    uint8_t high;
+    if (!this->readByte(&low) || !this->readByte(&high))
+    {
+        return false;
+    }
+
+    *value = low | (high << 8);
+    return true;
+}
+
+bool TapePlayer::readLength(uint32_t* value, uint8_t size)
+{
+    *value = 0;
+    for (int i = 0; i < size; i++)
+    {
+        uint8_t byteValue;
+        if (!this->readByte(&byteValue))
+        {
+            return false;
+        }
+        *value |= byteValue << (i * 8);
+    }
+
+    return true;
+}
+
+bool TapePlayer::skip(uint32_t count)
+{
+    this->seekTo(this->tell() + count);
+    return this->tell() <= this->_size;
+}
+
+void TapePlayer::setStandardBlock(uint32_t length, uint16_t pauseMs)
+{
+    this->_pilotPulse = PILOT_PULSE;
+    this->_sync1 = SYNC1_PULSE;
+    this->_sync2 = SYNC2_PULSE;
+    this->_zero = ZERO_PULSE;
+    this->_one = ONE_PULSE;
+    this->_lastBits = 8;
+    this->_dataLength = length;
+    this->_pauseMs = pauseMs;
+
+    // Headers have a longer pilot tone
+    uint8_t flag = 0xFF;
+    if (length > 0 && this->readByte(&flag))
+    {
+        this->seekTo(this->tell() - 1);
+    }
+    this->_pilotCount = flag < 0x80 ? PILOT_HEADER_PULSES : PILOT_DATA_PULSES;
+    this->_stage = Pilot;
+}
+
+// Returns false at the end of the tape, or when the tape has to stop before the next block
+bool TapePlayer::startBlock()
+{
+    this->_blockStart = this->tell();
+    this->_bitsLeft = 0;
+    this->_isSecondHalf = false;
+
+    if (this->_isTzx)
+    {
+        return this->startTzxBlock();
+    }
+
+    uint16_t length;
+    if (!this->readWord(&length))
+    {
+        return false;
+    }
+
+    this->setStandardBlock(length, TAP_PAUSE_MS);
+    return true;
+}
+
+bool TapePlayer::startTzxBlock()
+{
+    // Blocks without a signal are skipped
+    while (true)
+    {
+        this->_blockStart = this->tell();
+
+        uint8_t id;
+        if (!this->readByte(&id))
+        {
+            return false;
+        }
+
+        uint8_t count;
+        uint16_t word;
+        uint32_t length;
+        bool result = true;
+        switch (id)
+        {
+        case 0x10:
+        {
+            uint16_t dataLength;
+            if (!this->readWord(&word) || !this->readWord(&dataLength))
+            {
+                return false;
+            }
+            this->setStandardBlock(dataLength, word);
+            return true;
+        }
+
+        case 0x11:
+            result = this->readWord(&this->_pilotPulse)
+                && this->readWord(&this->_sync1)
+                && this->readWord(&this->_sync2)
+                && this->readWord(&this->_zero)
+                && this->readWord(&this->_one)
+                && this->readWord(&this->_pilotCount)
+                && this->readByte(&this->_lastBits)
+                && this->readWord(&this->_pauseMs)
+                && this->readLength(&this->_dataLength, 3);
+            this->_stage = Pilot;
+            return result;
+
+        case 0x12:
+            result = this->readWord(&this->_pilotPulse) && this->readWord(&this->_pulseCount);
+            this->_stage = Tone;
+            return result;
+
+        case 0x13:
+            result = this->readByte(&count);
+            this->_pulseCount = count;
+            this->_stage = Pulses;
+            return result;
+
+        case 0x14:
+            result = this->readWord(&this->_zero)
+                && this->readWord(&this->_one)
+                && this->readByte(&this->_lastBits)
+                && this->readWord(&this->_pauseMs)
+                && this->readLength(&this->_dataLength, 3);
+            this->_stage = Data;
+            return result;
+
+        case 0x15:
+            // T-states per sample are kept as the pilot pulse
+            result = this->readWord(&this->_pilotPulse)
+                && this->readWord(&this->_pauseMs)
+                && this->readByte(&this->_lastBits)
+                && this->readLength(&this->_dataLength, 3);
+            this->_stage = Direct;
+            return result;
+
+        case 0x20:
+            if (!this->readWord(&this->_pauseMs))
+            {
+                return false;
+            }
+            if (this->_pauseMs == 0)
+            {
+                ESP_LOGI(TAG, "Tape stopped by the tape");
+                return false;
+            }
+            this->_stage = Pause;
+            return true;
+
+        case 0x2A:
+            // Stop the tape if in 48K mode
+            if (!this->readLength(&length, 4) || !this->skip(length))
+            {
+                return false;
+            }
+            if (Environment.MemoryState.PagingLock == 1)
+            {
+                return false;
+            }
+            break;
+
+        case 0x2B:
+            if (!this->readLength(&length, 4) || !this->readByte(&count))
+            {
+                return false;
+            }
+            this->_signal = count != 0 ? 1 : 0;
+            break;
+
+        case 0x24:
+            if (!this->readWord(&this->_loopCount))
+            {
+                return false;
+            }
+            this->_loopStart = this->tell();
+            break;
+
+        case 0x25:
+            if (this->_loopCount > 1)
+            {
+                this->_loopCount--;
+                this->seekTo(this->_loopStart);
+            }
+            else
+            {
+                this->_loopCount = 0;
+            }
+            break;
+
+        case 0x22:
+        case 0x27:
+            // Group end, return from sequence
+            break;
+
+        case 0x21:
+        case 0x30:
+            result = this->readByte(&count) && this->skip(count);
+            break;
+
+        case 0x31:
+            result = this->skip(1) && this->readByte(&count) && this->skip(count);
+            break;
+
+        case 0x23:
+            // Jumps are not followed
+            result = this->skip(2);
+            break;
+
+        case 0x26:
+            result = this->readWord(&word) && this->skip(word * 2);
+            break;
+
+        case 0x28:
+        case 0x32:
+            result = this->readWord(&word) && this->skip(word);
+            break;
+
+        case 0x33:
+            result = this->readByte(&count) && this->skip(count * 3);
+            break;
+
+        case 0x35:
+            result = this->skip(16) && this->readLength(&length, 4) && this->skip(length);
+            break;
+
+        case 0x18:
+        case 0x19:
+            // CSW and generalized data are not supported
+            ESP_LOGI(TAG, "Tape block 0x%02X skipped", id);
+            result = this->readLength(&length, 4) && this->skip(length);
+            break;
+
+        case 0x5A:
+            result = this->skip(9);
+            break;
+
+        default:
+            ESP_LOGE(TAG, "Unknown tape block 0x%02X", id);
+            this->seekTo(this->_size);
+            return false;
+        }
+
+        if (!result)
+        {
+            return false;
+        }
+    }
+}
+
+// Duration of the next pulse, the level after it is in _signal
+bool TapePlayer::nextPulse(uint32_t* duration)
+{
+    while (true)
+    {
+        switch (this->_stage)
+        {
+        case BlockStart:
+            if (!this->startBlock())
+            {
+                if (this->tell() >= this->_size)
+                {
+                    this->_stage = End;
+                }
+                return false;
+            }
+            break;
+
+        case Pilot:
+            if (this->_pilotCount > 0)
+            {
+                this->_pilotCount--;
+                *duration = this->_pilotPulse;
+                this->_signal ^= 1;
+                return true;
+            }
+            this->_stage = Sync1;
+            break;
+
+        case Sync1:
+            this->_stage = Sync2;
+            *duration = this->_sync1;
+            this->_signal ^= 1;
+            return true;
+
+        case Sync2:
+            this->_stage = Data;
+            *duration = this->_sync2;
+            this->_signal ^= 1;
+            return true;
+
+        case Data:
+            // Two pulses per bit, most significant bit first
+            if (!this->_isSecondHalf && this->_bitsLeft == 0)
+            {
+                if (this->_dataLength == 0 || !this->readByte(&this->_byte))
+                {
+                    this->_stage = Pause;
+                    break;
+                }
+                this->_dataLength--;
+                this->_bitsLeft = (this->_dataLength == 0 && this->_lastBits > 0) ? this->_lastBits : 8;
+            }
+            *duration = (this->_byte & 0x80) ? this->_one : this->_zero;
+            if (this->_isSecondHalf)
+            {
+                this->_byte <<= 1;
+                this->_bitsLeft--;
+            }
+            this->_isSecondHalf = !this->_isSecondHalf;
+            this->_signal ^= 1;
+            return true;
+
+        case Direct:
+        {
+            // Samples of the same level make one pulse
+            uint32_t samples = 0;
+            while (true)
+            {
+                if (this->_bitsLeft == 0)
+                {
+                    if (this->_dataLength == 0 || !this->readByte(&this->_byte))
+                    {
+                        break;
+                    }
+                    this->_dataLength--;
+                    this->_bitsLeft = (this->_dataLength == 0 && this->_lastBits > 0) ? this->_lastBits : 8;
+                }
+                if ((this->_byte >> 7) != this->_signal)
+                {
+                    break;
+                }
+                samples++;
+                this->_byte <<= 1;
+                this->_bitsLeft--;
+            }
+
+            if (samples == 0 && this->_bitsLeft == 0)
+            {
+                this->_stage = Pause;
+                break;
+            }
+            *duration = samples * this->_pilotPulse;
+            this->_signal ^= 1;
+            return true;
+        }
+
+        case Pause:
+            if (this->_pauseMs == 0)
+            {
+                this->_stage = BlockStart;
+                break;
+            }
+            // Low level from 1 ms into the pause
+            this->_stage = PauseRest;
+            *duration = TAPE_MS_TSTATES;
+            this->_signal = 0;
+            return true;
+
+        case PauseRest:
+            this->_stage = BlockStart;
+            if (this->_pauseMs > 1)
+            {
+                *duration = (this->_pauseMs - 1) * TAPE_MS_TSTATES;
+                return true;
+            }
+            break;
+
+        case Tone:
+            if (this->_pulseCount > 0)
+            {
+                this->_pulseCount--;
+                *duration = this->_pilotPulse;
+                this->_signal ^= 1;
+                return true;
+            }
+            this->_stage = BlockStart;
+            break;
+
+        case Pulses:
+        {
+            uint16_t pulse;
+            if (this->_pulseCount > 0 && this->readWord(&pulse))
+            {
+                this->_pulseCount--;
+                *duration = pulse;
+                this->_signal ^= 1;
+                return true;
+            }
+            this->_stage = BlockStart;
+            break;
+        }
+
+        case End:
+            return false;
+        }
+    }
+}
+
+void TapePlayer::advance()
+{
+    this->_level = this->_edgeLevel;
+
+    uint32_t duration;
+    if (!this->nextPulse(&duration))
+    {
+        this->_isPlaying = false;
+        return;
+    }
+
+    this->_edgeTime += duration;
+    this->_edgeLevel = this->_signal;
+}
+
+void TapePlayer::Play(uint32_t tstates)
+{
+    if (!this->_isInserted || this->_isPlaying || this->_stage == End)
+    {
+        return;
+    }
+
+    this->_isPlaying = true;
+    if (this->_pausedRemaining > 0)
+    {
+        // Continue the pulse that was playing
+        this->_edgeTime = tstates + this->_pausedRemaining;
+        this->_pausedRemaining = 0;
+    }
+    else
+    {
+        this->_edgeTime = tstates;
+        this->_edgeLevel = this->_level;
+        this->_signal = this->_level;
+        this->advance();
+    }
+}
+
+void TapePlayer::Stop(uint32_t tstates)
+{
+    if (!this->_isPlaying)
+    {
+        return;
+    }
+
+    this->levelAt(tstates);
+    this->_pausedRemaining = this->_edgeTime - (int32_t)tstates;
+    this->_isPlaying = false;
+}
+
+uint32_t TapePlayer::GetBlockPosition()
+{
+    switch (this->_stage)
+    {
+    case BlockStart:
+    case Pause:
+    case PauseRest:
+    case End:
+        return this->tell();
+    default:
+        return this->_blockStart;
+    }
+}
+
+void TapePlayer::Seek(uint32_t position)
+{
+    this->seekTo(position);
+    this->_stage = BlockStart;
+    this->_isPlaying = false;
+    this->_pausedRemaining = 0;
+    this->_loopCount = 0;
+}
+
+uint8_t TapePlayer::levelAt(uint32_t tstates)
+{
+    while (this->_isPlaying && (int32_t)tstates >= this->_edgeTime)
+    {
+        this->advance();
+    }
+
+    return this->_level;
+}
+
+uint8_t TapePlayer::GetEar(uint32_t tstates)
+{
+#ifdef TAPE_FAST_FORWARD
+    this->_isSampled = this->_isPlaying;
+#endif
+    return this->levelAt(tstates);
+}
+
+void TapePlayer::EndFrame(uint32_t tstates)
+{
+    if (!this->_isPlaying)
+    {
+        return;
+    }
+
+    this->levelAt(tstates);
+    this->_edgeTime -= tstates;
+}
+
+uint32_t TapePlayer::OnTrap(uint16_t pc, uint32_t tstates)
+{
+    if (pc == LD_BYTES_TRAP)
+    {
+        if (Tape.IsInserted())
+        {
+            // .tap is loaded at once from where the signal is
+            if (this->_isInserted)
+            {
+                Tape.Seek(this->GetBlockPosition());
+            }
+
+            if (Tape.LoadBytes())
+            {
+                if (this->_isInserted)
+                {
+                    // Custom loaders that follow get the signal
+                    this->Seek(Tape.GetPosition());
+                    this->Play(tstates);
+                }
+                return 0;
+            }
+        }
+
+        // ROM loads from the signal
+        this->Play(tstates);
+        return 0;
+    }
+
+#ifdef TAPE_FAST_FORWARD
+    if (this->_isSampled)
+    {
+        // Right after IN A,(FE) of a possible edge sampling loop
+        this->_isSampled = false;
+        if (pc != this->_checkedAddress)
+        {
+            this->_checkedAddress = pc;
+            if (this->isEdgeLoop(pc - EDGE_LOOP_IN_OFFSET))
+            {
+                this->_loopAddress = pc - EDGE_LOOP_IN_OFFSET;
+            }
+        }
+        return 0;
+    }
+
+    if (pc == this->_loopAddress)
+    {
+        return this->fastForward(tstates);
+    }
+#endif
+
+    return 0;
+}
+
+bool TapePlayer::isEdgeLoop(uint16_t address)
+{
+    for (int i = 0; i < EDGE_LOOP_SIZE; i++)
+    {
+        if (EdgeLoop[i] >= 0 && Environment.PeekByte(address + i) != EdgeLoop[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Skips iterations of the sampling loop that would not see an edge, returns skipped T-states
+uint32_t TapePlayer::fastForward(uint32_t tstates)
+{
+    if (!this->_isPlaying)
+    {
+        return 0;
+    }
+
+    // Loop waits for the level to differ from bit 5 of C
+    uint8_t level = this->levelAt(tstates + EDGE_LOOP_SAMPLE);
+    if (level != ((Z80cpu.C >> 5) & 0x01))
+    {
+        return 0;
+    }
+
+    int32_t untilEdge = this->_edgeTime - (int32_t)(tstates + EDGE_LOOP_SAMPLE);
+    if (untilEdge <= 0)
+    {
+        return 0;
+    }
+
+    // B counts iterations up to the timeout at 0
+    uint8_t b = Z80cpu.B;
+    uint32_t count = (untilEdge + EDGE_LOOP_TSTATES - 1) / EDGE_LOOP_TSTATES;
+    if (count > (uint32_t)(0xFF - b))
+    {
+        count = 0xFF - b;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // State after the last skipped iteration, 9 instructions per iteration
+    uint8_t r = Z80cpu.R;
+    Z80cpu.B = b + count;
+    Z80cpu.R = (r & 0x80) | ((r + count * 9) & 0x7F);
+    Z80cpu.A = 0;
+    Z80cpu.F = 0x54;
+
+    return count * EDGE_LOOP_TSTATES;
+}
@@ -0,0 +1,57 @@
+#include "settings.h"
+
+#ifdef TRACE_INSTRUCTIONS
+
+#include <stdio.h>
+
+#include "TraceBuffer.h"
+
+using namespace std;
+
+TraceBuffer Trace;
+
+int TraceBuffer::Count()
+{
+    // Once trapped, the oldest entry is being overwritten
+    uint32_t size = this->IsTrapped() ? TRACE_INSTRUCTIONS - 1 : TRACE_INSTRUCTIONS;
+    return this->_index < size ? this->_index : size;
+}
+
+const TraceEntry* TraceBuffer::Get(int i)
+{
+    uint32_t start = this->_index - this->Count();
+    return &this->_entries[(start + i) & (TRACE_INSTRUCTIONS - 1)];
+}
+
+bool TraceBuffer::Save(zx::File* file)
+{
+    char line[80];
+    size_t length = sprintf(line, "PC   Bytes       AF   BC   DE   HL   IX   IY   SP   T-states\n");
+    if (file->write((uint8_t*)line, length) != length)
+    {
+        return false;
+    }
+
+    int count = this->Count();
+    for (int i = 0; i < count; i++)
+    {
+        const TraceEntry* entry = this->Get(i);
+        length = sprintf(line, "%04X %02X %02X %02X %02X %04X %04X %04X %04X %04X %04X %04X %u\n",
+            entry->PC, entry->Bytes[0], entry->Bytes[1], entry->Bytes[2], entry->Bytes[3],
+            entry->AF, entry->BC, entry->DE, entry->HL, entry->IX, entry->IY, entry->SP, entry->TStates);
+        if (file->write((uint8_t*)line, length) != length)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void TraceBuffer::Reset()
+{
+    this->_index = 0;
+    this->_step = 1;
+}
+
+#endif
@@ -1,11 +1,16 @@
+#include "esp_log.h"
+
 #include "VideoController.h"
 #include "font8x8.h"
 #include "z80Environment.h"
+#include "PerfCounters.h"
 
 #define BACK_COLOR 0x10
 #define FORE_COLOR 0x3F
 
-static uint32_t _borderAttribute;
+#define FREE_ENTRY 0xFFFF
+#define NO_ATTRIBUTE 0xFF
+#define PALETTE_KEY(foreColor, backColor) (((foreColor) & 0x3F) << 6 | ((backColor) & 0x3F))
 
 extern uint8_t* IRAM_ATTR GetPixelPointer(uint8_t* pixels, uint16_t line);
 extern "C" void IRAM_ATTR drawScanline(void* arg, uint8_t* dest, int scanLine);
@@ -13,11 +18,19 @@ extern "C" void IRAM_ATTR drawScanline(void* arg, uint8_t* dest, int scanLine);
 VideoController::VideoController(SpectrumScreenData* screenData)
 {
     this->Settings = screenData;
-	this->_spectrumAttributes = (uint32_t*)heap_caps_malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8 * 2 * 4, MALLOC_CAP_32BIT);
+    memset(this->_oddScanlines, 0, sizeof(this->_oddScanlines));
 }
 
 void VideoController::Start(char const* modeline)
 {
+    uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	this->_screenshotPixels = (uint8_t*)heap_caps_malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8, MALLOC_CAP_8BIT);
+	this->_screenshotAttributes = (uint16_t*)heap_caps_malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 2, MALLOC_CAP_8BIT);
+    this->_screenshot.Pixels = this->_screenshotPixels;
+    this->_screenshot.Attributes = this->_screenshotAttributes;
+    uint32_t freeHeapAfter = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    ESP_LOGI(TAG, "Screenshot buffer: free heap %u bytes before, %u bytes after", freeHeap, freeHeapAfter);
+
 #ifdef SDCARD
     this->_fontData = (uint8_t*)font8x8;
 #else
@@ -25,24 +38,33 @@ void VideoController::Start(char const* modeline)
     memcpy(this->_fontData, font8x8, 256 * 8);
 #endif
 
-    // "default" attribute (white on blue)
-    this->_defaultAttribute = (uint32_t*)heap_caps_malloc(16 * 4, MALLOC_CAP_32BIT);
-
-    this->Attributes = (uint32_t**)heap_caps_malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4, MALLOC_CAP_32BIT);
-
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+    this->_glyphs = (uint32_t(*)[16])heap_caps_malloc(GLYPH_CACHE_SIZE * 16 * 4, MALLOC_CAP_32BIT);
+    for (int i = 0; i < PALETTE_SIZE; i++)
+    {
+        this->_paletteColors[i] = FREE_ENTRY;
+        this->_paletteUsage[i] = 0;
+    }
+    memset(this->_paletteLookup, NO_ATTRIBUTE, sizeof(this->_paletteLookup));
+    for (int i = 0; i < GLYPH_CACHE_SIZE; i++)
     {
-        this->Characters[i] = ' ';
-        this->Attributes[i] = this->_defaultAttribute;
+        this->_glyphKeys[i] = FREE_ENTRY;
     }
 
     this->setDrawScanlineCallback(drawScanline, this);
 
+    // 4 line buffers, so that a doubled line is never redrawn while it is displayed
+    this->setScanlinesPerCallBack(2);
+
     this->begin();
     this->setResolution(modeline);
 
-    this->InitAttribute(this->_defaultAttribute, FORE_COLOR, BACK_COLOR);
+    // "default" attribute (white on blue)
+    this->_paletteColors[DEFAULT_ATTRIBUTE] = FORE_COLOR << 8 | BACK_COLOR;
+    this->_paletteUsage[DEFAULT_ATTRIBUTE] = SCREEN_WIDTH * SCREEN_HEIGHT;
+    this->_paletteLookup[PALETTE_KEY(FORE_COLOR, BACK_COLOR)] = DEFAULT_ATTRIBUTE;
+    this->InitAttribute(this->_palette[DEFAULT_ATTRIBUTE], FORE_COLOR, BACK_COLOR);
 
+    this->Clear(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
     this->prepareDebugScreen();
 }   
 
@@ -127,30 +149,137 @@ void VideoController::Print(const char* str)
 
 void VideoController::SetAttribute(uint8_t x, uint8_t y, uint8_t foreColor, uint8_t backColor)
 {
-    uint32_t* attribute;
+    uint8_t attribute;
     uint16_t colors = foreColor << 8 | backColor;
 
     if (colors == 0xFFFF)
     {
-        attribute = this->_defaultAttribute;
+        attribute = DEFAULT_ATTRIBUTE;
     }
     else
     {
-
-        auto iterator = this->_attrToAddr.find(colors);
-        if (iterator == this->_attrToAddr.end())
+        attribute = this->_paletteLookup[PALETTE_KEY(foreColor, backColor)];
+        if (attribute == NO_ATTRIBUTE)
         {
             // Missing
             attribute = this->CreateAttribute(foreColor, backColor);
-            this->_attrToAddr.insert(make_pair(colors, attribute));
         }
-        else
+    }
+
+    int offset = y * SCREEN_WIDTH + x;
+    this->setCellAttribute(offset, attribute);
+    this->Glyphs[offset] = this->getGlyph(attribute, this->Characters[offset], true);
+}
+
+void VideoController::setCellAttribute(int offset, uint8_t attribute)
+{
+    uint8_t oldAttribute = this->Attributes[offset];
+    if (oldAttribute != attribute)
+    {
+        this->_paletteUsage[oldAttribute]--;
+        this->_paletteUsage[attribute]++;
+        this->Attributes[offset] = attribute;
+    }
+}
+
+void VideoController::Clear(uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+    uint8_t glyph = this->getGlyph(DEFAULT_ATTRIBUTE, ' ', true);
+    for (int i = y; i < y + height; i++)
+    {
+        int offset = i * SCREEN_WIDTH + x;
+        for (int j = offset; j < offset + width; j++)
+        {
+            this->setCellAttribute(j, DEFAULT_ATTRIBUTE);
+        }
+        memset(&this->Characters[offset], ' ', width);
+        memset(&this->Glyphs[offset], glyph, width);
+    }
+}
+
+uint8_t VideoController::getGlyph(uint8_t attribute, uint8_t character, bool canFlush)
+{
+    if (canFlush && this->_glyphCount >= this->_glyphLimit)
+    {
+        this->flushGlyphs();
+    }
+
+    uint16_t key = attribute << 8 | character;
+    uint8_t index;
+    if (this->findGlyph(key, &index))
+    {
+        return index;
+    }
+
+    if (this->_glyphCount >= GLYPH_CACHE_SIZE - 1)
+    {
+        // More different glyphs on the screen than the cache holds even after a flush,
+        // keep the character readable in the default colors, or leave the cell blank
+        if (this->findGlyph(DEFAULT_ATTRIBUTE << 8 | character, &index))
         {
-            attribute = iterator->second;
+            return index;
         }
+        this->findGlyph(DEFAULT_ATTRIBUTE << 8 | ' ', &index);
+        return index;
     }
 
-    this->Attributes[y * SCREEN_WIDTH + x] = attribute;
+    // Missing, expand each row of the character with the palette entry
+    uint32_t* palette = this->_palette[attribute];
+    uint32_t* glyph = this->_glyphs[index];
+    uint8_t* fontData = this->_fontData + character * 8;
+    for (int row = 0; row < 8; row++)
+    {
+        uint8_t fontPixels = fontData[row];
+        glyph[row * 2] = palette[fontPixels >> 4];
+        glyph[row * 2 + 1] = palette[fontPixels & 0x0F];
+    }
+
+    this->_glyphKeys[index] = key;
+    this->_glyphCount++;
+    return index;
+}
+
+bool VideoController::findGlyph(uint16_t key, uint8_t* index)
+{
+    uint8_t i = ((key & 0xFF) ^ ((key >> 8) * 37)) & (GLYPH_CACHE_SIZE - 1);
+    while (this->_glyphKeys[i] != FREE_ENTRY)
+    {
+        if (this->_glyphKeys[i] == key)
+        {
+            *index = i;
+            return true;
+        }
+
+        i = (i + 1) & (GLYPH_CACHE_SIZE - 1);
+    }
+
+    // Free entry for the key
+    *index = i;
+    return false;
+}
+
+void VideoController::flushGlyphs()
+{
+    for (int i = 0; i < GLYPH_CACHE_SIZE; i++)
+    {
+        this->_glyphKeys[i] = FREE_ENTRY;
+    }
+    this->_glyphCount = 0;
+
+    // Always cached, cells that do not fit in the cache fall back to it
+    this->getGlyph(DEFAULT_ATTRIBUTE, ' ', false);
+
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+    {
+        this->Glyphs[i] = this->getGlyph(this->Attributes[i], this->Characters[i], false);
+    }
+
+    // Leave some room for new glyphs before flushing again
+    this->_glyphLimit = this->_glyphCount + GLYPH_CACHE_SIZE / 4;
+    if (this->_glyphLimit > GLYPH_CACHE_SIZE - 1)
+    {
+        this->_glyphLimit = GLYPH_CACHE_SIZE - 1;
+    }
 }
 
 void VideoController::printChar(uint16_t x, uint16_t y, uint16_t ch)
@@ -221,41 +350,54 @@ void VideoController::SetCursorPosition(uint8_t x, uint8_t y)
 	}
 }
 
-void VideoController::freeUnusedAttributes()
+uint8_t VideoController::CreateAttribute(uint8_t foreColor, uint8_t backColor)
 {
-    for (auto it = this->_attrToAddr.begin(); it != this->_attrToAddr.end(); it++)
+    // Prefer an entry that was never used, otherwise take one no cell uses anymore
+    uint8_t attribute = NO_ATTRIBUTE;
+    for (int i = 0; i < PALETTE_SIZE; i++)
     {
-        uint32_t* attribute = it->second;
-
-        bool found = false;
-        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+        if (this->_paletteUsage[i] == 0)
         {
-            if (this->Attributes[i] == attribute)
+            attribute = i;
+            if (this->_paletteColors[i] == FREE_ENTRY)
             {
-                found = true;
                 break;
             }
         }
+    }
 
-        if (!found)
-        {   
-            free(attribute);
-            this->_attrToAddr.erase(it->first);
-        }
-    }   
-}
+    if (attribute == NO_ATTRIBUTE)
+    {
+        // All colors are on the screen, reuse the default one
+        return DEFAULT_ATTRIBUTE;
+    }
 
-uint32_t* VideoController::CreateAttribute(uint8_t foreColor, uint8_t backColor)
-{
-    uint32_t* attribute = (uint32_t*)heap_caps_malloc(16 * 4, MALLOC_CAP_32BIT);
-    this->InitAttribute(attribute, foreColor, backColor);
+    uint16_t oldColors = this->_paletteColors[attribute];
+    if (oldColors != FREE_ENTRY)
+    {
+        // Recycle, glyphs expanded with the old colors are not valid anymore
+        this->_paletteLookup[PALETTE_KEY(oldColors >> 8, oldColors & 0xFF)] = NO_ATTRIBUTE;
+        this->flushGlyphs();
+    }
+
+    this->_paletteColors[attribute] = foreColor << 8 | backColor;
+    this->_paletteLookup[PALETTE_KEY(foreColor, backColor)] = attribute;
+    this->InitAttribute(this->_palette[attribute], foreColor, backColor);
     return attribute;
 }
 
 void VideoController::ShowScreenshot(const uint8_t* screenshot, uint8_t borderColor)
 {
+    // Keep a copy, the buffer can be reused while the screenshot is displayed
+    memcpy(this->_screenshotPixels, screenshot, SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8);
+    const uint8_t* attributes = screenshot + SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8;
+    for (int i = 0; i < SPECTRUM_WIDTH * SPECTRUM_HEIGHT; i++)
+    {
+        this->_screenshotAttributes[i] = Z80Environment::FromSpectrumColor(attributes[i]);
+    }
+
     uint8_t border = Z80Environment::FromSpectrumColor(borderColor) >> 8;
-    this->showScreenshot((uint8_t*)screenshot, nullptr, border);
+    this->showScreenshot(this->_screenshotPixels, this->_screenshotAttributes, border);
 }
 
 void VideoController::ShowScreenshot()
@@ -268,77 +410,22 @@ void VideoController::showScreenshot(
     uint16_t* attributes,
     uint8_t borderColor)
 {
-    // Screenshot
-    uint8_t* attrData8 = nullptr;
-    if (attributes == nullptr)
-    {
-        attrData8 = (uint8_t*)pixelData + SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8;
-    }
-
-	uint32_t* spectrumAttributes = this->_spectrumAttributes;
-    for (int y = 0; y < SPECTRUM_HEIGHT; y++)
-    {
-        for (int x = 0; x < SPECTRUM_WIDTH; x++)
-        {
-			this->Attributes[(y + this->_topOffset / 8) * SCREEN_WIDTH + x + (this->_leftOffset / 8)] = spectrumAttributes;
-			uint16_t colors;
-            if (attributes == nullptr)
-            {
-                colors = Z80Environment::FromSpectrumColor(*attrData8);
-            }
-            else
-            {
-                colors = *attributes;
-            }
-			uint8_t foreColor = colors >> 8;
-			uint8_t backColor = colors & 0xFF;
-
-            for (int y2 = 0; y2 < 8; y2++)
-            {
-				uint8_t* charPixels = GetPixelPointer(pixelData, y * 8 + y2) + x;
-				uint8_t pixels = *charPixels;
-
-				uint32_t attributeValue;
-				for (uint8_t halfByte = 0; halfByte < 2; halfByte++)
-				{
-					for (uint8_t bit = 0; bit < 4; bit++)
-					{
-						VGA_PIXELINROW(((uint8_t*)&attributeValue), bit) = 
-							this->createRawPixel(pixels & 0x80 ?  foreColor : backColor);
-						pixels <<= 1;
-					}
-
-					*spectrumAttributes = attributeValue;
-					spectrumAttributes++;
-				}
-			}
-
-            if (attributes == nullptr)
-            {
-                attrData8++;
-            }
-            else
-            {
-                attributes++;
-            }
-        }
-    }
+    // Screenshot is drawn from Spectrum pixels and attributes
+    this->_screenshot.Pixels = pixelData;
+    this->_screenshot.Attributes = attributes;
 
     // Border
-    uint8_t rawPixel = this->createRawPixel(borderColor);
-    uint32_t attributeValue = rawPixel << 24 | rawPixel << 16 | rawPixel << 8 | rawPixel;
-    _borderAttribute = attributeValue;
     for (int x = 1; x <= SPECTRUM_WIDTH_WITH_BORDER; x++)
     {
-    	this->Attributes[SCREEN_WIDTH + x] = &_borderAttribute;
-    	this->Attributes[SPECTRUM_HEIGHT_WITH_BORDER * SCREEN_WIDTH + x] = &_borderAttribute;
+    	this->SetAttribute(x, 1, borderColor, borderColor);
+    	this->SetAttribute(x, SPECTRUM_HEIGHT_WITH_BORDER, borderColor, borderColor);
     }
     for (int y = 1; y <= SPECTRUM_HEIGHT_WITH_BORDER; y++)
     {
-    	this->Attributes[y * SCREEN_WIDTH + 1] = &_borderAttribute;
-    	this->Attributes[y * SCREEN_WIDTH + 2] = &_borderAttribute;
-    	this->Attributes[y * SCREEN_WIDTH + SPECTRUM_WIDTH_WITH_BORDER - 1] = &_borderAttribute;
-    	this->Attributes[y * SCREEN_WIDTH + SPECTRUM_WIDTH_WITH_BORDER] = &_borderAttribute;
+    	this->SetAttribute(1, y, borderColor, borderColor);
+    	this->SetAttribute(2, y, borderColor, borderColor);
+    	this->SetAttribute(SPECTRUM_WIDTH_WITH_BORDER - 1, y, borderColor, borderColor);
+    	this->SetAttribute(SPECTRUM_WIDTH_WITH_BORDER, y, borderColor, borderColor);
     }
 }
 
@@ -362,11 +449,83 @@ uint8_t* IRAM_ATTR GetPixelPointer(uint8_t* pixels, uint16_t line)
 
 void VideoController::SetMode(uint8_t mode)
 {
+    this->setLineDoubling(mode == 2);
     this->_mode = mode;
 }
 
+void VideoController::onSetupDMABuffer(lldesc_t volatile* buffer, bool isStartOfVertFrontPorch, 
+    int scan, bool isVisible, int visibleRow)
+{
+    fabgl::VGADirectController::onSetupDMABuffer(buffer, isStartOfVertFrontPorch, scan, isVisible, visibleRow);
+
+    if (isVisible && (visibleRow % 2) == 1 && visibleRow < SCREEN_HEIGHT * 8)
+    {
+        this->_oddScanlines[visibleRow / 2] = buffer;
+        if (this->_mode == 2)
+        {
+            buffer->buf = this->getScanlineBuffer(visibleRow - 1);
+        }
+    }
+}
+
+void VideoController::setLineDoubling(bool enabled)
+{
+    // Odd scanline is either sent from its own buffer, 
+    // or from the buffer of the previous (even) scanline
+    for (int i = 0; i < SCREEN_HEIGHT * 8 / 2; i++)
+    {
+        lldesc_t volatile* descriptor = this->_oddScanlines[i];
+        if (descriptor != nullptr)
+        {
+            int scanLine = i * 2 + 1;
+            descriptor->buf = this->getScanlineBuffer(enabled ? scanLine - 1 : scanLine);
+        }
+    }
+}
+
+static inline void IRAM_ATTR drawScreenshotLine(VideoController* controller, uint8_t* dest, uint16_t line)
+{
+    // Same as the Spectrum screen in mode 2, but not scaled
+    uint8_t* bitmap = GetPixelPointer(controller->_screenshot.Pixels, line);
+    uint16_t* colors = &controller->_screenshot.Attributes[line / 8 * SPECTRUM_WIDTH];
+    for (uint8_t* charBits = bitmap; charBits < bitmap + SPECTRUM_WIDTH; charBits++)
+    {
+        uint8_t pixels = *charBits;
+        uint8_t foregroundColor = controller->createRawPixel(((uint8_t*)colors)[1]);
+        uint8_t backgroundColor = controller->createRawPixel(((uint8_t*)colors)[0]);
+        for (int bit = 0; bit < 8; bit++)
+        {
+            VGA_PIXELINROW(dest, bit) = (pixels & 0x80) != 0 ? foregroundColor : backgroundColor;
+            pixels <<= 1;
+        }
+
+        dest += 8;
+        colors++;
+    }
+}
+
+static inline void IRAM_ATTR drawOverlayLine(VideoController* controller, uint8_t* dest, unsigned scaledLine)
+{
+    // Text is not scaled, its rows are doubled like the rest of the screen
+    int offset = (scaledLine / 8 + 1) * SCREEN_WIDTH + controller->OverlayColumn;
+    uint8_t* glyphs = controller->Glyphs + offset;
+    uint8_t* lastGlyph = controller->Glyphs + offset + SCREEN_WIDTH - controller->OverlayColumn - 2;
+    uint32_t* glyphRows = controller->_glyphs[0] + (scaledLine % 8) * 2;
+    uint32_t* dest32 = (uint32_t*)dest + controller->OverlayColumn * 2;
+    do
+    {
+        uint32_t* glyphRow = glyphRows + *glyphs * 16;
+        dest32[0] = glyphRow[0];
+        dest32[1] = glyphRow[1];
+
+        dest32 += 2;
+        glyphs++;
+    } while (glyphs <= lastGlyph);
+}
+
 void IRAM_ATTR drawScanline(void* arg, uint8_t* dest, int scanLine)
 {
+    uint32_t startTime = PerfCounters::Cycles();
     auto controller = static_cast<VideoController*>(arg);
     if (scanLine == 0)
     {
@@ -382,93 +541,110 @@ void IRAM_ATTR drawScanline(void* arg, uint8_t* dest, int scanLine)
         int fontRow = scanLine % 8;
         int startCoord = y * SCREEN_WIDTH;
 
-        uint8_t* characters = controller->Characters + startCoord;
-        uint32_t** attributes = controller->Attributes + startCoord;
+        uint8_t* glyphs = controller->Glyphs + startCoord;
+        uint32_t* glyphRows = controller->_glyphs[0] + fontRow * 2;
         uint32_t* dest32 = (uint32_t*)dest;
-        uint32_t** lastAttribute = attributes + SCREEN_WIDTH - 1;
-        uint8_t* fontData = controller->_fontData + fontRow;
+        uint8_t* lastGlyph = glyphs + SCREEN_WIDTH - 1;
+
+        uint8_t* screenshotGlyph = nullptr;
+        uint16_t screenshotLine = scanLine - controller->_topOffset;
+        if (screenshotLine < SPECTRUM_HEIGHT * 8)
+        {
+            // Spectrum screen is not made of glyphs
+            screenshotGlyph = glyphs + controller->_leftOffset / 8;
+        }
 
         do
         {
-            uint8_t character = *characters;
-            uint8_t fontPixels = fontData[character * 8];
-            uint32_t* attribute = *attributes;
-            dest32[0] = attribute[fontPixels >> 4];
-            dest32[1] = attribute[fontPixels & 0x0F];
+            if (glyphs == screenshotGlyph)
+            {
+                drawScreenshotLine(controller, (uint8_t*)dest32, screenshotLine);
+                dest32 += SPECTRUM_WIDTH * 2;
+                glyphs += SPECTRUM_WIDTH;
+                continue;
+            }
+
+            uint32_t* glyphRow = glyphRows + *glyphs * 16;
+            dest32[0] = glyphRow[0];
+            dest32[1] = glyphRow[1];
 
             dest32 += 2;
-            attributes++;
-            characters++;
-        } while (attributes <= lastAttribute);
+            glyphs++;
+        } while (glyphs <= lastGlyph);
     }
-    else
+    else if (scanLine % 2 == 0)
     {
-        // Spectrum screen
+        // Spectrum screen, odd lines are not redrawn, DMA sends the previous line again
 
-        if (scanLine % 2 == 1)
+        unsigned scaledLine = scanLine / 2;
+        DrawSpectrumLine(controller, controller->Settings, *controller->BorderColor, dest, scaledLine);
+        if (scaledLine < controller->OverlayRows * 8u && scaledLine < controller->_borderHeight)
         {
-            // Do not redraw every second line
-            const void* previousLineBuffer = (const void*)controller->getScanlineBuffer(scanLine - 1);
-            memcpy(dest, previousLineBuffer, controller->getScreenWidth());
-            return;
+            drawOverlayLine(controller, dest, scaledLine);
         }
+    }
 
-        unsigned scaledLine = scanLine / 2;
-        uint16_t* dest16 = (uint16_t*)dest;
+    Perf.AddInterrupt(startTime);
+}
 
-        if (scaledLine < controller->_borderHeight
-            || scaledLine >= SPECTRUM_HEIGHT * 8 + controller->_borderHeight)
-        {
-            memset(dest16, controller->createRawPixel(*controller->BorderColor), SCREEN_WIDTH * 8);
-        }
-        else
+void IRAM_ATTR DrawSpectrumLine(VideoController* controller, SpectrumScreenData* screenData, uint8_t borderColor,
+    uint8_t* dest, unsigned scaledLine)
+{
+    // Spectrum screen with border, every pixel is doubled
+    uint16_t* dest16 = (uint16_t*)dest;
+
+    if (scaledLine < controller->_borderHeight
+        || scaledLine >= SPECTRUM_HEIGHT * 8 + controller->_borderHeight)
+    {
+        memset(dest16, controller->createRawPixel(borderColor), SCREEN_WIDTH * 8);
+    }
+    else
+    {
+        // Border on the left
+        memset(dest16, controller->createRawPixel(borderColor), controller->_borderWidth * 2);
+        dest16 += controller->_borderWidth;
+
+        // Screen pixels
+        uint16_t vline = scaledLine - controller->_borderHeight;
+        uint8_t* bitmap = (uint8_t*)GetPixelPointer(screenData->Pixels, vline);
+        uint16_t* colors = &screenData->Attributes[vline / 8 * SPECTRUM_WIDTH];
+        for (uint8_t* charBits = bitmap; charBits < bitmap + SPECTRUM_WIDTH; charBits++)
         {
-            // Border on the left
-            memset(dest16, controller->createRawPixel(*controller->BorderColor), controller->_borderWidth);
-            dest16 += controller->_borderWidth;
-
-            // Screen pixels
-            uint16_t vline = scaledLine - controller->_borderHeight;
-            uint8_t* bitmap = (uint8_t*)GetPixelPointer(controller->Settings->Pixels, vline);
-            uint16_t* colors = &controller->Settings->Attributes[vline / 8 * SPECTRUM_WIDTH];
-            for (uint8_t* charBits = bitmap; charBits < bitmap + SPECTRUM_WIDTH; charBits++)
+            uint8_t pixels = *charBits;
+            uint16_t foregroundColor = controller->createRawPixel(((uint8_t*)colors)[1]);
+            foregroundColor |= foregroundColor << 8;
+            uint16_t backgroundColor = controller->createRawPixel(((uint8_t*)colors)[0]);
+            backgroundColor |= backgroundColor << 8;
+            for (uint16_t* endDest16 = dest16 + 8; dest16 < endDest16; )
             {
-                uint8_t pixels = *charBits;
-                uint16_t foregroundColor = controller->createRawPixel(((uint8_t*)colors)[1]);
-                foregroundColor |= foregroundColor << 8;
-                uint16_t backgroundColor = controller->createRawPixel(((uint8_t*)colors)[0]);
-                backgroundColor |= backgroundColor << 8;
-                for (uint16_t* endDest16 = dest16 + 8; dest16 < endDest16; )
+                if ((pixels & 0x40) != 0)
                 {
-                    if ((pixels & 0x40) != 0)
-                    {
-                        *dest16 = foregroundColor;
-                    }
-                    else
-                    {
-                        *dest16 = backgroundColor;
-                    }
-
-                    dest16++;
-
-                    if ((pixels & 0x80) != 0)
-                    {
-                        *dest16 = foregroundColor;
-                    }
-                    else
-                    {
-                        *dest16 = backgroundColor;
-                    }
-
-                    pixels <<= 2;
-                    dest16++;
+                    *dest16 = foregroundColor;
                 }
+                else
+                {
+                    *dest16 = backgroundColor;
+                }
+
+                dest16++;
 
-                colors++;
+                if ((pixels & 0x80) != 0)
+                {
+                    *dest16 = foregroundColor;
+                }
+                else
+                {
+                    *dest16 = backgroundColor;
+                }
+
+                pixels <<= 2;
+                dest16++;
             }
 
-            // Border on the right
-            memset(dest16, controller->createRawPixel(*controller->BorderColor), controller->_borderWidth);
+            colors++;
         }
+
+        // Border on the right
+        memset(dest16, controller->createRawPixel(borderColor), controller->_borderWidth * 2);
     }
 }
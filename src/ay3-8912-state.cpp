@@ -27,6 +27,7 @@ namespace Sound
 
 void Ay3_8912_state::Initialize()
 {
+    this->_isAudible = true;
     _soundGenerator.setVolume(126);
     _soundGenerator.play(true);
 	for (int8_t channel = 0; channel < 3; channel++)
@@ -76,7 +77,10 @@ void Ay3_8912_state::Clear()
     {
 	    this->channelVolume[channel] = 0xFF;
 	    this->channelFrequency[channel] = 0xFFFF;
-        _channel[channel].setVolume(0);
+        if (this->_isAudible)
+        {
+            _channel[channel].setVolume(0);
+        }
     }
 }
 
@@ -142,6 +146,11 @@ void Ay3_8912_state::updated()
 		break;
 	}
 
+	if (!this->_isAudible)
+	{
+		return;
+	}
+
 	for (int8_t channel = 0; channel < 3; channel++)
 	{
 		if (this->channelVolume[channel] != oldChannelVolume[channel])
@@ -7,9 +7,19 @@
 #include "Emulator.h"
 #include "VideoController.h"
 #include "z80Environment.h"
+#include "Machine.h"
 #include "ps2Input.h"
 #include "z80main.h"
 #include "FileSystem.h"
+#include "TapePlayer.h"
+#include "QuickSave.h"
+#include "RewindBuffer.h"
+#include "InputRecorder.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
+#include "TraceBuffer.h"
+#include "Debugger.h"
+#include "GdbStub.h"
 #include "keyboard.h"
 #include "z80snapshot.h"
 #include "main_ROM.h"
@@ -32,12 +42,14 @@ ScreenArea DebugScreen(Screen,
 	SPECTRUM_WIDTH_WITH_BORDER + 2, SCREEN_WIDTH - (SPECTRUM_WIDTH_WITH_BORDER + 3), 
 	1, SCREEN_HEIGHT - 2);
 
-// Z80State
-Z80Environment Environment(Screen);
+// Machine on screen
+Machine Spectrum(Screen);
+Z80Environment& Environment = Spectrum.Environment;
 
 static PS2Controller* InputController;
 
 static bool _savingSnapshot = false;
+static uint8_t _quickSaveSlot = 0;
 
 static void startKeyboard()
 {
@@ -49,7 +61,7 @@ static void startKeyboard()
 
 static void hideRegisters()
 {
-	for (int y = 8; y < 12; y++)
+	for (int y = 15; y < 19; y++)
 	{
     	HelpScreen.PrintAlignCenter(y, "                                  ");
 	}
@@ -65,21 +77,21 @@ static void showRegisters()
 
     sprintf(buf, "PC %04x  AF %04x  AF' %04x  I %02x",
         (uint16_t)Z80cpu.PC, (uint16_t)Z80cpu.AF, (uint16_t)Z80cpu.AFx, (uint16_t)Z80cpu.I);
-    HelpScreen.PrintAlignCenter(8, buf);
+    HelpScreen.PrintAlignCenter(15, buf);
     sprintf(buf, "SP %04x  BC %04x  BC' %04x  R %02x",
         (uint16_t)Z80cpu.SP, (uint16_t)Z80cpu.BC, (uint16_t)Z80cpu.BCx, (uint16_t)Z80cpu.R);
-    HelpScreen.PrintAlignCenter(9, buf);
+    HelpScreen.PrintAlignCenter(16, buf);
     sprintf(buf, "IX %04x  DE %04x  DE' %04x  IM %x",
         (uint16_t)Z80cpu.IX, (uint16_t)Z80cpu.DE, (uint16_t)Z80cpu.DEx, (uint16_t)Z80cpu.IM);
-    HelpScreen.PrintAlignCenter(10, buf);
+    HelpScreen.PrintAlignCenter(17, buf);
     sprintf(buf, "IY %04x  HL %04x  HL' %04x      ",
         (uint16_t)Z80cpu.IY, (uint16_t)Z80cpu.HL, (uint16_t)Z80cpu.HLx);
-    HelpScreen.PrintAlignCenter(11, buf);
+    HelpScreen.PrintAlignCenter(18, buf);
 }
 
 void saveState()
 {
-	_ay3_8912.StopSound();
+	Environment.Ay.StopSound();
 	Screen->ShowScreenshot();
 	Screen->SetMode(1);
 }
@@ -94,18 +106,42 @@ static void showHelp()
 	HelpScreen.PrintAt(0, y++, "F1  - pause");
 #ifdef SDCARD
 	HelpScreen.PrintAt(0, y++, "F2  - save snapshot to SD card");
-	HelpScreen.PrintAt(0, y++, "F3  - load snapshot from SD card");
+	HelpScreen.PrintAt(0, y++, "F3  - load snapshot or tape from SD card");
+	HelpScreen.PrintAt(0, y++, "F4  - save screen to SD card");
 #else
 	HelpScreen.PrintAt(0, y++, "F3  - load snapshot from flash");
 #endif
 	HelpScreen.PrintAt(0, y++, "F5  - reset");
+#ifdef SDCARD
+	HelpScreen.PrintAt(0, y++, "F6  - play/stop tape");
+#endif
+	HelpScreen.PrintAt(0, y++, "F7  - quick save");
+	HelpScreen.PrintAt(0, y++, "F8  - quick load");
+	HelpScreen.PrintAt(0, y++, "F9  - next quick save slot");
 	HelpScreen.PrintAt(0, y++, "F10 - show keyboard layout");
+	HelpScreen.PrintAt(0, y++, "F11 - rewind 1 second");
+#ifdef SDCARD
+	HelpScreen.PrintAt(0, y++, "F12 - record/stop input to SD card");
+#endif
+	HelpScreen.PrintAt(0, y++, "NumLk - show performance");
+#ifdef TRACE_INSTRUCTIONS
+	HelpScreen.PrintAt(0, 20, "End - show last instructions");
+#endif
+#ifdef DEBUGGER
+	HelpScreen.PrintAt(0, 21, "Home - break");
+#endif
 }
 
 void restoreState()
 {
+#ifdef DEBUGGER
+	if (Debug.IsStopped())
+	{
+		Debug.Resume();
+	}
+#endif
 	Screen->SetMode(2);
-	_ay3_8912.ResumeSound();
+	Environment.Ay.ResumeSound();
 }
 
 static void showErrorMessage(const char* errorMessage)
@@ -115,6 +151,121 @@ static void showErrorMessage(const char* errorMessage)
 	DebugScreen.SetPrintAttribute(DEBUG_BAND_COLORS);
 }
 
+static void showQuickSaveSlot()
+{
+    char* buf = (char*)_buffer16K_1;
+    sprintf(buf, "Quick save slot %d %s", _quickSaveSlot + 1,
+        QuickSaves.IsUsed(_quickSaveSlot) ? "(used) " : "(empty)");
+    HelpScreen.PrintAt(0, 14, buf);
+}
+
+static void showPerformance()
+{
+    char* buf = (char*)_buffer16K_1;
+    uint16_t* permille = Perf.Values.Permille;
+    sprintf(buf, "Emu %3d.%d%% Scan %3d.%d%% Idle %3d.%d%%",
+        permille[(int)PerfCounter::Emulate] / 10, permille[(int)PerfCounter::Emulate] % 10,
+        permille[(int)PerfCounter::Scanline] / 10, permille[(int)PerfCounter::Scanline] % 10,
+        permille[(int)PerfCounter::Idle] / 10, permille[(int)PerfCounter::Idle] % 10);
+    DebugScreen.PrintAt(0, 0, buf);
+    sprintf(buf, "In %d.%d%% Snd %d.%d%% Rew %d.%d%% %dT %dfps   ",
+        permille[(int)PerfCounter::Input] / 10, permille[(int)PerfCounter::Input] % 10,
+        permille[(int)PerfCounter::Audio] / 10, permille[(int)PerfCounter::Audio] % 10,
+        permille[(int)PerfCounter::Rewind] / 10, permille[(int)PerfCounter::Rewind] % 10,
+        Perf.Values.TStatesPerFrame, Perf.Values.FramesPerSecond);
+    DebugScreen.PrintAt(0, 1, buf);
+}
+
+static void togglePerformance()
+{
+    Perf.ToggleHud();
+    if (Perf.IsHudVisible())
+    {
+        showPerformance();
+        Screen->OverlayColumn = SPECTRUM_WIDTH_WITH_BORDER + 2;
+        Screen->OverlayRows = 2;
+    }
+    else
+    {
+        Screen->OverlayRows = 0;
+        DebugScreen.PrintAt(0, 0, "                                       ");
+        DebugScreen.PrintAt(0, 1, "                                       ");
+    }
+}
+
+static void showCpuCore()
+{
+    char* buf = (char*)_buffer16K_1;
+    sprintf(buf, "ScrLk - next CPU core (%s)      ", Z80cpu.GetCoreName());
+    HelpScreen.PrintAt(0, 13, buf);
+}
+
+#ifdef PROFILER
+static void showProfiler()
+{
+    HelpScreen.PrintAt(0, 19, Profile.IsRunning()
+        ? "PrtSc - save profile (running)"
+        : "PrtSc - start profile         ");
+}
+#endif
+
+#ifdef TRACE_INSTRUCTIONS
+// Rows of DebugScreen below the title
+#define TRACE_SCREEN_ROWS (SCREEN_HEIGHT - 3)
+
+static void showTrace(bool isSaved)
+{
+    char* buf = (char*)_buffer16K_1;
+    DebugScreen.Clear();
+    DebugScreen.PrintAt(0, 0, isSaved ? "PC   Bytes    AF   BC   DE   HL   SP" : "Cannot save trace to SD card");
+
+    int count = Trace.Count();
+    int first = count > TRACE_SCREEN_ROWS ? count - TRACE_SCREEN_ROWS : 0;
+    for (int i = first; i < count; i++)
+    {
+        const TraceEntry* entry = Trace.Get(i);
+        sprintf(buf, "%04x %02x%02x%02x%02x %04x %04x %04x %04x %04x",
+            entry->PC, entry->Bytes[0], entry->Bytes[1], entry->Bytes[2], entry->Bytes[3],
+            entry->AF, entry->BC, entry->DE, entry->HL, entry->SP);
+        DebugScreen.PrintAt(0, 1 + i - first, buf);
+    }
+}
+
+// Pauses with the last instructions on screen
+static void dumpTrace()
+{
+    saveState();
+    showRegisters();
+#ifdef SDCARD
+    showTrace(SaveTrace());
+#else
+    showTrace(true);
+#endif
+    Trace.Reset();
+}
+#endif
+
+#ifdef DEBUGGER
+// Pauses with the reason of the stop, any key continues
+static void showBreak()
+{
+#ifdef GDB_STUB
+    if (Gdb.IsConnected())
+    {
+        // GDB shows the stop
+        return;
+    }
+#endif
+
+    char* buf = (char*)_buffer16K_1;
+    saveState();
+    showRegisters();
+    DebugScreen.Clear();
+    sprintf(buf, "%s %04x", Debug.GetStopReasonName(), Debug.GetStopAddress());
+    DebugScreen.PrintAt(0, 0, buf);
+}
+#endif
+
 static bool ReadRomFromFiles()
 {
     if ((uint8_t*)*Environment.Rom[0] == (uint8_t*)ROM)
@@ -221,15 +372,119 @@ case KEY_F2:
 		}
 		break;
 
+#ifdef SDCARD
+	case KEY_F4:
+		if (!SaveScreenCapture())
+		{
+			showErrorMessage("Cannot save screen to SD card");
+		}
+		break;
+#endif
+
 	case KEY_F5:
 		ResetSystem();
 		break;
 
+#ifdef SDCARD
+	case KEY_F6:
+		// Between emulate() calls, at the time in the frame where the CPU is
+		if (Player.IsPlaying())
+		{
+			Player.Stop(Environment.TStates);
+		}
+		else
+		{
+			Player.Play(Environment.TStates);
+		}
+		break;
+#endif
+
+	case KEY_F7:
+		if (!QuickSaves.Save(_quickSaveSlot))
+		{
+			showErrorMessage("Not enough memory for quick save");
+		}
+		showQuickSaveSlot();
+		break;
+
+	case KEY_F8:
+#ifdef SDCARD
+		StopInputRecording();
+#endif
+		if (QuickSaves.Load(_quickSaveSlot))
+		{
+			Rewind.NewKeyframe();
+		}
+		break;
+
+	case KEY_F9:
+		_quickSaveSlot = (_quickSaveSlot + 1) % QUICK_SAVE_SLOTS;
+		showQuickSaveSlot();
+		break;
+
 	case KEY_F10:
 		hideRegisters();
 		showKeyboardSetup();
 		break;
 
+	case KEY_F11:
+#ifdef SDCARD
+		StopInputRecording();
+#endif
+		Rewind.StepBack();
+		break;
+
+	case KEY_NUM:
+		togglePerformance();
+		break;
+
+	case KEY_SCROLL:
+		Z80cpu.SelectCore((Z80CoreType)(((int)Z80cpu.GetCore() + 1) % (int)Z80CoreType::Count));
+		showCpuCore();
+		break;
+
+#ifdef DEBUGGER
+	case KEY_HOME:
+		Debug.Break();
+		break;
+#endif
+
+#ifdef TRACE_INSTRUCTIONS
+	case KEY_END:
+		dumpTrace();
+		break;
+#endif
+
+#ifdef PROFILER
+	case KEY_PRTSCR:
+		if (Profile.IsRunning())
+		{
+			if (!SaveProfile())
+			{
+				showErrorMessage("Cannot save profile to SD card");
+			}
+		}
+		else if (!Profile.Start())
+		{
+			showErrorMessage("Not enough memory for profiler");
+		}
+		showProfiler();
+		break;
+#endif
+
+#ifdef SDCARD
+	case KEY_F12:
+		if (Recorder.IsActive())
+		{
+			StopInputRecording();
+		}
+		else if (!StartInputRecording())
+		{
+			showErrorMessage("Cannot record input to SD card");
+		}
+		break;
+#endif
+
 	default:
 		return false;
 	}	
@@ -272,6 +527,13 @@ static bool pausedLoop()
 void EmulatorTaskMain(void *unused)
 {
     FileSystemInitialize();
+#ifdef BATCH_RUNNER
+    // Before the screen takes its memory, the machines run with the ROM in flash
+    RunBatch();
+#endif
+#ifdef PAGE_CODEC_TEST
+    zx::TestPageCodec(_buffer16K_1, _buffer16K_2);
+#endif
 
 	// Setup
 	startKeyboard();
@@ -283,6 +545,16 @@ void EmulatorTaskMain(void *unused)
 	Screen->Start(RESOLUTION);
 
 	showHelp();
+	QuickSaves.Initialize(_buffer16K_1, _buffer16K_2);
+	Rewind.Initialize(_buffer16K_1, _buffer16K_2);
+	showQuickSaveSlot();
+	showCpuCore();
+#ifdef PROFILER
+	showProfiler();
+#endif
+#ifdef GDB_STUB
+	Gdb.Initialize();
+#endif
 
     uint32_t freeHeap32 = heap_caps_get_free_size(MALLOC_CAP_32BIT);
     uint32_t freeHeap8 = heap_caps_get_free_size(MALLOC_CAP_8BIT);
@@ -291,14 +563,43 @@ void EmulatorTaskMain(void *unused)
 	// Loop
 	while (true)
 	{
+		uint32_t startTime = Perf.Now();
 		vTaskDelay(1); // important to avoid task watchdog timeouts
+		Perf.Add(PerfCounter::Idle, startTime);
 
 		if (pausedLoop())
 		{
 			continue;
 		}
 
+#ifdef GDB_STUB
+		if (Gdb.Poll())
+		{
+			// Stopped until GDB continues
+			continue;
+		}
+#endif
+
 		int32_t result = zx_loop();
 		processSpecialKey(result);
+
+#ifdef DEBUGGER
+		if (Debug.IsStopped())
+		{
+			showBreak();
+		}
+#endif
+
+#ifdef TRACE_TRAP_PC
+		if (Trace.IsTrapped())
+		{
+			dumpTrace();
+		}
+#endif
+
+		if (Perf.IsUpdated() && Perf.IsHudVisible())
+		{
+			showPerformance();
+		}
 	}
 }
@@ -0,0 +1,349 @@
+#include <string.h>
+#include <stdio.h>
+#include "esp_log.h"
+
+#include "settings.h"
+#include "snasnapshot.h"
+#include "z80main.h"
+#include "z80Emulator.h"
+#include "z80Environment.h"
+#include "Machine.h"
+#include "File.h"
+
+/*
+ Offset  Length  Description
+ ---------------------------
+ 0       1       I register
+ 1       2       HL' register pair
+ 3       2       DE' register pair
+ 5       2       BC' register pair
+ 7       2       AF' register pair
+ 9       2       HL register pair
+ 11      2       DE register pair
+ 13      2       BC register pair
+ 15      2       IY register
+ 17      2       IX register
+ 19      1       Bit 2: IFF2, 1=EI
+ 20      1       R register
+ 21      2       AF register pair
+ 23      2       SP register
+ 25      1       Interrupt mode (0, 1 or 2)
+ 26      1       Border color (0..7)
+ 27      49152   RAM dump 0x4000..0xFFFF
+
+ 48K snapshot has PC on the stack, it is loaded by RETN.
+
+ 128K snapshot has the currently paged bank at 0xC000 in the RAM dump, followed by
+ ===========================
+ 49179   2       PC register
+ 49181   1       Last OUT to 0x7ffd
+ 49182   1       TR-DOS ROM paged (1) or not (0)
+ 49183   16Kx5/6 Remaining RAM banks in ascending order, without banks 5, 2 and the paged one
+
+ All pages are stored as is, so they are read and written with one file operation per page.
+ A page is read into buffer1 and copied into its memory page.
+ */
+
+extern Z80Environment& Environment;
+
+struct SnaHeader
+{
+	uint8_t InterruptRegister;
+	uint16_t HL_Dash;
+	uint16_t DE_Dash;
+	uint16_t BC_Dash;
+	uint16_t AF_Dash;
+	uint16_t HL;
+	uint16_t DE;
+	uint16_t BC;
+	uint16_t IY;
+	uint16_t IX;
+	uint8_t Interrupt;
+	uint8_t RefreshRegister;
+	uint16_t AF;
+	uint16_t SP;
+	uint8_t InterruptMode;
+	uint8_t BorderColor;
+}__attribute__((packed));
+
+struct SnaExtension
+{
+	uint16_t PC;
+	uint8_t PagingState;
+	uint8_t TrDos;
+}__attribute__((packed));
+
+// Reads one uncompressed page with a single read into buffer, then into its memory page, or skips it
+static bool readPage(zx::File* file, MemoryPage* page, uint8_t buffer[0x4000])
+{
+    if (page == nullptr)
+    {
+        return file->seek(0x4000, ios_base::cur);
+    }
+
+    if (file->read(buffer, 0x4000) != 0x4000)
+    {
+        return false;
+    }
+
+    page->FromBuffer(buffer);
+    return true;
+}
+
+zx::SnapshotModel zx::GetSnaSnapshotModel(uint32_t fileSize)
+{
+    switch (fileSize)
+    {
+        case SNA_48K_SIZE:
+            return SnapshotModel::Spectrum48K;
+        case SNA_48K_SIZE + sizeof(SnaExtension) + 0x4000 * 5:
+        case SNA_48K_SIZE + sizeof(SnaExtension) + 0x4000 * 6:
+            return SnapshotModel::Spectrum128K;
+        default:
+            return SnapshotModel::Unknown;
+    }
+}
+
+bool zx::LoadSnaSnapshot(Machine* machine, File* file, uint8_t buffer1[0x4000])
+{
+    Z80Environment& environment = machine->Environment;
+    z80Emulator& cpu = machine->Cpu;
+
+    if (!file->seek(0, ios_base::end))
+    {
+        return false;
+    }
+
+    uint32_t fileSize = file->tellg();
+    SnapshotModel model = GetSnaSnapshotModel(fileSize);
+    if (model == SnapshotModel::Unknown)
+    {
+        ESP_LOGE(TAG, "Invalid .sna size %d", fileSize);
+        return false;
+    }
+
+    bool is128Mode = (model == SnapshotModel::Spectrum128K);
+
+    // The paged bank has to be known before the RAM dump is read
+    SnaExtension extension = { 0, 0, 0 };
+    if (is128Mode)
+    {
+        if (!file->seek(SNA_48K_SIZE, ios_base::beg)
+            || file->read((uint8_t*)&extension, sizeof(SnaExtension)) != sizeof(SnaExtension))
+        {
+            return false;
+        }
+    }
+
+    SnaHeader header;
+    if (!file->seek(0, ios_base::beg)
+        || file->read((uint8_t*)&header, SNA_HEADER_SIZE) != SNA_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    if (is128Mode)
+    {
+        environment.MemoryState.Bits = extension.PagingState;
+    }
+    else
+    {
+        environment.MemoryState.Bits = 0;
+        environment.MemoryState.RomSelect = 1;
+        environment.MemoryState.PagingLock = 1;
+    }
+    environment.SelectScreen();
+
+    uint8_t pagedBank = environment.MemoryState.RamBank;
+#ifndef ZX128K
+    // Only bank 0 can be at 0xC000
+    pagedBank = 0;
+#endif
+
+    const uint8_t pages[] = { 5, 2, pagedBank };
+    for (int i = 0; i < 3; i++)
+    {
+        if (!readPage(file, environment.GetRamPage(pages[i]), buffer1))
+        {
+            return false;
+        }
+    }
+
+    if (is128Mode)
+    {
+        if (!file->seek(sizeof(SnaExtension), ios_base::cur))
+        {
+            return false;
+        }
+
+        // Remaining banks
+        for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+        {
+            if (pageNumber == 2 || pageNumber == 5 || pageNumber == environment.MemoryState.RamBank)
+            {
+                continue;
+            }
+
+#ifdef ZX128K
+            MemoryPage* page = environment.GetRamPage(pageNumber);
+#else
+            // Bank at 0xC000 is already loaded into page 0
+            MemoryPage* page = nullptr;
+#endif
+            if (!readPage(file, page, buffer1))
+            {
+                return false;
+            }
+        }
+    }
+
+	cpu.I = header.InterruptRegister;
+	cpu.HLx = header.HL_Dash;
+	cpu.DEx = header.DE_Dash;
+	cpu.BCx = header.BC_Dash;
+	cpu.AFx = header.AF_Dash;
+	cpu.HL = header.HL;
+	cpu.DE = header.DE;
+	cpu.BC = header.BC;
+	cpu.IY = header.IY;
+	cpu.IX = header.IX;
+	cpu.IFF2 = (header.Interrupt & 0x04) >> 2;
+	cpu.IFF1 = cpu.IFF2;
+	cpu.R = header.RefreshRegister;
+	cpu.AF = header.AF;
+	cpu.SP = header.SP;
+	cpu.IM = header.InterruptMode & 0x03;
+    environment.BorderColor = header.BorderColor & 0x07;
+
+    if (is128Mode)
+    {
+        cpu.PC = extension.PC;
+    }
+    else
+    {
+        // RETN
+        uint16_t sp = cpu.SP;
+        cpu.PC = environment.ReadWord(sp);
+        cpu.SP = sp + 2;
+    }
+
+	return true;
+}
+
+bool zx::ReadScreenFromSnaSnapshot(File* file, uint8_t screen[0x1B00], uint8_t* borderColor)
+{
+    SnaHeader header;
+    if (file->read((uint8_t*)&header, SNA_HEADER_SIZE) != SNA_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    *borderColor = header.BorderColor & 0x07;
+
+    // Screen is at the start of bank 5
+    return file->read(screen, 0x1B00) == 0x1B00;
+}
+
+bool zx::SaveSnaSnapshot(File* file, uint8_t buffer1[0x4000])
+{
+#ifdef ZX128K
+    bool is128Mode = !(Environment.MemoryState.PagingLock == 1
+        && Environment.MemoryState.RomSelect == 1);
+    uint8_t pagedBank = Environment.MemoryState.RamBank;
+#else
+    bool is128Mode = false;
+    uint8_t pagedBank = 0;
+#endif
+
+    SnaHeader header;
+	header.InterruptRegister = Z80cpu.I;
+	header.HL_Dash = Z80cpu.HLx;
+	header.DE_Dash = Z80cpu.DEx;
+	header.BC_Dash = Z80cpu.BCx;
+	header.AF_Dash = Z80cpu.AFx;
+	header.HL = Z80cpu.HL;
+	header.DE = Z80cpu.DE;
+	header.BC = Z80cpu.BC;
+	header.IY = Z80cpu.IY;
+	header.IX = Z80cpu.IX;
+	header.Interrupt = Z80cpu.IFF2 ? 0x04 : 0x00;
+	header.RefreshRegister = Z80cpu.R;
+	header.AF = Z80cpu.AF;
+	header.SP = Z80cpu.SP;
+	header.InterruptMode = Z80cpu.IM & 0x03;
+	header.BorderColor = (Environment.BorderColor & 0x38) >> 3;
+
+    // 48K snapshot has PC on the stack. It is put only into the saved copy of the page,
+    // so that the emulated memory is not changed.
+    uint16_t pcAddress = 0;
+    if (!is128Mode)
+    {
+        header.SP -= 2;
+        pcAddress = header.SP;
+        if (pcAddress < 0x4000)
+        {
+            ESP_LOGE(TAG, "Stack is in ROM, PC is not saved");
+        }
+    }
+
+    if (file->write((uint8_t*)&header, SNA_HEADER_SIZE) != SNA_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    const uint8_t pages[] = { 5, 2, pagedBank };
+    for (int i = 0; i < 3; i++)
+    {
+        Environment.GetRamPage(pages[i])->ToBuffer(buffer1);
+
+        if (!is128Mode)
+        {
+            uint16_t pageStart = 0x4000 * (i + 1);
+            for (int j = 0; j < 2; j++)
+            {
+                uint16_t address = pcAddress + j;
+                if (address >= pageStart && address - pageStart < 0x4000)
+                {
+                    buffer1[address - pageStart] = j == 0 ? Z80cpu.PC & 0xFF : Z80cpu.PC >> 8;
+                }
+            }
+        }
+
+        if (file->write(buffer1, 0x4000) != 0x4000)
+        {
+            return false;
+        }
+    }
+
+    if (!is128Mode)
+    {
+        return true;
+    }
+
+    SnaExtension extension;
+    extension.PC = Z80cpu.PC;
+    extension.PagingState = Environment.MemoryState.Bits;
+    extension.TrDos = 0;
+    if (file->write((uint8_t*)&extension, sizeof(SnaExtension)) != sizeof(SnaExtension))
+    {
+        return false;
+    }
+
+#ifdef ZX128K
+    for (uint8_t pageNumber = 0; pageNumber < 8; pageNumber++)
+    {
+        if (pageNumber == 2 || pageNumber == 5 || pageNumber == pagedBank)
+        {
+            continue;
+        }
+
+        Environment.GetRamPage(pageNumber)->ToBuffer(buffer1);
+        if (file->write(buffer1, 0x4000) != 0x4000)
+        {
+            return false;
+        }
+    }
+#endif
+
+	return true;
+}
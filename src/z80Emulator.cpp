@@ -0,0 +1,83 @@
+#include "esp_log.h"
+
+#include "settings.h"
+#include "z80Emulator.h"
+
+// Core used at startup
+#if defined(CPU_LINKEFONG)
+#define CPU_DEFAULT Z80CoreType::LinKeFong
+#elif defined(CPU_STEVECHECKOWAY)
+#define CPU_DEFAULT Z80CoreType::SteveCheckoway
+#elif defined(CPU_ANDREWEISSFLOG)
+#define CPU_DEFAULT Z80CoreType::AndreWeissflog
+#else
+#define CPU_DEFAULT Z80CoreType::JLSanchez
+#endif
+
+#define Z80_COPY_REGISTER(TYPE, NAME) core->set_##NAME(this->_core->get_##NAME());
+
+z80Emulator::z80Emulator() : TStates(this),
+    A(this), F(this), B(this), C(this), D(this), E(this), H(this), L(this),
+    I(this), R(this), AF(this), BC(this), DE(this), HL(this),
+    AFx(this), BCx(this), DEx(this), HLx(this),
+    IX(this), IY(this), SP(this), PC(this),
+    IFF1(this), IFF2(this), IM(this)
+{
+    this->_coreType = CPU_DEFAULT;
+    this->_core = this->createCore(CPU_DEFAULT);
+    this->_cores[(int)CPU_DEFAULT] = this->_core;
+}
+
+z80Emulator::~z80Emulator()
+{
+    for (int i = 0; i < (int)Z80CoreType::Count; i++)
+    {
+        delete this->_cores[i];
+    }
+}
+
+z80Core* z80Emulator::createCore(Z80CoreType coreType)
+{
+    switch (coreType)
+    {
+    case Z80CoreType::LinKeFong:
+        return CreateCoreLKF();
+    case Z80CoreType::SteveCheckoway:
+        return CreateCoreZEL();
+    case Z80CoreType::AndreWeissflog:
+        return CreateCoreAW();
+    default:
+        return CreateCoreJLS();
+    }
+}
+
+void z80Emulator::setup(Z80Environment* environment)
+{
+    this->_environment = environment;
+    this->_core->setup(environment);
+}
+
+void z80Emulator::SelectCore(Z80CoreType coreType)
+{
+    if (coreType == this->_coreType)
+    {
+        return;
+    }
+
+    // Cores other than the first one are created when they are selected
+    z80Core* core = this->_cores[(int)coreType];
+    if (core == nullptr)
+    {
+        core = this->createCore(coreType);
+        core->setup(this->_environment);
+        core->reset();
+        this->_cores[(int)coreType] = core;
+    }
+
+    // Pending interrupt and HALT are not carried over, cores are switched right before the interrupt
+    Z80_REGISTERS(Z80_COPY_REGISTER)
+
+    this->_core = core;
+    this->_coreType = coreType;
+    ESP_LOGI(TAG, "CPU core %s", core->Name());
+}
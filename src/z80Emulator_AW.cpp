@@ -2,111 +2,168 @@
 
 #include "z80Emulator.h"
 
-#ifdef CPU_ANDREWEISSFLOG
-
 #include "z80_AW.h"
+#include "TapePlayer.h"
+#include "Debugger.h"
+
+class AWCore : public z80Core
+{
+private:
+    z80_t _zxCpu;
+    Z80Environment* _environment;
+
+public:
+    const char* Name() override { return "Andre Weissflog"; }
+
+    void setup(Z80Environment* environment) override;
+    void reset() override;
+    int emulate(int number_cycles) override;
+    void interrupt() override;
+
+    Z80_REGISTERS(Z80_CORE_OVERRIDE)
+};
 
-static z80_t _zxCpu;
-static Z80Environment* env;
+z80Core* CreateCoreAW()
+{
+    return new AWCore();
+}
+
+// Values of trap_id
+#define TRAP_TAPE 1
+#define TRAP_DEBUGGER 2
 
 extern "C" uint64_t cpu_tick(int num, uint64_t pins, void* user_data);
+extern "C" int cpu_trap(uint16_t pc, uint32_t ticks, uint64_t pins, void* trap_user_data);
 
-void z80Emulator::setup(Z80Environment* environment)
+void AWCore::setup(Z80Environment* environment)
 {
-    env = environment;
-    z80_desc_t init = { .tick_cb = cpu_tick, .user_data = nullptr };
-	z80_init(&_zxCpu, &init);    
+    this->_environment = environment;
+    z80_desc_t init = { .tick_cb = cpu_tick, .user_data = environment };
+	z80_init(&this->_zxCpu, &init);    
+    z80_trap_cb(&this->_zxCpu, cpu_trap, environment);
 }
 
-void z80Emulator::reset()
+void AWCore::reset()
 {
-    z80_reset(&_zxCpu);
+    z80_reset(&this->_zxCpu);
 }
 
-int z80Emulator::emulate(int number_cycles)
+int AWCore::emulate(int number_cycles)
 {
-    return z80_exec(&_zxCpu, number_cycles);
+    int cycles = 0;
+    do
+    {
+#ifdef DEBUGGER
+        // The trap checks the instructions after the first one
+        if (Debug.IsArmed() && Debug.OnInstruction(z80_pc(&this->_zxCpu)))
+        {
+            break;
+        }
+#endif
+        // Stops early at traps, TStates is counted by ticks
+        cycles += z80_exec(&this->_zxCpu, number_cycles - cycles);
+#ifdef DEBUGGER
+        if (this->_zxCpu.trap_id == TRAP_DEBUGGER)
+        {
+            // Stopped, the rest of the frame runs after resuming
+            break;
+        }
+#endif
+        if (this->_zxCpu.trap_id != 0)
+        {
+            uint32_t skipped = this->_environment->Tape->OnTrap(z80_pc(&this->_zxCpu), this->_environment->TStates);
+            this->_environment->TStates += skipped;
+            cycles += skipped;
+        }
+    } while (this->_zxCpu.trap_id != 0 && cycles < number_cycles);
+
+    return cycles;
 }
 
-void z80Emulator::interrupt()
+void AWCore::interrupt()
 {
-    _zxCpu.pins |= Z80_INT;
+    this->_zxCpu.pins |= Z80_INT;
 }
 
-uint8_t z80Emulator::get_A() { return z80_a(&_zxCpu); }
-void z80Emulator::set_A(uint8_t value) { z80_set_a(&_zxCpu, value); }
+uint8_t AWCore::get_A() { return z80_a(&this->_zxCpu); }
+void AWCore::set_A(uint8_t value) { z80_set_a(&this->_zxCpu, value); }
+
+uint8_t AWCore::get_F() { return z80_f(&this->_zxCpu); }
+void AWCore::set_F(uint8_t value) { z80_set_f(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_F() { return z80_f(&_zxCpu); }
-void z80Emulator::set_F(uint8_t value) { z80_set_f(&_zxCpu, value); }
+uint8_t AWCore::get_B() { return z80_b(&this->_zxCpu); }
+void AWCore::set_B(uint8_t value) { z80_set_b(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_B() { return z80_b(&_zxCpu); }
-void z80Emulator::set_B(uint8_t value) { z80_set_b(&_zxCpu, value); }
+uint8_t AWCore::get_C() { return z80_c(&this->_zxCpu); }
+void AWCore::set_C(uint8_t value) { z80_set_c(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_C() { return z80_c(&_zxCpu); }
-void z80Emulator::set_C(uint8_t value) { z80_set_c(&_zxCpu, value); }
+uint8_t AWCore::get_D() { return z80_d(&this->_zxCpu); }
+void AWCore::set_D(uint8_t value) { z80_set_d(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_D() { return z80_d(&_zxCpu); }
-void z80Emulator::set_D(uint8_t value) { z80_set_d(&_zxCpu, value); }
+uint8_t AWCore::get_E() { return z80_e(&this->_zxCpu); }
+void AWCore::set_E(uint8_t value) { z80_set_e(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_H() { return z80_h(&_zxCpu); }
-void z80Emulator::set_H(uint8_t value) { z80_set_h(&_zxCpu, value); }
+uint8_t AWCore::get_H() { return z80_h(&this->_zxCpu); }
+void AWCore::set_H(uint8_t value) { z80_set_h(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_L() { return z80_l(&_zxCpu); }
-void z80Emulator::set_L(uint8_t value) { z80_set_l(&_zxCpu, value); }
+uint8_t AWCore::get_L() { return z80_l(&this->_zxCpu); }
+void AWCore::set_L(uint8_t value) { z80_set_l(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_I() { return z80_i(&_zxCpu); }
-void z80Emulator::set_I(uint8_t value) { z80_set_i(&_zxCpu, value); }
+uint8_t AWCore::get_I() { return z80_i(&this->_zxCpu); }
+void AWCore::set_I(uint8_t value) { z80_set_i(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_R() { return z80_r(&_zxCpu); }
-void z80Emulator::set_R(uint8_t value) { z80_set_r(&_zxCpu, value); }
+uint8_t AWCore::get_R() { return z80_r(&this->_zxCpu); }
+void AWCore::set_R(uint8_t value) { z80_set_r(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_AF() { return z80_af(&_zxCpu); }
-void z80Emulator::set_AF(uint16_t value) { z80_set_af(&_zxCpu, value); }
+uint16_t AWCore::get_AF() { return z80_af(&this->_zxCpu); }
+void AWCore::set_AF(uint16_t value) { z80_set_af(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_BC() { return z80_bc(&_zxCpu); }
-void z80Emulator::set_BC(uint16_t value) { z80_set_bc(&_zxCpu, value); }
+uint16_t AWCore::get_BC() { return z80_bc(&this->_zxCpu); }
+void AWCore::set_BC(uint16_t value) { z80_set_bc(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_DE() { return z80_de(&_zxCpu); }
-void z80Emulator::set_DE(uint16_t value) { z80_set_de(&_zxCpu, value); }
+uint16_t AWCore::get_DE() { return z80_de(&this->_zxCpu); }
+void AWCore::set_DE(uint16_t value) { z80_set_de(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_HL() { return z80_hl(&_zxCpu); }
-void z80Emulator::set_HL(uint16_t value) { z80_set_hl(&_zxCpu, value); }
+uint16_t AWCore::get_HL() { return z80_hl(&this->_zxCpu); }
+void AWCore::set_HL(uint16_t value) { z80_set_hl(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_AFx() { return z80_af_(&_zxCpu); }
-void z80Emulator::set_AFx(uint16_t value) { z80_set_af_(&_zxCpu, value); }
+uint16_t AWCore::get_AFx() { return z80_af_(&this->_zxCpu); }
+void AWCore::set_AFx(uint16_t value) { z80_set_af_(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_BCx() { return z80_bc_(&_zxCpu); }
-void z80Emulator::set_BCx(uint16_t value) { z80_set_bc_(&_zxCpu, value); }
+uint16_t AWCore::get_BCx() { return z80_bc_(&this->_zxCpu); }
+void AWCore::set_BCx(uint16_t value) { z80_set_bc_(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_DEx() { return z80_de_(&_zxCpu); }
-void z80Emulator::set_DEx(uint16_t value) { z80_set_de_(&_zxCpu, value); }
+uint16_t AWCore::get_DEx() { return z80_de_(&this->_zxCpu); }
+void AWCore::set_DEx(uint16_t value) { z80_set_de_(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_HLx() { return z80_hl_(&_zxCpu); }
-void z80Emulator::set_HLx(uint16_t value) { z80_set_hl_(&_zxCpu, value); }
+uint16_t AWCore::get_HLx() { return z80_hl_(&this->_zxCpu); }
+void AWCore::set_HLx(uint16_t value) { z80_set_hl_(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_IX() { return z80_ix(&_zxCpu); }
-void z80Emulator::set_IX(uint16_t value) { z80_set_ix(&_zxCpu, value); }
+uint16_t AWCore::get_IX() { return z80_ix(&this->_zxCpu); }
+void AWCore::set_IX(uint16_t value) { z80_set_ix(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_IY() { return z80_iy(&_zxCpu); }
-void z80Emulator::set_IY(uint16_t value) { z80_set_iy(&_zxCpu, value); }
+uint16_t AWCore::get_IY() { return z80_iy(&this->_zxCpu); }
+void AWCore::set_IY(uint16_t value) { z80_set_iy(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_SP() { return z80_sp(&_zxCpu); }
-void z80Emulator::set_SP(uint16_t value) {z80_set_sp(&_zxCpu, value); }
+uint16_t AWCore::get_SP() { return z80_sp(&this->_zxCpu); }
+void AWCore::set_SP(uint16_t value) {z80_set_sp(&this->_zxCpu, value); }
 
-uint16_t z80Emulator::get_PC() { return z80_pc(&_zxCpu); }
-void z80Emulator::set_PC(uint16_t value) { z80_set_pc(&_zxCpu, value); }
+uint16_t AWCore::get_PC() { return z80_pc(&this->_zxCpu); }
+void AWCore::set_PC(uint16_t value) { z80_set_pc(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_IFF1() { return z80_iff1(&_zxCpu); }
-void z80Emulator::set_IFF1(uint8_t value) { z80_set_iff1(&_zxCpu, value); }
+uint8_t AWCore::get_IFF1() { return z80_iff1(&this->_zxCpu); }
+void AWCore::set_IFF1(uint8_t value) { z80_set_iff1(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_IFF2() { return z80_iff2(&_zxCpu); }
-void z80Emulator::set_IFF2(uint8_t value) { z80_set_iff2(&_zxCpu, value); }
+uint8_t AWCore::get_IFF2() { return z80_iff2(&this->_zxCpu); }
+void AWCore::set_IFF2(uint8_t value) { z80_set_iff2(&this->_zxCpu, value); }
 
-uint8_t z80Emulator::get_IM() { return z80_im(&_zxCpu); }
-void z80Emulator::set_IM(uint8_t value) { z80_set_im(&_zxCpu, value); }
+uint8_t AWCore::get_IM() { return z80_im(&this->_zxCpu); }
+void AWCore::set_IM(uint8_t value) { z80_set_im(&this->_zxCpu, value); }
 
 extern "C" uint64_t cpu_tick(int num, uint64_t pins, void* user_data)
 {
+    Z80Environment* env = (Z80Environment*)user_data;
+    env->TStates += num;
     if (pins & Z80_MREQ)
     {
         if (pins & Z80_RD)
@@ -134,4 +191,20 @@ extern "C" uint64_t cpu_tick(int num, uint64_t pins, void* user_data)
     return pins;
 }
 
-#endif
\ No newline at end of file
+// Stops execution at the end of an instruction when the tape needs it
+extern "C" int cpu_trap(uint16_t pc, uint32_t ticks, uint64_t pins, void* trap_user_data)
+{
+    TapePlayer* tape = ((Z80Environment*)trap_user_data)->Tape;
+    if (tape != nullptr && tape->IsTrap(pc))
+    {
+        // emulate() checks the debugger after the tape
+        return TRAP_TAPE;
+    }
+#ifdef DEBUGGER
+    if (Debug.IsArmed() && Debug.OnInstruction(pc))
+    {
+        return TRAP_DEBUGGER;
+    }
+#endif
+    return 0;
+}
@@ -2,10 +2,12 @@
 
 #include "z80Emulator.h"
 
-#ifdef CPU_JLSANCHEZ
-
 #include "z80.h"
 #include "z80operations.h"
+#include "TapePlayer.h"
+#include "Profiler.h"
+#include "TraceBuffer.h"
+#include "Debugger.h"
 
 class Operations : public Z80operations
 {
@@ -17,6 +19,7 @@ private:
 
 public:
     Z80Environment* _environment;
+    bool _interruptPending = false;
 
     uint8_t fetchOpcode(uint16_t address) override;
     uint8_t peek8(uint16_t address) override;
@@ -30,108 +33,185 @@ public:
     bool isActiveINT(void) override;    
 };
 
-static Operations z80Operations;
-static Z80 z80(&z80Operations);
+class JLSCore : public z80Core
+{
+private:
+    Operations _operations;
+    Z80 _z80;
+
+#ifdef TRACE_INSTRUCTIONS
+    void trace();
+#endif
+
+public:
+    JLSCore() : _z80(&this->_operations) { }
+
+    const char* Name() override { return "Jose Luis Sanchez"; }
+
+    void setup(Z80Environment* environment) override;
+    void reset() override;
+    int emulate(int number_cycles) override;
+    void interrupt() override;
+    uint32_t takeFetchCount() override;
+
+    Z80_REGISTERS(Z80_CORE_OVERRIDE)
+};
 
-static bool interruptPending = false;
+z80Core* CreateCoreJLS()
+{
+    return new JLSCore();
+}
 
-void z80Emulator::setup(Z80Environment* environment)
+void JLSCore::setup(Z80Environment* environment)
 {
-    z80Operations._environment = environment;
+    this->_operations._environment = environment;
 }
 
-void z80Emulator::reset()
+void JLSCore::reset()
 {
-    z80.reset();
+    this->_z80.reset();
 }
 
-int z80Emulator::emulate(int number_cycles)
+int JLSCore::emulate(int number_cycles)
 {
-    z80Operations._environment->TStates = 0;
-	while (z80Operations._environment->TStates < number_cycles)
+    // TStates goes on from the previous call, it is the time in the frame
+    uint32_t start = this->_operations._environment->TStates;
+    uint32_t end = start + number_cycles;
+    TapePlayer* tape = this->_operations._environment->Tape;
+	while (this->_operations._environment->TStates < end)
 	{
-		z80.execute();
+#ifdef DEBUGGER
+		if (Debug.IsArmed() && Debug.OnInstruction(this->_z80.getRegPC()))
+		{
+			// Stopped, the rest of the frame runs after resuming
+			return this->_operations._environment->TStates - start;
+		}
+#endif
+#ifdef TRACE_INSTRUCTIONS
+		this->trace();
+#endif
+#ifdef PROFILER
+		if (Profile.IsRunning())
+		{
+			uint16_t pc = this->_z80.getRegPC();
+			uint32_t tstates = this->_operations._environment->TStates;
+			this->_z80.execute();
+			Profile.OnInstruction(this->_operations._environment, pc, this->_operations._environment->TStates - tstates);
+		}
+		else
+#endif
+		this->_z80.execute();
+		uint16_t pc = this->_z80.getRegPC();
+		if (tape != nullptr && tape->IsTrap(pc))
+		{
+			this->_operations._environment->TStates += tape->OnTrap(pc, this->_operations._environment->TStates);
+		}
 	}  
 
-    return number_cycles;
+    // Last instruction usually runs past number_cycles
+    return this->_operations._environment->TStates - start;
+}
+
+#ifdef TRACE_INSTRUCTIONS
+void JLSCore::trace()
+{
+    TraceEntry* entry = Trace.Next(this->_operations._environment, this->_z80.getRegPC());
+    entry->AF = this->_z80.getRegAF();
+    entry->BC = this->_z80.getRegBC();
+    entry->DE = this->_z80.getRegDE();
+    entry->HL = this->_z80.getRegHL();
+    entry->IX = this->_z80.getRegIX();
+    entry->IY = this->_z80.getRegIY();
+    entry->SP = this->_z80.getRegSP();
+}
+#endif
+
+void JLSCore::interrupt()
+{
+    this->_operations._interruptPending = true;
 }
 
-void z80Emulator::interrupt()
+uint32_t JLSCore::takeFetchCount()
 {
-    interruptPending = true;
+    uint32_t fetches = this->_z80.getFetchCount();
+    this->_z80.setFetchCount(0);
+    return fetches;
 }
 
-uint8_t z80Emulator::get_A() { return z80.getRegA(); }
-void z80Emulator::set_A(uint8_t value) { z80.setRegA(value); }
+uint8_t JLSCore::get_A() { return this->_z80.getRegA(); }
+void JLSCore::set_A(uint8_t value) { this->_z80.setRegA(value); }
 
-uint8_t z80Emulator::get_F() { return z80.getFlags(); }
-void z80Emulator::set_F(uint8_t value) { z80.setFlags(value); }
+uint8_t JLSCore::get_F() { return this->_z80.getFlags(); }
+void JLSCore::set_F(uint8_t value) { this->_z80.setFlags(value); }
 
-uint8_t z80Emulator::get_B() { return z80.getRegB(); }
-void z80Emulator::set_B(uint8_t value) { z80.setRegB(value); }
+uint8_t JLSCore::get_B() { return this->_z80.getRegB(); }
+void JLSCore::set_B(uint8_t value) { this->_z80.setRegB(value); }
 
-uint8_t z80Emulator::get_C() { return z80.getRegC(); }
-void z80Emulator::set_C(uint8_t value) { z80.setRegC(value); }
+uint8_t JLSCore::get_C() { return this->_z80.getRegC(); }
+void JLSCore::set_C(uint8_t value) { this->_z80.setRegC(value); }
 
-uint8_t z80Emulator::get_D() { return z80.getRegD(); }
-void z80Emulator::set_D(uint8_t value) { z80.setRegD(value); }
+uint8_t JLSCore::get_D() { return this->_z80.getRegD(); }
+void JLSCore::set_D(uint8_t value) { this->_z80.setRegD(value); }
 
-uint8_t z80Emulator::get_H() { return z80.getRegH(); }
-void z80Emulator::set_H(uint8_t value) { z80.setRegH(value); }
+uint8_t JLSCore::get_E() { return this->_z80.getRegE(); }
+void JLSCore::set_E(uint8_t value) { this->_z80.setRegE(value); }
 
-uint8_t z80Emulator::get_L() { return z80.getRegL(); }
-void z80Emulator::set_L(uint8_t value) { z80.setRegL(value); }
+uint8_t JLSCore::get_H() { return this->_z80.getRegH(); }
+void JLSCore::set_H(uint8_t value) { this->_z80.setRegH(value); }
 
-uint8_t z80Emulator::get_I() { return z80.getRegI(); }
-void z80Emulator::set_I(uint8_t value) { z80.setRegI(value); }
+uint8_t JLSCore::get_L() { return this->_z80.getRegL(); }
+void JLSCore::set_L(uint8_t value) { this->_z80.setRegL(value); }
 
-uint8_t z80Emulator::get_R() { return z80.getRegR(); }
-void z80Emulator::set_R(uint8_t value) { z80.setRegR(value); }
+uint8_t JLSCore::get_I() { return this->_z80.getRegI(); }
+void JLSCore::set_I(uint8_t value) { this->_z80.setRegI(value); }
 
-uint16_t z80Emulator::get_AF() { return z80.getRegAF(); }
-void z80Emulator::set_AF(uint16_t value) { z80.setRegAF(value); }
+uint8_t JLSCore::get_R() { return this->_z80.getRegR(); }
+void JLSCore::set_R(uint8_t value) { this->_z80.setRegR(value); }
 
-uint16_t z80Emulator::get_BC() { return z80.getRegBC(); }
-void z80Emulator::set_BC(uint16_t value) { z80.setRegBC(value); }
+uint16_t JLSCore::get_AF() { return this->_z80.getRegAF(); }
+void JLSCore::set_AF(uint16_t value) { this->_z80.setRegAF(value); }
 
-uint16_t z80Emulator::get_DE() { return z80.getRegDE(); }
-void z80Emulator::set_DE(uint16_t value) { z80.setRegDE(value); }
+uint16_t JLSCore::get_BC() { return this->_z80.getRegBC(); }
+void JLSCore::set_BC(uint16_t value) { this->_z80.setRegBC(value); }
 
-uint16_t z80Emulator::get_HL() { return z80.getRegHL(); }
-void z80Emulator::set_HL(uint16_t value) { z80.setRegHL(value); }
+uint16_t JLSCore::get_DE() { return this->_z80.getRegDE(); }
+void JLSCore::set_DE(uint16_t value) { this->_z80.setRegDE(value); }
 
-uint16_t z80Emulator::get_AFx() { return z80.getRegAFx(); }
-void z80Emulator::set_AFx(uint16_t value) { z80.setRegAFx(value); }
+uint16_t JLSCore::get_HL() { return this->_z80.getRegHL(); }
+void JLSCore::set_HL(uint16_t value) { this->_z80.setRegHL(value); }
 
-uint16_t z80Emulator::get_BCx() { return z80.getRegBCx(); }
-void z80Emulator::set_BCx(uint16_t value) { z80.setRegBCx(value); }
+uint16_t JLSCore::get_AFx() { return this->_z80.getRegAFx(); }
+void JLSCore::set_AFx(uint16_t value) { this->_z80.setRegAFx(value); }
 
-uint16_t z80Emulator::get_DEx() { return z80.getRegDEx(); }
-void z80Emulator::set_DEx(uint16_t value) { z80.setRegDEx(value); }
+uint16_t JLSCore::get_BCx() { return this->_z80.getRegBCx(); }
+void JLSCore::set_BCx(uint16_t value) { this->_z80.setRegBCx(value); }
 
-uint16_t z80Emulator::get_HLx() { return z80.getRegHLx(); }
-void z80Emulator::set_HLx(uint16_t value) { z80.setRegHLx(value); }
+uint16_t JLSCore::get_DEx() { return this->_z80.getRegDEx(); }
+void JLSCore::set_DEx(uint16_t value) { this->_z80.setRegDEx(value); }
 
-uint16_t z80Emulator::get_IX() { return z80.getRegIX(); }
-void z80Emulator::set_IX(uint16_t value) { z80.setRegIX(value); }
+uint16_t JLSCore::get_HLx() { return this->_z80.getRegHLx(); }
+void JLSCore::set_HLx(uint16_t value) { this->_z80.setRegHLx(value); }
 
-uint16_t z80Emulator::get_IY() { return z80.getRegIY(); }
-void z80Emulator::set_IY(uint16_t value) { z80.setRegIY(value); }
+uint16_t JLSCore::get_IX() { return this->_z80.getRegIX(); }
+void JLSCore::set_IX(uint16_t value) { this->_z80.setRegIX(value); }
 
-uint16_t z80Emulator::get_SP() { return z80.getRegSP(); }
-void z80Emulator::set_SP(uint16_t value) { z80.setRegSP(value); }
+uint16_t JLSCore::get_IY() { return this->_z80.getRegIY(); }
+void JLSCore::set_IY(uint16_t value) { this->_z80.setRegIY(value); }
 
-uint16_t z80Emulator::get_PC() { return z80.getRegPC(); }
-void z80Emulator::set_PC(uint16_t value) { z80.setRegPC(value); }
+uint16_t JLSCore::get_SP() { return this->_z80.getRegSP(); }
+void JLSCore::set_SP(uint16_t value) { this->_z80.setRegSP(value); }
 
-uint8_t z80Emulator::get_IFF1() { return z80.isIFF1() ? 1 : 0; }
-void z80Emulator::set_IFF1(uint8_t value) { z80.setIFF1(value == 1);  }
+uint16_t JLSCore::get_PC() { return this->_z80.getRegPC(); }
+void JLSCore::set_PC(uint16_t value) { this->_z80.setRegPC(value); }
 
-uint8_t z80Emulator::get_IFF2() { return z80.isIFF2() ? 1 : 0; }
-void z80Emulator::set_IFF2(uint8_t value) { z80.setIFF2(value == 1); }
+uint8_t JLSCore::get_IFF1() { return this->_z80.isIFF1() ? 1 : 0; }
+void JLSCore::set_IFF1(uint8_t value) { this->_z80.setIFF1(value == 1);  }
 
-uint8_t z80Emulator::get_IM() { return (uint8_t)z80.getIM(); }
-void z80Emulator::set_IM(uint8_t value) { z80.setIM((Z80::IntMode)value); }
+uint8_t JLSCore::get_IFF2() { return this->_z80.isIFF2() ? 1 : 0; }
+void JLSCore::set_IFF2(uint8_t value) { this->_z80.setIFF2(value == 1); }
+
+uint8_t JLSCore::get_IM() { return (uint8_t)this->_z80.getIM(); }
+void JLSCore::set_IM(uint8_t value) { this->_z80.setIM((Z80::IntMode)value); }
 
 
 #define ADDRESS_IN_LOW_RAM(addr) (1 == (addr >> 14))
@@ -256,9 +336,7 @@ void Operations::interruptHandlingTime(int32_t wstates)
 /* Callback to know when the INT signal is active */
 bool Operations::isActiveINT(void) 
 {
-    if (!interruptPending) return false;
-    interruptPending = false;
+    if (!this->_interruptPending) return false;
+    this->_interruptPending = false;
     return true;
 }
-
-#endif
\ No newline at end of file
@@ -2,152 +2,251 @@
 
 #include "z80Emulator.h"
 
-#ifdef CPU_LINKEFONG
-
 #include "z80emu.h"
 #include "z80user.h"
-
-static Z80_STATE z80_state;
-static Z80_STATE* state = &z80_state;
-static CONTEXT context;
-static Z80Environment* env;
+#include "TapePlayer.h"
+#include "Profiler.h"
+#include "TraceBuffer.h"
+#include "Debugger.h"
 
 extern "C"
 {
-    uint8_t readbyte(uint16_t addr);
-    uint16_t readword(uint16_t addr);
-    void writebyte(uint16_t addr, uint8_t data);
-    void writeword(uint16_t addr, uint16_t data);
-    uint8_t input(uint8_t portLow, uint8_t portHigh);
-    void output(uint8_t portLow, uint8_t portHigh, uint8_t data);
+    uint8_t readbyte(void* environment, uint16_t addr);
+    uint16_t readword(void* environment, uint16_t addr);
+    void writebyte(void* environment, uint16_t addr, uint8_t data);
+    void writeword(void* environment, uint16_t addr, uint16_t data);
+    uint8_t input(void* environment, uint8_t portLow, uint8_t portHigh);
+    void output(void* environment, uint8_t portLow, uint8_t portHigh, uint8_t data);
+#ifdef TRACE_INSTRUCTIONS
+    void instruction(void* environment, void* state, uint16_t pc, int elapsed_cycles);
+#endif
+}
+
+class LKFCore : public z80Core
+{
+private:
+    Z80_STATE _state;
+    CONTEXT _context;
+    Z80Environment* _environment;
+
+public:
+    const char* Name() override { return "Lin Ke-Fong"; }
+
+    void setup(Z80Environment* environment) override;
+    void reset() override;
+    int emulate(int number_cycles) override;
+    void interrupt() override;
+    uint32_t takeFetchCount() override;
+
+    Z80_REGISTERS(Z80_CORE_OVERRIDE)
+};
+
+z80Core* CreateCoreLKF()
+{
+    return new LKFCore();
+}
+
+void LKFCore::setup(Z80Environment* environment)
+{
+    this->_environment = environment;
+    this->_context.environment = environment;
+    this->_context.readbyte = readbyte;
+    this->_context.readword = readword;
+    this->_context.writeword = writeword;
+    this->_context.writebyte = writebyte;
+    this->_context.input = input;
+    this->_context.output = output;
+#ifdef TRACE_INSTRUCTIONS
+    this->_context.instruction = instruction;
+#endif
+    this->_context.fetches = 0;
 }
 
-void z80Emulator::setup(Z80Environment* environment)
+void LKFCore::reset()
 {
-    env = environment;
-    context.readbyte = readbyte;
-    context.readword = readword;
-    context.writeword = writeword;
-    context.writebyte = writebyte;
-    context.input = input;
-    context.output = output;
+    Z80Reset(&this->_state);
 }
 
-void z80Emulator::reset()
+int LKFCore::emulate(int number_cycles)
 {
-    Z80Reset(state);
+    // Emulation stops after each DI, so LD-BYTES is caught right after its DI.
+    // While the tape plays, it runs in short slices so that port reads see the time of the slice.
+    TapePlayer* tape = this->_environment->Tape;
+    uint32_t start = this->_environment->TStates;
+    int cycles = 0;
+    do
+    {
+        this->_environment->TStates = start + cycles;
+        int sliceCycles = number_cycles - cycles;
+        if (tape != nullptr && tape->IsPlaying() && sliceCycles > TAPE_SLICE_TSTATES)
+        {
+            sliceCycles = TAPE_SLICE_TSTATES;
+        }
+
+#ifdef DEBUGGER
+        if (Debug.IsArmed())
+        {
+            // One instruction at a time, so that each of them is checked
+            if (Debug.OnInstruction(this->_state.pc))
+            {
+                break;
+            }
+            sliceCycles = 1;
+        }
+#endif
+
+#ifdef PROFILER
+        if (Profile.IsRunning())
+        {
+            // One instruction at a time, so that each of them is counted
+            uint16_t pc = this->_state.pc;
+            int elapsed = Z80Emulate(&this->_state, 1, &this->_context);
+            Profile.OnInstruction(this->_environment, pc, elapsed);
+            cycles += elapsed;
+        }
+        else
+#endif
+        cycles += Z80Emulate(&this->_state, sliceCycles, &this->_context);
+        if (tape != nullptr && tape->IsTrap(this->_state.pc))
+        {
+            cycles += tape->OnTrap(this->_state.pc, start + cycles);
+        }
+    } while (cycles < number_cycles);
+
+    this->_environment->TStates = start + cycles;
+    return cycles;
 }
 
-int z80Emulator::emulate(int number_cycles)
+void LKFCore::interrupt()
 {
-    return Z80Emulate(state, number_cycles, &context);
+    Z80Interrupt(&this->_state, 0xff, &this->_context);
 }
 
-void z80Emulator::interrupt()
+uint32_t LKFCore::takeFetchCount()
 {
-    Z80Interrupt(state, 0xff, &context);
+    uint32_t fetches = this->_context.fetches;
+    this->_context.fetches = 0;
+    return fetches;
 }
 
-uint8_t z80Emulator::get_A() { return state->registers.byte[Z80_A]; }
-void z80Emulator::set_A(uint8_t value) { state->registers.byte[Z80_A] = value; }
+uint8_t LKFCore::get_A() { return this->_state.registers.byte[Z80_A]; }
+void LKFCore::set_A(uint8_t value) { this->_state.registers.byte[Z80_A] = value; }
+
+uint8_t LKFCore::get_F() { return this->_state.registers.byte[Z80_F]; }
+void LKFCore::set_F(uint8_t value) { this->_state.registers.byte[Z80_F] = value; }
 
-uint8_t z80Emulator::get_F() { return state->registers.byte[Z80_F]; }
-void z80Emulator::set_F(uint8_t value) { state->registers.byte[Z80_F] = value; }
+uint8_t LKFCore::get_B() { return this->_state.registers.byte[Z80_B]; }
+void LKFCore::set_B(uint8_t value) { this->_state.registers.byte[Z80_B] = value; }
 
-uint8_t z80Emulator::get_B() { return state->registers.byte[Z80_B]; }
-void z80Emulator::set_B(uint8_t value) { state->registers.byte[Z80_B] = value; }
+uint8_t LKFCore::get_C() { return this->_state.registers.byte[Z80_C]; }
+void LKFCore::set_C(uint8_t value) { this->_state.registers.byte[Z80_C] = value; }
 
-uint8_t z80Emulator::get_C() { return state->registers.byte[Z80_C]; }
-void z80Emulator::set_C(uint8_t value) { state->registers.byte[Z80_C] = value; }
+uint8_t LKFCore::get_D() { return this->_state.registers.byte[Z80_D]; }
+void LKFCore::set_D(uint8_t value) { this->_state.registers.byte[Z80_D] = value; }
 
-uint8_t z80Emulator::get_D() { return state->registers.byte[Z80_D]; }
-void z80Emulator::set_D(uint8_t value) { state->registers.byte[Z80_D] = value; }
+uint8_t LKFCore::get_E() { return this->_state.registers.byte[Z80_E]; }
+void LKFCore::set_E(uint8_t value) { this->_state.registers.byte[Z80_E] = value; }
 
-uint8_t z80Emulator::get_H() { return state->registers.byte[Z80_H]; }
-void z80Emulator::set_H(uint8_t value) { state->registers.byte[Z80_H] = value; }
+uint8_t LKFCore::get_H() { return this->_state.registers.byte[Z80_H]; }
+void LKFCore::set_H(uint8_t value) { this->_state.registers.byte[Z80_H] = value; }
 
-uint8_t z80Emulator::get_L() { return state->registers.byte[Z80_L]; }
-void z80Emulator::set_L(uint8_t value) { state->registers.byte[Z80_L] = value; }
+uint8_t LKFCore::get_L() { return this->_state.registers.byte[Z80_L]; }
+void LKFCore::set_L(uint8_t value) { this->_state.registers.byte[Z80_L] = value; }
 
-uint8_t z80Emulator::get_I() { return (uint8_t)state->i; }
-void z80Emulator::set_I(uint8_t value) { state->i = value; }
+uint8_t LKFCore::get_I() { return (uint8_t)this->_state.i; }
+void LKFCore::set_I(uint8_t value) { this->_state.i = value; }
 
-uint8_t z80Emulator::get_R() { return (uint8_t)state->r; }
-void z80Emulator::set_R(uint8_t value) { state->r = value; }
+uint8_t LKFCore::get_R() { return (uint8_t)this->_state.r; }
+void LKFCore::set_R(uint8_t value) { this->_state.r = value; }
 
-uint16_t z80Emulator::get_AF() { return state->registers.word[Z80_AF]; }
-void z80Emulator::set_AF(uint16_t value) { state->registers.word[Z80_AF] = value; }
+uint16_t LKFCore::get_AF() { return this->_state.registers.word[Z80_AF]; }
+void LKFCore::set_AF(uint16_t value) { this->_state.registers.word[Z80_AF] = value; }
 
-uint16_t z80Emulator::get_BC() { return state->registers.word[Z80_BC]; }
-void z80Emulator::set_BC(uint16_t value) { state->registers.word[Z80_BC] = value; }
+uint16_t LKFCore::get_BC() { return this->_state.registers.word[Z80_BC]; }
+void LKFCore::set_BC(uint16_t value) { this->_state.registers.word[Z80_BC] = value; }
 
-uint16_t z80Emulator::get_DE() { return state->registers.word[Z80_DE]; }
-void z80Emulator::set_DE(uint16_t value) { state->registers.word[Z80_DE] = value; }
+uint16_t LKFCore::get_DE() { return this->_state.registers.word[Z80_DE]; }
+void LKFCore::set_DE(uint16_t value) { this->_state.registers.word[Z80_DE] = value; }
 
-uint16_t z80Emulator::get_HL() { return state->registers.word[Z80_HL]; }
-void z80Emulator::set_HL(uint16_t value) { state->registers.word[Z80_HL] = value; }
+uint16_t LKFCore::get_HL() { return this->_state.registers.word[Z80_HL]; }
+void LKFCore::set_HL(uint16_t value) { this->_state.registers.word[Z80_HL] = value; }
 
-uint16_t z80Emulator::get_AFx() { return state->alternates[Z80_AF]; }
-void z80Emulator::set_AFx(uint16_t value) { state->alternates[Z80_AF] = value; }
+uint16_t LKFCore::get_AFx() { return this->_state.alternates[Z80_AF]; }
+void LKFCore::set_AFx(uint16_t value) { this->_state.alternates[Z80_AF] = value; }
 
-uint16_t z80Emulator::get_BCx() { return state->alternates[Z80_BC]; }
-void z80Emulator::set_BCx(uint16_t value) { state->alternates[Z80_BC] = value; }
+uint16_t LKFCore::get_BCx() { return this->_state.alternates[Z80_BC]; }
+void LKFCore::set_BCx(uint16_t value) { this->_state.alternates[Z80_BC] = value; }
 
-uint16_t z80Emulator::get_DEx() { return state->alternates[Z80_DE]; }
-void z80Emulator::set_DEx(uint16_t value) { state->alternates[Z80_DE] = value; }
+uint16_t LKFCore::get_DEx() { return this->_state.alternates[Z80_DE]; }
+void LKFCore::set_DEx(uint16_t value) { this->_state.alternates[Z80_DE] = value; }
 
-uint16_t z80Emulator::get_HLx() { return state->alternates[Z80_HL]; }
-void z80Emulator::set_HLx(uint16_t value) { state->alternates[Z80_HL] = value; }
+uint16_t LKFCore::get_HLx() { return this->_state.alternates[Z80_HL]; }
+void LKFCore::set_HLx(uint16_t value) { this->_state.alternates[Z80_HL] = value; }
 
-uint16_t z80Emulator::get_IX() { return state->registers.word[Z80_IX]; }
-void z80Emulator::set_IX(uint16_t value) { state->registers.word[Z80_IX] = value; }
+uint16_t LKFCore::get_IX() { return this->_state.registers.word[Z80_IX]; }
+void LKFCore::set_IX(uint16_t value) { this->_state.registers.word[Z80_IX] = value; }
 
-uint16_t z80Emulator::get_IY() { return state->registers.word[Z80_IY]; }
-void z80Emulator::set_IY(uint16_t value) { state->registers.word[Z80_IY] = value; }
+uint16_t LKFCore::get_IY() { return this->_state.registers.word[Z80_IY]; }
+void LKFCore::set_IY(uint16_t value) { this->_state.registers.word[Z80_IY] = value; }
 
-uint16_t z80Emulator::get_SP() { return state->registers.word[Z80_SP]; }
-void z80Emulator::set_SP(uint16_t value) { state->registers.word[Z80_SP] = value; }
+uint16_t LKFCore::get_SP() { return this->_state.registers.word[Z80_SP]; }
+void LKFCore::set_SP(uint16_t value) { this->_state.registers.word[Z80_SP] = value; }
 
-uint16_t z80Emulator::get_PC() { return (uint16_t)state->pc; }
-void z80Emulator::set_PC(uint16_t value) { state->pc = value; }
+uint16_t LKFCore::get_PC() { return (uint16_t)this->_state.pc; }
+void LKFCore::set_PC(uint16_t value) { this->_state.pc = value; }
 
-uint8_t z80Emulator::get_IFF1() { return (uint8_t)state->iff1; }
-void z80Emulator::set_IFF1(uint8_t value) { state->iff1 = value; }
+uint8_t LKFCore::get_IFF1() { return (uint8_t)this->_state.iff1; }
+void LKFCore::set_IFF1(uint8_t value) { this->_state.iff1 = value; }
 
-uint8_t z80Emulator::get_IFF2() { return (uint8_t)state->iff2; }
-void z80Emulator::set_IFF2(uint8_t value) { state->iff2 = value; }
+uint8_t LKFCore::get_IFF2() { return (uint8_t)this->_state.iff2; }
+void LKFCore::set_IFF2(uint8_t value) { this->_state.iff2 = value; }
 
-uint8_t z80Emulator::get_IM() { return (uint8_t)state->im; }
-void z80Emulator::set_IM(uint8_t value) { state->im = value; }
+uint8_t LKFCore::get_IM() { return (uint8_t)this->_state.im; }
+void LKFCore::set_IM(uint8_t value) { this->_state.im = value; }
 
-extern "C" uint8_t readbyte(uint16_t addr)
+extern "C" uint8_t readbyte(void* environment, uint16_t addr)
 {
-    return env->ReadByte(addr);
+    return ((Z80Environment*)environment)->ReadByte(addr);
 }
 
-extern "C" uint16_t readword(uint16_t addr)
+extern "C" uint16_t readword(void* environment, uint16_t addr)
 {
-    return env->ReadWord(addr);
+    return ((Z80Environment*)environment)->ReadWord(addr);
 }
 
-extern "C" void writebyte(uint16_t addr, uint8_t data)
+extern "C" void writebyte(void* environment, uint16_t addr, uint8_t data)
 {
-    env->WriteByte(addr, data);
+    ((Z80Environment*)environment)->WriteByte(addr, data);
 }
 
-extern "C" void writeword(uint16_t addr, uint16_t data)
+extern "C" void writeword(void* environment, uint16_t addr, uint16_t data)
 {
-    env->WriteWord(addr, data);
+    ((Z80Environment*)environment)->WriteWord(addr, data);
 }
 
-extern "C" uint8_t input(uint8_t portLow, uint8_t portHigh)
+extern "C" uint8_t input(void* environment, uint8_t portLow, uint8_t portHigh)
 {
-    return env->Input(portLow, portHigh);
+    return ((Z80Environment*)environment)->Input(portLow, portHigh);
 }
 
-extern "C" void output(uint8_t portLow, uint8_t portHigh, uint8_t data)
+extern "C" void output(void* environment, uint8_t portLow, uint8_t portHigh, uint8_t data)
 {
-    env->Output(portLow, portHigh, data);
+    ((Z80Environment*)environment)->Output(portLow, portHigh, data);
 }
 
-#endif
\ No newline at end of file
+#ifdef TRACE_INSTRUCTIONS
+// Called by the emulation loop before each instruction, TStates is the start of the slice
+extern "C" void instruction(void* environment, void* state, uint16_t pc, int elapsed_cycles)
+{
+    Z80_STATE* z80 = (Z80_STATE*)state;
+    TraceEntry* entry = Trace.Next((Z80Environment*)environment, pc);
+    entry->TStates += elapsed_cycles;
+    entry->AF = z80->registers.word[Z80_AF];
+    entry->BC = z80->registers.word[Z80_BC];
+    entry->DE = z80->registers.word[Z80_DE];
+    entry->HL = z80->registers.word[Z80_HL];
+    entry->IX = z80->registers.word[Z80_IX];
+    entry->IY = z80->registers.word[Z80_IY];
+    entry->SP = z80->registers.word[Z80_SP];
+}
+#endif
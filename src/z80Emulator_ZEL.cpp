@@ -2,14 +2,46 @@
 
 #include "z80Emulator.h"
 
-#ifdef CPU_STEVECHECKOWAY
-
 #include "zel/z80_instructions.h"
 #include "zel/z80.h"
 #include "z80_types.h"
+#include "TapePlayer.h"
+#include "Debugger.h"
+
+class ZELCore : public z80Core
+{
+private:
+    Z80 _zxCpu = nullptr;
+    Z80Environment* _environment;
+
+public:
+    ~ZELCore() override
+    {
+        if (this->_zxCpu != nullptr)
+        {
+            Z80_Free(this->_zxCpu);
+        }
+    }
+
+    const char* Name() override { return "Steve Checkoway"; }
+
+    void setup(Z80Environment* environment) override;
+    void reset() override;
+    int emulate(int number_cycles) override;
+    void interrupt() override;
 
-static Z80 _zxCpu;
-static Z80Environment* env;
+    Z80_REGISTERS(Z80_CORE_OVERRIDE)
+};
+
+z80Core* CreateCoreZEL()
+{
+    return new ZELCore();
+}
+
+static inline Z80Environment* environmentOf(Z80 cpu)
+{
+    return (Z80Environment*)cpu->user_data;
+}
 
 extern "C" uint8_t ReadMem(uint16_t addr, bool inst, Z80 cpu);
 extern "C" void WriteMem(uint16_t addr, uint8_t val, Z80 cpu);
@@ -18,9 +50,9 @@ extern "C" uint8_t ReadIO(uint16_t addr, Z80 cpu);
 extern "C" void WriteIO(uint16_t addr, uint8_t val, Z80 cpu);
 extern "C" void InterruptComplete(Z80 cpu);
 
-void z80Emulator::setup(Z80Environment* environment)
+void ZELCore::setup(Z80Environment* environment)
 {
-    env = environment;
+    this->_environment = environment;
 
     Z80FunctionBlock functionBlock;
     functionBlock.ReadMem = ReadMem;
@@ -31,118 +63,139 @@ void z80Emulator::setup(Z80Environment* environment)
     functionBlock.InterruptComplete = InterruptComplete;
     functionBlock.ControlFlow = nullptr;
 
-    _zxCpu = Z80_New(&functionBlock);
+    this->_zxCpu = Z80_New(&functionBlock);
+    this->_zxCpu->user_data = environment;
 }
 
-void z80Emulator::reset()
+void ZELCore::reset()
 {
     // set AF to 0xFFFF, all other regs are undefined
-    Z80_SetReg(REG_AF, 0xFFFF, _zxCpu);
+    Z80_SetReg(REG_AF, 0xFFFF, this->_zxCpu);
 
     // set SP to 0xFFFF, PC to 0x0000
-    Z80_SetReg(REG_SP, 0xFFFF, _zxCpu);
-    Z80_SetReg(REG_PC, 0x0000, _zxCpu);
+    Z80_SetReg(REG_SP, 0xFFFF, this->_zxCpu);
+    Z80_SetReg(REG_PC, 0x0000, this->_zxCpu);
 
     // IFF1 and IFF2 are off
-    _zxCpu->iff1 = false;
-    _zxCpu->iff2 = false;
+    this->_zxCpu->iff1 = false;
+    this->_zxCpu->iff2 = false;
 
     // IM is set to 0
-    _zxCpu->interrupt_mode = 0;
+    this->_zxCpu->interrupt_mode = 0;
 
     // after power-on or reset, R is set to 0
     this->set_R(0);
 
-    Z80_ClearHalt(_zxCpu);
+    Z80_ClearHalt(this->_zxCpu);
 }
 
-int z80Emulator::emulate(int number_cycles)
+int ZELCore::emulate(int number_cycles)
 {
+    TapePlayer* tape = this->_environment->Tape;
+    uint32_t start = this->_environment->TStates;
     int cycles = 0;
     while (cycles < number_cycles)
     {
-        cycles += Z80_Step(nullptr, _zxCpu);
+        // Port reads see the time of the start of the instruction
+        this->_environment->TStates = start + cycles;
+#ifdef DEBUGGER
+        if (Debug.IsArmed() && Debug.OnInstruction(Z80_GetReg(REG_PC, this->_zxCpu)))
+        {
+            // Stopped, the rest of the frame runs after resuming
+            break;
+        }
+#endif
+        cycles += Z80_Step(nullptr, this->_zxCpu);
+        uint16_t pc = Z80_GetReg(REG_PC, this->_zxCpu);
+        if (tape != nullptr && tape->IsTrap(pc))
+        {
+            cycles += tape->OnTrap(pc, start + cycles);
+        }
     }
 
+    this->_environment->TStates = start + cycles;
     return cycles;
 }
 
-void z80Emulator::interrupt()
+void ZELCore::interrupt()
 {
-    Z80_RaiseInterrupt(_zxCpu);
+    Z80_RaiseInterrupt(this->_zxCpu);
 }
 
-uint8_t z80Emulator::get_A() { return _zxCpu->byte_reg[REG_A]; }
-void z80Emulator::set_A(uint8_t value) { _zxCpu->byte_reg[REG_A] = value; }
+uint8_t ZELCore::get_A() { return this->_zxCpu->byte_reg[REG_A]; }
+void ZELCore::set_A(uint8_t value) { this->_zxCpu->byte_reg[REG_A] = value; }
 
-uint8_t z80Emulator::get_F() { return _zxCpu->byte_reg[REG_F]; }
-void z80Emulator::set_F(uint8_t value) { _zxCpu->byte_reg[REG_F] = value; }
+uint8_t ZELCore::get_F() { return this->_zxCpu->byte_reg[REG_F]; }
+void ZELCore::set_F(uint8_t value) { this->_zxCpu->byte_reg[REG_F] = value; }
 
-uint8_t z80Emulator::get_B() { return _zxCpu->byte_reg[REG_B]; }
-void z80Emulator::set_B(uint8_t value) { _zxCpu->byte_reg[REG_B] = value; }
+uint8_t ZELCore::get_B() { return this->_zxCpu->byte_reg[REG_B]; }
+void ZELCore::set_B(uint8_t value) { this->_zxCpu->byte_reg[REG_B] = value; }
 
-uint8_t z80Emulator::get_C() { return _zxCpu->byte_reg[REG_C]; }
-void z80Emulator::set_C(uint8_t value) { _zxCpu->byte_reg[REG_C] = value; }
+uint8_t ZELCore::get_C() { return this->_zxCpu->byte_reg[REG_C]; }
+void ZELCore::set_C(uint8_t value) { this->_zxCpu->byte_reg[REG_C] = value; }
 
-uint8_t z80Emulator::get_D() { return _zxCpu->byte_reg[REG_D]; }
-void z80Emulator::set_D(uint8_t value) { _zxCpu->byte_reg[REG_D] = value; }
+uint8_t ZELCore::get_D() { return this->_zxCpu->byte_reg[REG_D]; }
+void ZELCore::set_D(uint8_t value) { this->_zxCpu->byte_reg[REG_D] = value; }
 
-uint8_t z80Emulator::get_H() { return _zxCpu->byte_reg[REG_H]; }
-void z80Emulator::set_H(uint8_t value) { _zxCpu->byte_reg[REG_H] = value; }
+uint8_t ZELCore::get_E() { return this->_zxCpu->byte_reg[REG_E]; }
+void ZELCore::set_E(uint8_t value) { this->_zxCpu->byte_reg[REG_E] = value; }
 
-uint8_t z80Emulator::get_L() { return _zxCpu->byte_reg[REG_L]; }
-void z80Emulator::set_L(uint8_t value) { _zxCpu->byte_reg[REG_L] = value; }
+uint8_t ZELCore::get_H() { return this->_zxCpu->byte_reg[REG_H]; }
+void ZELCore::set_H(uint8_t value) { this->_zxCpu->byte_reg[REG_H] = value; }
 
-uint8_t z80Emulator::get_I() { return _zxCpu->byte_reg[REG_I]; }
-void z80Emulator::set_I(uint8_t value) { _zxCpu->byte_reg[REG_I] = value; }
+uint8_t ZELCore::get_L() { return this->_zxCpu->byte_reg[REG_L]; }
+void ZELCore::set_L(uint8_t value) { this->_zxCpu->byte_reg[REG_L] = value; }
 
-uint8_t z80Emulator::get_R() { return _zxCpu->byte_reg[REG_R]; }
-void z80Emulator::set_R(uint8_t value) { _zxCpu->byte_reg[REG_R] = value; }
+uint8_t ZELCore::get_I() { return this->_zxCpu->byte_reg[REG_I]; }
+void ZELCore::set_I(uint8_t value) { this->_zxCpu->byte_reg[REG_I] = value; }
 
-uint16_t z80Emulator::get_AF() { return Z80_GetReg(REG_AF, _zxCpu); }
-void z80Emulator::set_AF(uint16_t value) { Z80_SetReg(REG_AF, value, _zxCpu); }
+uint8_t ZELCore::get_R() { return this->_zxCpu->byte_reg[REG_R]; }
+void ZELCore::set_R(uint8_t value) { this->_zxCpu->byte_reg[REG_R] = value; }
 
-uint16_t z80Emulator::get_BC() { return Z80_GetReg(REG_BC, _zxCpu); }
-void z80Emulator::set_BC(uint16_t value) { Z80_SetReg(REG_BC, value, _zxCpu); }
+uint16_t ZELCore::get_AF() { return Z80_GetReg(REG_AF, this->_zxCpu); }
+void ZELCore::set_AF(uint16_t value) { Z80_SetReg(REG_AF, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_DE() { return Z80_GetReg(REG_DE, _zxCpu); }
-void z80Emulator::set_DE(uint16_t value) { Z80_SetReg(REG_DE, value, _zxCpu); }
+uint16_t ZELCore::get_BC() { return Z80_GetReg(REG_BC, this->_zxCpu); }
+void ZELCore::set_BC(uint16_t value) { Z80_SetReg(REG_BC, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_HL() { return Z80_GetReg(REG_HL, _zxCpu);; }
-void z80Emulator::set_HL(uint16_t value) { Z80_SetReg(REG_HL, value, _zxCpu); }
+uint16_t ZELCore::get_DE() { return Z80_GetReg(REG_DE, this->_zxCpu); }
+void ZELCore::set_DE(uint16_t value) { Z80_SetReg(REG_DE, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_AFx() { return Z80_GetReg(REG_AFP, _zxCpu); }
-void z80Emulator::set_AFx(uint16_t value) { Z80_SetReg(REG_AFP, value, _zxCpu); }
+uint16_t ZELCore::get_HL() { return Z80_GetReg(REG_HL, this->_zxCpu);; }
+void ZELCore::set_HL(uint16_t value) { Z80_SetReg(REG_HL, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_BCx() { return Z80_GetReg(REG_BCP, _zxCpu); }
-void z80Emulator::set_BCx(uint16_t value) { Z80_SetReg(REG_BCP, value, _zxCpu); }
+uint16_t ZELCore::get_AFx() { return Z80_GetReg(REG_AFP, this->_zxCpu); }
+void ZELCore::set_AFx(uint16_t value) { Z80_SetReg(REG_AFP, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_DEx() { return Z80_GetReg(REG_DEP, _zxCpu);; }
-void z80Emulator::set_DEx(uint16_t value) { Z80_SetReg(REG_DEP, value, _zxCpu); }
+uint16_t ZELCore::get_BCx() { return Z80_GetReg(REG_BCP, this->_zxCpu); }
+void ZELCore::set_BCx(uint16_t value) { Z80_SetReg(REG_BCP, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_HLx() { return Z80_GetReg(REG_HLP, _zxCpu); }
-void z80Emulator::set_HLx(uint16_t value) { Z80_SetReg(REG_HLP, value, _zxCpu); }
+uint16_t ZELCore::get_DEx() { return Z80_GetReg(REG_DEP, this->_zxCpu);; }
+void ZELCore::set_DEx(uint16_t value) { Z80_SetReg(REG_DEP, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_IX() { return Z80_GetReg(REG_IX, _zxCpu);; }
-void z80Emulator::set_IX(uint16_t value) { Z80_SetReg(REG_IX, value, _zxCpu); }
+uint16_t ZELCore::get_HLx() { return Z80_GetReg(REG_HLP, this->_zxCpu); }
+void ZELCore::set_HLx(uint16_t value) { Z80_SetReg(REG_HLP, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_IY() { return Z80_GetReg(REG_IY, _zxCpu);; }
-void z80Emulator::set_IY(uint16_t value) { Z80_SetReg(REG_IY, value, _zxCpu); }
+uint16_t ZELCore::get_IX() { return Z80_GetReg(REG_IX, this->_zxCpu);; }
+void ZELCore::set_IX(uint16_t value) { Z80_SetReg(REG_IX, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_SP() { return Z80_GetReg(REG_SP, _zxCpu); }
-void z80Emulator::set_SP(uint16_t value) { Z80_SetReg(REG_SP, value, _zxCpu); }
+uint16_t ZELCore::get_IY() { return Z80_GetReg(REG_IY, this->_zxCpu);; }
+void ZELCore::set_IY(uint16_t value) { Z80_SetReg(REG_IY, value, this->_zxCpu); }
 
-uint16_t z80Emulator::get_PC() { return Z80_GetReg(REG_PC, _zxCpu); }
-void z80Emulator::set_PC(uint16_t value) { Z80_SetReg(REG_PC, value, _zxCpu); }
+uint16_t ZELCore::get_SP() { return Z80_GetReg(REG_SP, this->_zxCpu); }
+void ZELCore::set_SP(uint16_t value) { Z80_SetReg(REG_SP, value, this->_zxCpu); }
 
-uint8_t z80Emulator::get_IFF1() { return _zxCpu->iff1 ? 1 : 0; }
-void z80Emulator::set_IFF1(uint8_t value) { _zxCpu->iff1 = (value == 1); }
+uint16_t ZELCore::get_PC() { return Z80_GetReg(REG_PC, this->_zxCpu); }
+void ZELCore::set_PC(uint16_t value) { Z80_SetReg(REG_PC, value, this->_zxCpu); }
 
-uint8_t z80Emulator::get_IFF2() { return _zxCpu->iff2 ? 1 : 0; }
-void z80Emulator::set_IFF2(uint8_t value) { _zxCpu->iff2 = (value == 1); }
+uint8_t ZELCore::get_IFF1() { return this->_zxCpu->iff1 ? 1 : 0; }
+void ZELCore::set_IFF1(uint8_t value) { this->_zxCpu->iff1 = (value == 1); }
 
-uint8_t z80Emulator::get_IM() { return (uint8_t)_zxCpu->interrupt_mode; }
-void z80Emulator::set_IM(uint8_t value) { _zxCpu->interrupt_mode = value; }
+uint8_t ZELCore::get_IFF2() { return this->_zxCpu->iff2 ? 1 : 0; }
+void ZELCore::set_IFF2(uint8_t value) { this->_zxCpu->iff2 = (value == 1); }
+
+uint8_t ZELCore::get_IM() { return (uint8_t)this->_zxCpu->interrupt_mode; }
+void ZELCore::set_IM(uint8_t value) { this->_zxCpu->interrupt_mode = value; }
 
 
 /*! Read a byte of memory.
@@ -153,7 +206,7 @@ void z80Emulator::set_IM(uint8_t value) { _zxCpu->interrupt_mode = value; }
 */
 extern "C" uint8_t ReadMem(uint16_t addr, bool inst, Z80 cpu)
 {
-    return env->ReadByte(addr);
+    return environmentOf(cpu)->ReadByte(addr);
 }
 
 /*! Write a byte of memory.
@@ -163,7 +216,7 @@ extern "C" uint8_t ReadMem(uint16_t addr, bool inst, Z80 cpu)
 */
 extern "C" void WriteMem(uint16_t addr, uint8_t val, Z80 cpu)
 {
-    env->WriteByte(addr, val);
+    environmentOf(cpu)->WriteByte(addr, val);
 }
 
 /*! Read the interrupt data.
@@ -183,7 +236,7 @@ extern "C" uint8_t ReadInterruptData(uint16_t n, Z80 cpu)
 */
 extern "C" uint8_t ReadIO(uint16_t addr, Z80 cpu)
 {
-    return env->Input(addr &0xFF, addr >> 8);
+    return environmentOf(cpu)->Input(addr &0xFF, addr >> 8);
 }
 
 /*! Write a byte from an I/O port.
@@ -194,7 +247,7 @@ extern "C" uint8_t ReadIO(uint16_t addr, Z80 cpu)
 */
 extern "C" void WriteIO(uint16_t addr, uint8_t val, Z80 cpu)
 {
-    env->Output(addr &0xFF, addr >> 8, val);
+    environmentOf(cpu)->Output(addr &0xFF, addr >> 8, val);
 }
 
 /*! Notify the peripherials that a return from interrupt
@@ -205,5 +258,3 @@ extern "C" void InterruptComplete(Z80 cpu)
 {
 
 }
-
-#endif
\ No newline at end of file
@@ -1,17 +1,18 @@
+#include <string.h>
+#include <stdlib.h>
 #include "esp_log.h"
 #include "soc/rtc_io_reg.h"
 #include "fabgl.h"
 
 #include "settings.h"
 #include "z80Environment.h"
-#include "z80input.h"
 #include "ps2Input.h"
-#include "ay3-8912-state.h"
 #include "main_ROM.h"
 #include "VideoController.h"
-
-Sound::Ay3_8912_state _ay3_8912;
-static uint8_t zx_data = 0;
+#include "TapePlayer.h"
+#include "InputRecorder.h"
+#include "PerfCounters.h"
+#include "Debugger.h"
 
 static uint8_t _ram0Buffer[0x4000];
 static uint8_t _ram2Buffer[0x4000];
@@ -23,7 +24,10 @@ Z80Environment::Z80Environment(VideoController* screen)
     : BorderColor(this)
 {
     this->Screen = screen;
-    this->Screen->BorderColor = &this->_borderColor;
+    if (this->Screen != nullptr)
+    {
+        this->Screen->BorderColor = &this->_borderColor;
+    }
 
     this->Rom[0] = &this->_rom0;
     this->Rom[1] = &this->_rom1;
@@ -38,6 +42,28 @@ Z80Environment::Z80Environment(VideoController* screen)
     this->Ram[7] = &this->_ram7;    
 }
 
+Z80Environment::~Z80Environment()
+{
+    if (this->Screen != nullptr)
+    {
+        // Machine on screen is never destroyed
+        return;
+    }
+
+    free((uint8_t*)this->_ram0);
+    free((uint8_t*)this->_ram1);
+    free((uint8_t*)this->_ram2);
+    free((uint8_t*)this->_ram3);
+    free((uint8_t*)this->_ram4);
+    free((uint8_t*)this->_ram6);
+    free(this->_mainScreenData.Pixels);
+    free(this->_mainScreenData.Attributes);
+    free(this->_shadowScreenData.Pixels);
+    free(this->_shadowScreenData.Attributes);
+    free(this->_ram5Data);
+    free(this->_ram7Data);
+}
+
 void Z80Environment::Initialize()
 {
     ESP_LOGI(TAG, "Z80Environment::Initialize()");
@@ -69,7 +95,9 @@ void Z80Environment::Initialize()
     this->_ram7.Initialize(&this->_shadowScreenData, (uint8_t*)malloc(0x2500));
 #endif
 
-    _ay3_8912.Initialize();
+    this->Ay.Initialize();
+    this->Tape = &Player;
+    this->Recorder = &::Recorder;
 
 #ifdef BEEPER
     gpio_config_t io_conf = {};
@@ -80,7 +108,149 @@ void Z80Environment::Initialize()
 #endif
 }
 
+bool Z80Environment::InitializeHeadless()
+{
+    this->_rom0 = (uint8_t*)ROM;
+    this->_rom1 = (uint8_t*)ROM;
+
+    this->_ram0 = malloc(0x4000);
+    this->_ram2 = malloc(0x4000);
+    this->_mainScreenData.Pixels = (uint8_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8);
+    this->_mainScreenData.Attributes = (uint16_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 2);
+    this->_ram5Data = (uint8_t*)malloc(0x2500);
+    this->_ram5.Initialize(&this->_mainScreenData, this->_ram5Data);
+    bool result = (uint8_t*)this->_ram0 != nullptr && (uint8_t*)this->_ram2 != nullptr
+        && this->_mainScreenData.Pixels != nullptr && this->_mainScreenData.Attributes != nullptr
+        && this->_ram5Data != nullptr;
+
+#ifdef ZX128K
+    this->_ram1 = malloc(0x4000);
+    this->_ram3 = malloc(0x4000);
+    this->_ram4 = malloc(0x4000);
+    this->_ram6 = malloc(0x4000);
+    this->_shadowScreenData.Pixels = (uint8_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 8);
+    this->_shadowScreenData.Attributes = (uint16_t*)malloc(SPECTRUM_WIDTH * SPECTRUM_HEIGHT * 2);
+    this->_ram7Data = (uint8_t*)malloc(0x2500);
+    this->_ram7.Initialize(&this->_shadowScreenData, this->_ram7Data);
+    result = result && (uint8_t*)this->_ram1 != nullptr && (uint8_t*)this->_ram3 != nullptr
+        && (uint8_t*)this->_ram4 != nullptr && (uint8_t*)this->_ram6 != nullptr
+        && this->_shadowScreenData.Pixels != nullptr && this->_shadowScreenData.Attributes != nullptr
+        && this->_ram7Data != nullptr;
+#else
+    this->_shadowScreenData.Pixels = nullptr;
+    this->_shadowScreenData.Attributes = nullptr;
+#endif
+
+    return result;
+}
+
+void Z80Environment::Reset()
+{
+    this->Ay.Clear();
+    memset(this->KeyboardRows, 0xFF, sizeof(this->KeyboardRows));
+    this->_portFE = 0xFF;
+    this->_portData = 0;
+    this->TStates = 0;
+}
+
+MemoryPage* Z80Environment::GetRamPage(uint8_t pageNumber)
+{
+    switch (pageNumber)
+    {
+        case 0:
+        case 2:
+        case 5:
+            return this->Ram[pageNumber];
+#ifdef ZX128K
+        case 1:
+        case 3:
+        case 4:
+        case 6:
+        case 7:
+            return this->Ram[pageNumber];
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+uint8_t Z80Environment::GetDirtyPages()
+{
+    uint8_t result = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (this->_dirtyPages[i] != 0)
+        {
+            result |= 1 << i;
+        }
+    }
+
+    return result;
+}
+
+// Written block differs from the reference in at least one byte
+static bool isBlockChanged(MemoryPage* page, const uint8_t* reference, uint16_t block)
+{
+    uint16_t offset = block << 8;
+    for (uint16_t i = offset; i < offset + 0x100; i++)
+    {
+        if (page->ReadByte(i) != reference[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Z80Environment::GetDirtyRange(uint8_t pageNumber, const uint8_t reference[0x4000], uint16_t* offset, uint16_t* size)
+{
+    MemoryPage* page = this->GetRamPage(pageNumber);
+    if (page == nullptr || this->_dirtyPages[pageNumber] == 0)
+    {
+        return false;
+    }
+
+    uint16_t block = (*offset + 0xFF) >> 8;
+    while (block < 64 && !isBlockChanged(page, reference, block))
+    {
+        block++;
+    }
+    if (block >= 64)
+    {
+        return false;
+    }
+
+    uint16_t end = block + 1;
+    while (end < 64 && isBlockChanged(page, reference, end))
+    {
+        end++;
+    }
+
+    *offset = block << 8;
+    *size = (end - block) << 8;
+    return true;
+}
+
+void Z80Environment::ClearDirty()
+{
+    memset(this->_dirtyPages, 0, sizeof(this->_dirtyPages));
+}
+
 uint8_t Z80Environment::ReadByte(uint16_t addr)
+{
+#ifdef DEBUGGER
+    // Slots with a watchpoint take the slow path
+    if (((Debug.ReadSlots >> (addr >> 14)) & 1) != 0)
+    {
+        Debug.OnRead(addr);
+    }
+#endif
+
+    return this->PeekByte(addr);
+}
+
+uint8_t Z80Environment::PeekByte(uint16_t addr)
 {
     uint8_t res;
     uint16_t offset;
@@ -109,6 +279,25 @@ uint8_t Z80Environment::ReadByte(uint16_t addr)
     return res;
 }
 
+void Z80Environment::PokeByte(uint16_t addr, uint8_t data)
+{
+    switch (addr)
+    {
+        case 0x0000 ... 0x3fff:
+            // Cannot write to ROM
+            break;
+        case 0x4000 ... 0x7FFF:
+            this->_ram5.WriteByte(addr - (uint16_t)0x4000, data);
+            break;
+        case 0x8000 ... 0xBFFF:
+            this->_ram2.WriteByte(addr - (uint16_t)0x8000, data);
+            break;
+        case 0xC000 ... 0xFFFF:
+            this->Ram[this->MemoryState.RamBank]->WriteByte(addr - (uint16_t)0xC000, data);
+            break;
+    }
+}
+
 uint16_t Z80Environment::ReadWord(uint16_t addr)
 {
     return this->ReadByte(addr) | (this->ReadByte(addr + 1) << 8);
@@ -116,6 +305,13 @@ uint16_t Z80Environment::ReadWord(uint16_t addr)
 
 void Z80Environment::WriteByte(uint16_t addr, uint8_t data)
 {
+#ifdef DEBUGGER
+    if (((Debug.WriteSlots >> (addr >> 14)) & 1) != 0)
+    {
+        Debug.OnWrite(addr);
+    }
+#endif
+
     uint16_t offset;
     switch (addr)
     {
@@ -125,16 +321,19 @@ void Z80Environment::WriteByte(uint16_t addr, uint8_t data)
         case 0x4000 ... 0x7FFF:
             // Always bank 5
             offset = addr - (uint16_t)0x4000;
+            this->markDirty(5);
             this->_ram5.WriteByte(offset, data);
             break;
         case 0x8000 ... 0xBFFF:
             // Always bank 2
             offset = addr - (uint16_t)0x8000;
+            this->markDirty(2);
             this->_ram2.WriteByte(offset, data);
             break;
         case 0xC000 ... 0xFFFF:
             // Selected page
             offset = addr - (uint16_t)0xC000;
+            this->markDirty(this->MemoryState.RamBank);
             this->Ram[this->MemoryState.RamBank]->WriteByte(offset, data);
             break;
     }
@@ -148,34 +347,49 @@ void Z80Environment::WriteWord(uint16_t addr, uint16_t data)
 
 uint8_t Z80Environment::Input(uint8_t portLow, uint8_t portHigh)
 {
-    if (portLow == 0xFE)
+#ifdef DEBUGGER
+    if (Debug.IsWatchingPorts)
+    {
+        Debug.OnInput((portHigh << 8) | portLow);
+    }
+#endif
+
+    // Recorded input replaces everything read from ports
+    if (this->Recorder != nullptr && this->Recorder->IsPlaying())
+    {
+        return this->Recorder->GetInput();
+    }
+
+    uint8_t result = this->readPort(portLow, portHigh);
+    if (this->Recorder != nullptr && this->Recorder->IsRecording())
     {
-    	// Keyboard
+        this->Recorder->PutInput(result);
+    }
 
-        switch (portHigh)
+    return result;
+}
+
+uint8_t Z80Environment::readPort(uint8_t portLow, uint8_t portHigh)
+{
+    if (portLow == 0xFE && portHigh != 0xFF)
+    {
+    	// Keyboard, each zero bit of the high byte selects a row
+        uint8_t result = 0xFF;
+        for (int row = 0; row < 8; row++)
         {
-        case 0xFE:
-        case 0xFD:
-        case 0xFB:
-        case 0xF7:
-        case 0xEF:
-        case 0xDF:
-        case 0xBF:
-        case 0x7F:
-            return indata[portHigh - 0x7F];
-        case 0x00:
-			{
-				uint8_t result = indata[0xFE - 0x7F];
-				result &= indata[0xFD - 0x7F];
-				result &= indata[0xFB - 0x7F];
-				result &= indata[0xF7 - 0x7F];
-				result &= indata[0xEF - 0x7F];
-				result &= indata[0xDF - 0x7F];
-				result &= indata[0xBF - 0x7F];
-				result &= indata[0x7F - 0x7F];
-				return result;
-			}
+            if ((portHigh & (1 << row)) == 0)
+            {
+                result &= this->KeyboardRows[row];
+            }
         }
+
+        // Tape
+        if (this->Tape != nullptr && this->Tape->IsPlaying())
+        {
+            result = (result & ~0x40) | (this->Tape->GetEar(this->TStates) << 6);
+        }
+
+        return result;
     }
 
     // Sound (AY-3-8912)
@@ -184,12 +398,12 @@ uint8_t Z80Environment::Input(uint8_t portLow, uint8_t portHigh)
         switch (portHigh)
         {
         case 0xFF:
-        	return _ay3_8912.getRegisterData();
+        	return this->Ay.getRegisterData();
         }
     }
 
     // Kempston Mouse
-    if (portLow == 0xDF && Ps2_isMouseAvailable())
+    if (portLow == 0xDF && this->Screen != nullptr && Ps2_isMouseAvailable())
     {
         switch (portHigh)
         {
@@ -202,7 +416,7 @@ uint8_t Z80Environment::Input(uint8_t portLow, uint8_t portHigh)
         }
     }
 
-    uint8_t data = zx_data;
+    uint8_t data = this->_portData;
     data |= (0xe0); /* Set bits 5-7 - as reset above */
     data &= ~0x40;
     return data;
@@ -219,29 +433,57 @@ void Z80Environment::SetState(uint8_t memoryState)
     this->MemoryState.Bits = memoryState;
 }
 
+void Z80Environment::SelectScreen()
+{
+    if (this->Screen == nullptr)
+    {
+        return;
+    }
+
+    if (this->MemoryState.ShadowScreen == 1)
+    {
+        this->Screen->Settings->Pixels = this->_shadowScreenData.Pixels;
+        this->Screen->Settings->Attributes = this->_shadowScreenData.Attributes;
+    }
+    else
+    {
+        this->Screen->Settings->Pixels = this->_mainScreenData.Pixels;
+        this->Screen->Settings->Attributes = this->_mainScreenData.Attributes;
+    }
+}
+
 void Z80Environment::Output(uint8_t portLow, uint8_t portHigh, uint8_t data)
 {
+#ifdef DEBUGGER
+    if (Debug.IsWatchingPorts)
+    {
+        Debug.OnOutput((portHigh << 8) | portLow);
+    }
+#endif
+
     switch (portLow)
     {
     case 0xFE:
     {
         // border color (no bright colors)
         uint8_t borderColor = (data & 0x07);
-    	if ((indata[0x20] & 0x07) != borderColor)
+    	if ((this->_portFE & 0x07) != borderColor)
     	{
             this->BorderColor = borderColor;
     	}
 
 #ifdef BEEPER
         uint8_t sound = (data & 0x10);
-    	if ((indata[0x20] & 0x10) != sound)
+    	if ((this->_portFE & 0x10) != sound && this->Screen != nullptr)
     	{
+            uint32_t startTime = Perf.Now();
             //_beeperGenerator.setState(sound != 0, this->TStates);
             gpio_set_level(BEEPER_PIN, sound >> 4 ? 1 : 0);
+            Perf.Add(PerfCounter::Audio, startTime);
     	}
 #endif
 
-        indata[0x20] = data;
+        this->_portFE = data;
     }
     break;
 
@@ -251,7 +493,7 @@ void Z80Environment::Output(uint8_t portLow, uint8_t portHigh, uint8_t data)
         switch (portHigh)
         {
         case 0xC0:
-        	_ay3_8912.selectRegister(data);
+        	this->Ay.selectRegister(data);
         	break;
         }
     }
@@ -264,27 +506,29 @@ void Z80Environment::Output(uint8_t portLow, uint8_t portHigh, uint8_t data)
         // Sound (AY-3-8912)
         case 0xFF:
         	// Not sure if this one is correct
-        	_ay3_8912.selectRegister(data);
+        	this->Ay.selectRegister(data);
         	break;
         case 0xBF:
-        	_ay3_8912.setRegisterData(data);
+        {
+            if (this->Screen == nullptr)
+            {
+                // Silent, and not counted in the performance of the machine on screen
+                this->Ay.setRegisterData(data);
+                break;
+            }
+
+            uint32_t startTime = Perf.Now();
+        	this->Ay.setRegisterData(data);
+            Perf.Add(PerfCounter::Audio, startTime);
         	break;
+        }
 
         case 0x7F:
             MemorySelect originalState = this->MemoryState;
         	this->SetState(data);
             if (originalState.ShadowScreen != this->MemoryState.ShadowScreen)
             {
-                if (this->MemoryState.ShadowScreen == 1)
-                {
-                    this->Screen->Settings->Pixels = this->_shadowScreenData.Pixels;
-                    this->Screen->Settings->Attributes = this->_shadowScreenData.Attributes;
-                }
-                else
-                {
-                    this->Screen->Settings->Pixels = this->_mainScreenData.Pixels;
-                    this->Screen->Settings->Attributes = this->_mainScreenData.Attributes;
-                }
+                this->SelectScreen();
             }
 
         	break;
@@ -293,7 +537,7 @@ void Z80Environment::Output(uint8_t portLow, uint8_t portHigh, uint8_t data)
     break;
 
     default:
-        zx_data = data;
+        this->_portData = data;
         break;
     }
 }
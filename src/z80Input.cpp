@@ -2,17 +2,15 @@
 #include "z80input.h"
 #include "ps2Input.h"
 
-uint8_t indata[128];
-
-const uint8_t keyaddr[ZX_KEY_LAST] = {
-	0xFE, 0xFE, 0xFE, 0xFE, 0xFE, // ZX_KEY_SHIFT, ZX_KEY_Z,   ZX_KEY_X, ZX_KEY_C, ZX_KEY_V
-	0xFD, 0xFD, 0xFD, 0xFD, 0xFD, // ZX_KEY_A,     ZX_KEY_S,   ZX_KEY_D, ZX_KEY_F, ZX_KEY_G
-	0xFB, 0xFB, 0xFB, 0xFB, 0xFB, // ZX_KEY_Q,     ZX_KEY_W,   ZX_KEY_E, ZX_KEY_R, ZX_KEY_T
-	0xF7, 0xF7, 0xF7, 0xF7, 0xF7, // ZX_KEY_1,     ZX_KEY_2,   ZX_KEY_3, ZX_KEY_4, ZX_KEY_5
-	0xEF, 0xEF, 0xEF, 0xEF, 0xEF, // ZX_KEY_0,     ZX_KEY_9,   ZX_KEY_8, ZX_KEY_7, ZX_KEY_6
-	0xDF, 0xDF, 0xDF, 0xDF, 0xDF, // ZX_KEY_P,     ZX_KEY_O,   ZX_KEY_I, ZX_KEY_U, ZX_KEY_Y
-	0xBF, 0xBF, 0xBF, 0xBF, 0xBF, // ZX_KEY_ENTER, ZX_KEY_L,   ZX_KEY_K, ZX_KEY_J, ZX_KEY_H
-	0x7F, 0x7F, 0x7F, 0x7F, 0x7F, // ZX_KEY_SPACE, ZX_KEY_SYM, ZX_KEY_M, ZX_KEY_N, ZX_KEY_B
+const uint8_t keyrow[ZX_KEY_LAST] = {
+	0, 0, 0, 0, 0,                // ZX_KEY_SHIFT, ZX_KEY_Z,   ZX_KEY_X, ZX_KEY_C, ZX_KEY_V
+	1, 1, 1, 1, 1,                // ZX_KEY_A,     ZX_KEY_S,   ZX_KEY_D, ZX_KEY_F, ZX_KEY_G
+	2, 2, 2, 2, 2,                // ZX_KEY_Q,     ZX_KEY_W,   ZX_KEY_E, ZX_KEY_R, ZX_KEY_T
+	3, 3, 3, 3, 3,                // ZX_KEY_1,     ZX_KEY_2,   ZX_KEY_3, ZX_KEY_4, ZX_KEY_5
+	4, 4, 4, 4, 4,                // ZX_KEY_0,     ZX_KEY_9,   ZX_KEY_8, ZX_KEY_7, ZX_KEY_6
+	5, 5, 5, 5, 5,                // ZX_KEY_P,     ZX_KEY_O,   ZX_KEY_I, ZX_KEY_U, ZX_KEY_Y
+	6, 6, 6, 6, 6,                // ZX_KEY_ENTER, ZX_KEY_L,   ZX_KEY_K, ZX_KEY_J, ZX_KEY_H
+	7, 7, 7, 7, 7,                // ZX_KEY_SPACE, ZX_KEY_SYM, ZX_KEY_M, ZX_KEY_N, ZX_KEY_B
 };
 
 const uint8_t keybuf[ZX_KEY_LAST] = {
@@ -26,9 +24,9 @@ const uint8_t keybuf[ZX_KEY_LAST] = {
 	0x01, 0x02, 0x04, 0x08, 0x10, // ZX_KEY_SPACE, ZX_KEY_SYM, ZX_KEY_M, ZX_KEY_N, ZX_KEY_B
 };
 
-#define ON_KEY(k, isKeyUp) isKeyUp ? indata[keyaddr[k] - 0x7F] |= keybuf[k] : indata[keyaddr[k] - 0x7F] &= ~keybuf[k]
+#define ON_KEY(k, isKeyUp) isKeyUp ? keyboardRows[keyrow[k]] |= keybuf[k] : keyboardRows[keyrow[k]] &= ~keybuf[k]
 
-bool OnKey(uint32_t scanCode, bool isKeyUp)
+bool OnKey(uint8_t keyboardRows[8], uint32_t scanCode, bool isKeyUp)
 {
 	switch (scanCode)
 	{
@@ -4,24 +4,28 @@
 #include "z80main.h"
 #include "z80input.h"
 #include "z80Environment.h"
+#include "Machine.h"
 #include "VideoController.h"
 #include "ps2Input.h"
-#include "ay3-8912-state.h"
+#include "FileSystem.h"
+#include "TapePlayer.h"
+#include "RewindBuffer.h"
+#include "InputRecorder.h"
+#include "PerfCounters.h"
 
 //#define BEEPER
 
-z80Emulator Z80cpu;
-extern Sound::Ay3_8912_state _ay3_8912;
+z80Emulator& Z80cpu = Spectrum.Cpu;
 
+static Z80Environment* _environment;
 static uint16_t _attributeCount;
-static int _total;
-static int _next_total = 0;
 static uint8_t frames = 0;
 static uint32_t _ticks = 0;
 static VideoController* _spectrumScreen;
 
 void zx_setup(Z80Environment* environment)
 {
+	_environment = environment;
 	_spectrumScreen = environment->Screen;
 	_attributeCount = SPECTRUM_HEIGHT * SPECTRUM_WIDTH;
 
@@ -31,21 +35,31 @@ void zx_setup(Z80Environment* environment)
 
 void zx_reset()
 {
-    _ay3_8912.Clear();
-    memset(indata, 0xFF, 128);
+    _environment->Reset();
     *_spectrumScreen->BorderColor = 0x2A;
     Z80cpu.reset();
 }
 
+void zx_resetFlash()
+{
+    frames = 0;
+}
+
 int32_t zx_loop()
 {
     int32_t result = -1;
 
-    _total += Z80cpu.emulate(_next_total - _total);
+    // After a debugger stop, the rest of the frame runs
+    uint32_t startTime = Perf.Now();
+    int cycles = Z80cpu.emulate(TSTATES_PER_FRAME - _environment->TStates);
+    Perf.Add(PerfCounter::Emulate, startTime);
+    Perf.AddTStates(cycles);
 
-    if (_total >= _next_total)
+    if (_environment->TStates >= TSTATES_PER_FRAME)
     {
-        _next_total += TSTATES_PER_FRAME;
+        // Next frame starts with what the last instruction ran over
+        _environment->TStates -= TSTATES_PER_FRAME;
+        Player.EndFrame(TSTATES_PER_FRAME);
 
         // flash every 32 frames
         frames++;
@@ -63,6 +77,7 @@ int32_t zx_loop()
         }
 
         // Keyboard input
+        startTime = Perf.Now();
         int32_t scanCode = Ps2_GetScancode();
         if (scanCode > 0)
         {
@@ -72,7 +87,7 @@ int32_t zx_loop()
 
                 scanCode = ((scanCode & 0xFF0000) >> 8 | (scanCode & 0xFF));
 
-                if (!OnKey(scanCode, true))
+                if (!OnKey(_environment->KeyboardRows, scanCode, true))
                 {
                     result = scanCode;
                 }
@@ -81,9 +96,20 @@ int32_t zx_loop()
             {
                 // key down
 
-                OnKey(scanCode, false);
+                OnKey(_environment->KeyboardRows, scanCode, false);
             }
         }
+        Perf.Add(PerfCounter::Input, startTime);
+
+#ifdef CAPTURE_FRAMES
+        ScreenCaptureOnFrame();
+#endif
+
+        Recorder.OnFrame(Z80cpu.TakeFetchCount());
+        startTime = Perf.Now();
+        Rewind.OnFrame();
+        Perf.Add(PerfCounter::Rewind, startTime);
+        Perf.OnFrame();
 
         Z80cpu.interrupt();
 
@@ -7,6 +7,7 @@
 #include "z80main.h"
 #include "z80Emulator.h"
 #include "z80Environment.h"
+#include "Machine.h"
 #include "VideoController.h"
 #include "File.h"
 
@@ -74,7 +75,7 @@
 
  */
 
-extern Z80Environment Environment;
+extern Z80Environment& Environment;
 
 struct FileHeader
 {
@@ -104,14 +105,205 @@ struct FileHeader
 	uint8_t PagingState;
 }__attribute__((packed));
 
-uint16_t DecompressPage(uint8_t *page, uint16_t pageLength, bool isCompressed,
-		uint16_t maxSize, uint8_t* destMemory);
-uint16_t CompressPage(uint8_t* page, uint8_t* destMemory);
-void ReadState(FileHeader* header);
+bool CompressPage(uint8_t* page, zx::File* file, uint8_t* chunk, uint16_t* size);
+void ReadState(Machine* machine, FileHeader* header);
 void SaveState(FileHeader* header);
 void GetPageInfo(uint8_t* buffer, bool is128Mode, uint8_t pagingState, int8_t* pageNumber, uint16_t* pageSize);
 void ShowScreenshot(uint8_t* buffer, uint8_t borderColor);
 
+// Compressed data is read and decoded by chunks of this size
+#define CHUNK_SIZE 512
+
+// Decodes memory blocks fed in chunks of any size, "ED ED xx yy" stands for "byte yy repeated xx times".
+// Output goes either directly to memory, or to a memory page through a small staging buffer.
+class PageDecoder
+{
+private:
+    enum State : uint8_t { Normal, ED, EDED, Count };
+
+    MemoryPage* _page = nullptr;
+    uint8_t* _output;
+    uint16_t _outputSize = 0;
+    uint16_t _offset = 0;
+    uint16_t _remaining = 0;
+    bool _isCompressed;
+    State _state = Normal;
+    uint8_t _count = 0;
+    uint8_t _repeat = 0;
+    uint8_t _value = 0;
+
+    void put(uint8_t value);
+    void putRepeated();
+
+public:
+    PageDecoder(bool isCompressed) : _isCompressed(isCompressed) {}
+
+    void SetPage(MemoryPage* page, uint8_t* staging);
+    void SetMemory(uint8_t* memory, uint16_t size);
+    uint16_t Decode(uint8_t* data, uint16_t length);
+    void Flush();
+    // End of the data of a page, a single 0xED at its end has no byte after it
+    void Finish();
+    bool IsFull() { return this->_remaining == 0; }
+};
+
+void PageDecoder::SetPage(MemoryPage* page, uint8_t* staging)
+{
+    this->_page = page;
+    this->_output = staging;
+    this->_outputSize = 0;
+    this->_offset = 0;
+    this->_remaining = 0x4000;
+}
+
+void PageDecoder::SetMemory(uint8_t* memory, uint16_t size)
+{
+    this->_page = nullptr;
+    this->_output = memory;
+    this->_outputSize = 0;
+    this->_remaining = size;
+}
+
+inline void PageDecoder::put(uint8_t value)
+{
+    this->_output[this->_outputSize++] = value;
+    this->_remaining--;
+    if (this->_page != nullptr && this->_outputSize == CHUNK_SIZE)
+    {
+        this->Flush();
+    }
+}
+
+void PageDecoder::putRepeated()
+{
+    while (this->_repeat > 0 && this->_remaining > 0)
+    {
+        uint16_t count = this->_repeat;
+        if (count > this->_remaining)
+        {
+            count = this->_remaining;
+        }
+        if (this->_page != nullptr && count > CHUNK_SIZE - this->_outputSize)
+        {
+            count = CHUNK_SIZE - this->_outputSize;
+        }
+
+        memset(&this->_output[this->_outputSize], this->_value, count);
+        this->_outputSize += count;
+        this->_remaining -= count;
+        this->_repeat -= count;
+        if (this->_page != nullptr && this->_outputSize == CHUNK_SIZE)
+        {
+            this->Flush();
+        }
+    }
+}
+
+uint16_t PageDecoder::Decode(uint8_t* data, uint16_t length)
+{
+    uint16_t i = 0;
+    while (true)
+    {
+        // Repetition can continue from the previous chunk or page
+        this->putRepeated();
+        if (this->_remaining == 0 || i >= length)
+        {
+            break;
+        }
+
+        uint8_t value = data[i++];
+        switch (this->_state)
+        {
+        case Normal:
+            if (this->_isCompressed && value == 0xED)
+            {
+                this->_state = ED;
+            }
+            else
+            {
+                this->put(value);
+            }
+            break;
+
+        case ED:
+            if (value == 0xED)
+            {
+                this->_state = EDED;
+            }
+            else
+            {
+                // A byte directly following a single 0xED is not taken into a block
+                this->put(0xED);
+                this->_value = value;
+                this->_repeat = 1;
+                this->_state = Normal;
+            }
+            break;
+
+        case EDED:
+            this->_count = value;
+            this->_state = Count;
+            break;
+
+        case Count:
+            this->_value = value;
+            this->_repeat = this->_count;
+            this->_state = Normal;
+            break;
+        }
+    }
+
+    return i;
+}
+
+void PageDecoder::Flush()
+{
+    if (this->_page != nullptr && this->_outputSize > 0)
+    {
+        this->_page->FromBuffer(this->_output, this->_offset, this->_outputSize);
+        this->_offset += this->_outputSize;
+        this->_outputSize = 0;
+    }
+}
+
+void PageDecoder::Finish()
+{
+    if (this->_state == ED && this->_remaining > 0)
+    {
+        this->put(0xED);
+    }
+
+    this->_state = Normal;
+    this->Flush();
+}
+
+// Reads up to inputSize bytes by chunks into decoder, until decoder is full
+static bool DecodeFromFile(zx::File* file, PageDecoder* decoder, uint8_t* chunk, uint32_t inputSize)
+{
+    while (inputSize > 0 && !decoder->IsFull())
+    {
+        UINT bytesToRead = inputSize < CHUNK_SIZE ? inputSize : CHUNK_SIZE;
+        size_t bytesRead = file->read(chunk, bytesToRead);
+        if (bytesRead != bytesToRead)
+        {
+            return false;
+        }
+
+        decoder->Decode(chunk, bytesToRead);
+        inputSize -= bytesToRead;
+    }
+
+    decoder->Finish();
+
+    if (inputSize > 0)
+    {
+        // Skip data past the end of the page
+        return file->seek(inputSize, ios_base::cur);
+    }
+
+    return true;
+}
+
 bool zx::SaveZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t buffer2[0x4000])
 {
 	// Note: this requires little-endian processor
@@ -173,65 +365,117 @@ bool zx::SaveZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t buffer2[0x
 #endif
         }
 
-		uint16_t pageSize = CompressPage(buffer, buffer1);
-
-		buffer = (uint8_t*)buffer2;
-		if (pageSize == 0x4000)
-		{
-			*buffer = 0xFF;
-			buffer++;
-			*buffer = 0xFF;
-		}
-		else
-		{
-			*buffer = pageSize & 0xFF;
-			buffer++;
-			*buffer = (pageSize & 0xFF00) >> 8;
-		}
-		buffer++;
+		// Page length is not known yet, it is written after the page is compressed
+		uint32_t pageInfoPosition = file->tellp();
 
+		buffer = buffer1;
+		buffer[0] = 0;
+		buffer[1] = 0;
         if (pageCount == 3)
         {
             switch (pageNumber)
             {
             case 2:
-    		    *buffer = 4;
+    		    buffer[2] = 4;
                 break;
             case 5:
-    		    *buffer = 8;
+    		    buffer[2] = 8;
                 break;
             default:
-    		    *buffer = 5;
+    		    buffer[2] = 5;
                 break;
             }
         }
         else
         {
-		    *buffer = pageNumber + 3;
+		    buffer[2] = pageNumber + 3;
         }
 
-		bytesWritten = file->write(buffer2, 3);
+		bytesWritten = file->write(buffer, 3);
 		if (bytesWritten != 3)
 		{
 			return false;
 		}
 
-		buffer = buffer1;
+		// Compressed page goes to the file by chunks of buffer1
+		uint16_t pageSize;
+		if (!CompressPage(buffer2, file, buffer1, &pageSize))
+		{
+			return false;
+		}
 
-        bytesToWrite = pageSize;
-        bytesWritten = file->write(buffer, bytesToWrite);
-        if (bytesWritten != bytesToWrite)
-        {
-            return false;
-        }
+		if (pageSize == 0x4000)
+		{
+			// Not smaller compressed, the page is written as is over the partial compressed data
+			if (!file->seek(pageInfoPosition + 3, ios_base::beg)
+				|| file->write(buffer2, 0x4000) != 0x4000)
+			{
+				return false;
+			}
+
+			buffer[0] = 0xFF;
+			buffer[1] = 0xFF;
+		}
+		else
+		{
+			buffer[0] = pageSize & 0xFF;
+			buffer[1] = (pageSize & 0xFF00) >> 8;
+		}
+
+		if (!file->seek(pageInfoPosition, ios_base::beg)
+			|| file->write(buffer, 2) != 2
+			|| !file->seek(0, ios_base::end))
+		{
+			return false;
+		}
 	}
 
 	return true;
 }
 
-bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
-		uint8_t buffer2[0x4000])
+zx::SnapshotModel zx::GetZ80SnapshotModel(uint8_t* header, uint16_t length)
 {
+    if (length < 30)
+    {
+        return SnapshotModel::Unknown;
+    }
+
+	// Note: this requires little-endian processor
+	FileHeader* fileHeader = (FileHeader*)header;
+    if (fileHeader->PC != 0)
+    {
+        // version 1
+        return SnapshotModel::Spectrum48K;
+    }
+
+    if (length < Z80_HEADER_SIZE)
+    {
+        return SnapshotModel::Unknown;
+    }
+
+    bool is128Mode;
+    if (fileHeader->AdditionalBlockLength == 23)
+    {
+        // version 2
+        is128Mode = (fileHeader->HardwareMode >= 3);
+    }
+    else if (fileHeader->AdditionalBlockLength == 54 || fileHeader->AdditionalBlockLength == 55)
+    {
+        // version 3
+        is128Mode = (fileHeader->HardwareMode >= 4);
+    }
+    else
+    {
+        return SnapshotModel::Unknown;
+    }
+
+    return is128Mode ? SnapshotModel::Spectrum128K : SnapshotModel::Spectrum48K;
+}
+
+bool zx::LoadZ80Snapshot(Machine* machine, File* file, uint8_t buffer1[0x4000])
+{
+    Z80Environment& environment = machine->Environment;
+
 	size_t bytesRead;
 	UINT bytesToRead;
 
@@ -255,7 +499,7 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
         pagingState = 0;
         isVersion1 = true;
 
-    	ReadState(header);
+    	ReadState(machine, header);
     }
     else
     {
@@ -284,7 +528,7 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
 
         pagingState = header->PagingState;
 
-    	ReadState(header);
+    	ReadState(machine, header);
 
         bytesToRead = header->AdditionalBlockLength - 4 + 3;
         bytesRead = file->read(buffer1, bytesToRead);
@@ -297,62 +541,54 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
 
     if (is128Mode)
     {
-        Environment.MemoryState.Bits = header->PagingState;
+        environment.MemoryState.Bits = pagingState;
     }
     else
     {
-        Environment.MemoryState.Bits = 0;
-        Environment.MemoryState.RomSelect = 1;
-        Environment.MemoryState.PagingLock = 1;
+        environment.MemoryState.Bits = 0;
+        environment.MemoryState.RomSelect = 1;
+        environment.MemoryState.PagingLock = 1;
     }
+    environment.SelectScreen();
+
+    // Compressed data is read into chunk, and decoded directly into memory pages
+    uint8_t* chunk = &buffer1[0x100];
+    uint8_t* staging = chunk + CHUNK_SIZE;
 
     bool isCompressed;
     if (isVersion1)
     {
+        // 48K of memory, the end marker is not needed
         isCompressed = (header->Flags1 & 0x20) != 0;
+        PageDecoder decoder(isCompressed);
 
-        uint8_t* buffer = buffer1;
-        int bytesToRead = 0x4000;
-        for (int pageIndex = 0; pageIndex < 3; pageIndex++)
+        const uint8_t pages[] = { 5, 2, 0 };
+        int pageIndex = 0;
+        decoder.SetPage(environment.Ram[pages[pageIndex]], staging);
+        while (pageIndex < 3)
         {
-            uint8_t* memory= buffer2;
-
-            bytesRead = file->read(buffer, bytesToRead);
-            if (!isCompressed && bytesRead != bytesToRead)
+            bytesRead = file->read(chunk, CHUNK_SIZE);
+            if (bytesRead == 0)
             {
                 return false;
             }
-            buffer += bytesRead;
-
-            uint16_t usedBytes = DecompressPage(buffer1, 0x4000, isCompressed, 0x4000, memory);
 
-            if (isCompressed)
+            uint16_t usedBytes = 0;
+            while (usedBytes < bytesRead && pageIndex < 3)
             {
-                uint16_t unusedBytes = 0x4000 - usedBytes; // part of next page(s)
-                bytesToRead = usedBytes;
-                for (int i = 0; i < unusedBytes; i++)
+                usedBytes += decoder.Decode(&chunk[usedBytes], bytesRead - usedBytes);
+                if (decoder.IsFull())
                 {
-                    buffer1[i] = buffer1[i + usedBytes];
+                    decoder.Flush();
+                    pageIndex++;
+                    if (pageIndex < 3)
+                    {
+                        decoder.SetPage(environment.Ram[pages[pageIndex]], staging);
+
+                        // Repetition can continue into the next page
+                        usedBytes += decoder.Decode(&chunk[usedBytes], 0);
+                    }
                 }
-                buffer = &buffer1[unusedBytes];
-            }
-            else
-            {
-                buffer = buffer1;
-                bytesToRead = 0x4000;
-            }
-
-            switch (pageIndex)
-            {
-                case 0:
-                    Environment.Ram[5]->FromBuffer(memory);
-                    break;
-                case 1:
-                    Environment.Ram[2]->FromBuffer(memory);
-                    break;
-                case 2:
-                    Environment.Ram[0]->FromBuffer(memory);
-                    break;
             }
         }
     }
@@ -371,13 +607,13 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
                 pageSize = 0x4000;
             }
 
-            uint8_t* memory;
+            MemoryPage* page;
             switch (pageNumber)
             {
                 case 0:
                 case 2:
                 case 5:
-                    memory = buffer2;
+                    page = environment.Ram[pageNumber];
                     break;
 #ifdef ZX128K
                 case 1:
@@ -385,27 +621,22 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
                 case 4:
                 case 6:
                 case 7:
-                    memory = buffer2;
+                    page = environment.Ram[pageNumber];
                     break;
 #endif
                 default:
-                    memory = nullptr;
+                    page = nullptr;
                     break;
             }
 
-            if (memory != nullptr)
+            if (page != nullptr)
             {
-                // Read page into tempBuffer
-                uint8_t* buffer = buffer1;
-                bytesToRead = pageSize;
-                bytesRead = file->read(buffer, bytesToRead);
-                if (bytesRead != bytesToRead)
+                PageDecoder decoder(isCompressed);
+                decoder.SetPage(page, staging);
+                if (!DecodeFromFile(file, &decoder, chunk, pageSize))
                 {
                     return false;
                 }
-
-                DecompressPage(buffer1, pageSize, isCompressed, 0, memory);
-                Environment.Ram[pageNumber]->FromBuffer(memory);
             }
             else
             {
@@ -439,6 +670,19 @@ bool zx::LoadZ80Snapshot(File* file, uint8_t buffer1[0x4000],
 }
 
 bool zx::LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000])
+{
+    uint8_t* screen = &buffer1[0x2000];
+    uint8_t borderColor;
+    if (!ReadScreenFromZ80Snapshot(file, buffer1, screen, &borderColor))
+    {
+        return false;
+    }
+
+    ShowScreenshot(screen, borderColor);
+    return true;
+}
+
+bool zx::ReadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000], uint8_t screen[0x1B00], uint8_t* borderColor)
 {
 	size_t bytesRead;
 	UINT bytesToRead;
@@ -452,7 +696,7 @@ bool zx::LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000])
 
 	// Note: this requires little-endian processor
 	FileHeader* header = (FileHeader*)buffer1;
-    uint8_t borderColor = (header->Flags1 & 0x0E) >> 1;
+    *borderColor = (header->Flags1 & 0x0E) >> 1;
 
     bool isCompressed;
     if (header->PC != 0)
@@ -460,16 +704,18 @@ bool zx::LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000])
         // version 1
 
         isCompressed = (header->Flags1 & 0x20) != 0;
-        int bytesToRead = 0x1B00;
-        bytesRead = file->read(buffer1, bytesToRead);
-        if (!isCompressed && bytesRead != bytesToRead)
+        PageDecoder decoder(isCompressed);
+        decoder.SetMemory(screen, 0x1B00);
+        while (!decoder.IsFull())
         {
-            return false;
-        }
+            bytesRead = file->read(buffer1, CHUNK_SIZE);
+            if (bytesRead == 0)
+            {
+                return false;
+            }
 
-        uint8_t* buffer2 = &buffer1[0x2000];
-        DecompressPage(buffer1, 0x1B00, isCompressed, 0x1B00, buffer2);
-        ShowScreenshot(buffer2, borderColor);
+            decoder.Decode(buffer1, bytesRead);
+        }
     }
     else
     {
@@ -525,19 +771,14 @@ bool zx::LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000])
             {
                 // This page contains screenshoot
 
-                // Read page into buffer1
-                uint8_t* buffer = buffer1;
-                UINT bytesToRead = pageSize;
-                bytesRead = file->read(buffer, bytesToRead);
-                if (bytesRead != bytesToRead)
+                // Decode only the screen part of the page
+                PageDecoder decoder(isCompressed);
+                decoder.SetMemory(screen, 0x1B00);
+                if (!DecodeFromFile(file, &decoder, buffer1, pageSize))
                 {
                     return false;
                 }
 
-                uint8_t* buffer2 = &buffer1[0x2000];
-                DecompressPage(buffer1, pageSize, isCompressed, 0x1B00, buffer2);
-                ShowScreenshot(buffer2, borderColor);
-
                 return true;
             }
             else
@@ -566,6 +807,9 @@ bool zx::LoadScreenFromZ80Snapshot(File* file, uint8_t buffer1[0x4000])
             }
 
         } while (pageSize > 0);
+
+        // Page 5 is not in the file
+        return false;
     }
 
 	return true;
@@ -587,85 +831,39 @@ bool zx::LoadScreenshot(File* file, uint8_t buffer1[0x4000])
 	return true;
 }
 
-uint16_t DecompressPage(uint8_t *page, uint16_t pageLength, bool isCompressed,
-		uint16_t maxSize, uint8_t* destMemory)
+void ReadState(Machine* machine, FileHeader* header)
 {
-	uint16_t size = 0;
-	uint8_t* memory = destMemory;
-	for (int i = 0; i < pageLength; i++)
-	{
-		if (i < pageLength - 4)
-		{
-			if (page[i] == 0x00 && page[i + 1] == 0xED && page[i + 2] == 0xED
-					&& page[i + 3] == 0x00)
-			{
-				return i + 4;
-			}
-
-			if (isCompressed && page[i] == 0xED && page[i + 1] == 0xED)
-			{
-				i += 2;
-				int repeat = page[i++];
-				uint8_t value = page[i];
-				for (int j = 0; j < repeat; j++)
-				{
-					*memory = value;
-					memory++;
-
-					size++;
-					if (maxSize > 0 && size >= maxSize)
-					{
-						return i + 1;
-					}
-				}
-
-				continue;
-			}
-		}
-
-		*memory = page[i];
-		memory++;
-
-		size++;
-		if (maxSize > 0 && size >= maxSize)
-		{
-			return i + 1;
-		}
-	}
-
-    return pageLength;
-}
+    Z80Environment& environment = machine->Environment;
+    z80Emulator& cpu = machine->Cpu;
 
-void ReadState(FileHeader* header)
-{
 	// If byte 12 is 255, it has to be regarded as being 1
 	if (header->Flags1 == 255)
 	{
 		header->Flags1 = 1;
 	}
 
-	Z80cpu.A = header->A;
-	Z80cpu.F = header->F;
-	Z80cpu.BC = header->BC;
-	Z80cpu.HL = header->HL;
-	Z80cpu.SP = header->SP;
-	Z80cpu.I = header->InterruptRegister;
-	Z80cpu.R = (header->RefreshRegister & 0x7F)
+	cpu.A = header->A;
+	cpu.F = header->F;
+	cpu.BC = header->BC;
+	cpu.HL = header->HL;
+	cpu.SP = header->SP;
+	cpu.I = header->InterruptRegister;
+	cpu.R = (header->RefreshRegister & 0x7F)
 			| ((header->Flags1 & 0x01) << 7);
-	Z80cpu.IM = header->Flags2 & 0x3;
-	Z80cpu.DE = header->DE;
-	Z80cpu.BCx = header->BC_Dash;
-	Z80cpu.DEx = header->DE_Dash;
-	Z80cpu.HLx = header->HL_Dash;
-	Z80cpu.AFx = header->F_Dash | (header->A_Dash << 8);
-	Z80cpu.IY = header->IY;
-	Z80cpu.IX = header->IX;
-	Z80cpu.IFF1 = header->InterruptFlipFlop;
-	Z80cpu.IFF2 = header->IFF2;
-	Z80cpu.PC = header->PC == 0 ? header->PCVersion2 : header->PC;
+	cpu.IM = header->Flags2 & 0x3;
+	cpu.DE = header->DE;
+	cpu.BCx = header->BC_Dash;
+	cpu.DEx = header->DE_Dash;
+	cpu.HLx = header->HL_Dash;
+	cpu.AFx = header->F_Dash | (header->A_Dash << 8);
+	cpu.IY = header->IY;
+	cpu.IX = header->IX;
+	cpu.IFF1 = header->InterruptFlipFlop;
+	cpu.IFF2 = header->IFF2;
+	cpu.PC = header->PC == 0 ? header->PCVersion2 : header->PC;
 
 	uint8_t borderColor = (header->Flags1 & 0x0E) >> 1;
-    Environment.BorderColor = borderColor;
+    environment.BorderColor = borderColor;
 }
 
 void SaveState(FileHeader* header)
@@ -775,79 +973,341 @@ void GetPageInfo(uint8_t* buffer, bool is128Mode, uint8_t pagingState, int8_t* p
     }
 }
 
-uint8_t CountEqualBytes(uint8_t* address, uint8_t* maxAddress)
+// Counts bytes equal to the first one, up to 255, comparing 4 bytes at a time when aligned
+static inline uint8_t CountEqualBytes(uint8_t* address, uint8_t* maxAddress)
 {
-	int result;
 	uint8_t byteValue = *address;
+	uint8_t* limit = address + 255;
+	if (limit > maxAddress)
+	{
+		limit = maxAddress;
+	}
 
-	for (result = 1; result < 255; result++)
+	uint8_t* current = address + 1;
+	while (current < limit && ((uintptr_t)current & 3) != 0)
 	{
-		address++;
-		if (byteValue != *address
-			|| address >= maxAddress)
+		if (*current != byteValue)
 		{
-			break;
+			return current - address;
 		}
+		current++;
+	}
+
+	uint32_t pattern = byteValue * 0x01010101;
+	while (current + 4 <= limit && *(uint32_t*)current == pattern)
+	{
+		current += 4;
 	}
 
-	return (uint8_t)result;
+	while (current < limit && *current == byteValue)
+	{
+		current++;
+	}
+
+	return current - address;
 }
 
-uint16_t CompressPage(uint8_t* page, uint8_t* destMemory)
+// Compressed output is collected into a chunk and written when the chunk is almost full.
+// Without a file, the chunk is the whole output and it fails when the output does not fit.
+// Output that is not smaller than the page stops the encoder with isFull, less than 0x4000
+// bytes have been written then.
+struct PageEncoder
+{
+	zx::File* file;
+	uint8_t* chunk;
+	uint16_t chunkSize;
+	uint16_t capacity;
+	uint16_t size;
+	bool isError;
+	bool isFull;
+
+	inline void Put(uint8_t value)
+	{
+		this->chunk[this->chunkSize++] = value;
+	}
+
+	inline void PutBlock(uint8_t count, uint8_t value)
+	{
+		this->Put(0xED);
+		this->Put(0xED);
+		this->Put(count);
+		this->Put(value);
+	}
+
+	// Makes room for the longest step of the encoder
+	inline bool Reserve()
+	{
+		if (this->size + this->chunkSize >= 0x4000)
+		{
+			this->isFull = true;
+			return false;
+		}
+
+		if (this->chunkSize > this->capacity - 5)
+		{
+			if (this->file == nullptr)
+			{
+				this->isError = true;
+				return false;
+			}
+			this->Flush();
+		}
+		return true;
+	}
+
+	void Flush()
+	{
+		if (this->file == nullptr)
+		{
+			this->size = this->chunkSize;
+			return;
+		}
+
+		if (this->chunkSize > 0)
+		{
+			if (this->file->write(this->chunk, this->chunkSize) != this->chunkSize)
+			{
+				this->isError = true;
+			}
+			this->size += this->chunkSize;
+			this->chunkSize = 0;
+		}
+	}
+};
+
+static bool EncodePage(uint8_t* page, PageEncoder& encoder)
 {
-	uint16_t size = 0;
 	uint8_t* maxAddress = page + 0x4000;
+	uint8_t* memory = page;
 	bool isPrevoiusSingleED = false;
 
-	for (uint8_t* memory = page; memory < maxAddress; memory++)
+	while (memory < maxAddress)
 	{
-		uint8_t byteValue = *memory;
-		uint8_t equalBytes;
+		// Longest step below is 5 bytes
+		if (!encoder.Reserve())
+		{
+			return false;
+		}
 
+		uint8_t byteValue = *memory;
 		if (isPrevoiusSingleED)
 		{
 			// A byte directly following a single 0xED is not taken into a block
-			equalBytes = 1;
-		}
-		else
-		{
-			equalBytes = CountEqualBytes(memory, maxAddress);
+			encoder.Put(byteValue);
+			memory++;
+			isPrevoiusSingleED = false;
+			continue;
 		}
 
-		uint8_t minRepeats;
+		uint8_t equalBytes = CountEqualBytes(memory, maxAddress);
+		memory += equalBytes;
+
 		if (byteValue == 0xED)
 		{
-			minRepeats = 2;
+			if (equalBytes >= 2)
+			{
+				encoder.PutBlock(equalBytes, byteValue);
+			}
+			else
+			{
+				encoder.Put(byteValue);
+			}
+
+			isPrevoiusSingleED = (memory < maxAddress && *memory != 0xED);
 		}
-		else
+		else if (equalBytes >= 5)
 		{
-			minRepeats = 5;
+			encoder.PutBlock(equalBytes, byteValue);
 		}
-
-		if (equalBytes >= minRepeats)
+		else
 		{
-			*destMemory = 0xED;
-			destMemory++;
-			*destMemory = 0xED;
-			destMemory++;
-			*destMemory = equalBytes;
-			destMemory++;
-
-			memory += equalBytes - 1;
-			size += 3;
+			// Short runs are stored as is, without scanning them again
+			for (int i = 0; i < equalBytes; i++)
+			{
+				encoder.Put(byteValue);
+			}
 		}
+	}
 
-		*destMemory = byteValue;
-		destMemory++;
-		size++;
+	// Last step is not written when it makes the output as long as the page
+	if (encoder.size + encoder.chunkSize >= 0x4000)
+	{
+		encoder.isFull = true;
+		return false;
+	}
 
-		isPrevoiusSingleED = (byteValue == 0xED && memory < maxAddress && *(memory + 1) != 0xED);
+	encoder.Flush();
+	return !encoder.isError;
+}
+
+// Size is 0x4000 when the page does not get smaller, the caller writes it as is
+bool CompressPage(uint8_t* page, zx::File* file, uint8_t* chunk, uint16_t* size)
+{
+	PageEncoder encoder = { file, chunk, 0, CHUNK_SIZE, 0, false, false };
+	bool result = EncodePage(page, encoder);
+	if (encoder.isFull)
+	{
+		*size = 0x4000;
+		return true;
 	}
 
-	return size;
+	*size = encoder.size;
+	return result;
+}
+
+bool zx::CompressPageToBuffer(uint8_t page[0x4000], uint8_t* output, uint16_t capacity, uint16_t* size)
+{
+	PageEncoder encoder = { nullptr, output, 0, capacity, 0, false, false };
+	bool result = EncodePage(page, encoder);
+	*size = encoder.size;
+	return result;
+}
+
+void zx::DecompressPageFromBuffer(uint8_t* data, uint16_t size, uint8_t page[0x4000])
+{
+	PageDecoder decoder(true);
+	decoder.SetMemory(page, 0x4000);
+	decoder.Decode(data, size);
+	decoder.Finish();
+}
+
+void zx::SaveZ80State(uint8_t state[Z80_HEADER_SIZE])
+{
+	// Note: this requires little-endian processor
+	SaveState((FileHeader*)state);
+}
+
+void zx::LoadZ80State(uint8_t state[Z80_HEADER_SIZE])
+{
+	FileHeader* header = (FileHeader*)state;
+	if (header->HardwareMode == 0)
+	{
+		Environment.MemoryState.Bits = 0;
+		Environment.MemoryState.RomSelect = 1;
+		Environment.MemoryState.PagingLock = 1;
+	}
+	else
+	{
+		Environment.MemoryState.Bits = header->PagingState;
+	}
+	Environment.SelectScreen();
+
+	ReadState(&Spectrum, header);
 }
 
 void ShowScreenshot(uint8_t* buffer, uint8_t borderColor)
 {
     Environment.Screen->ShowScreenshot(buffer, borderColor);
-}
\ No newline at end of file
+}
+#ifdef PAGE_CODEC_TEST
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define PAGE_CODEC_KINDS 5
+#define PAGE_CODEC_PAGES 40
+
+static uint32_t NextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Same state gives the same bytes, so a decompressed page is checked without a copy of it
+static uint8_t NextTestByte(uint32_t* state, uint32_t seed, int kind, uint8_t previous)
+{
+	uint32_t random = NextRandom(state);
+	switch (kind)
+	{
+	case 0:
+		// Does not compress, mostly as long as the page
+		return random & 0xFF;
+	case 1:
+		// Single 0xED between short runs
+		return (random % 3 == 0) ? 0xED : (random >> 8) & 1;
+	case 2:
+		// Long runs, some of them 0xED
+		return (random % 16 != 0) ? previous : ((random >> 8) & 1) ? 0xED : (random >> 16);
+	case 3:
+		// Runs of 0xED split by zeros
+		return (random % 4 != 0) ? 0xED : 0x00;
+	default:
+		// Random bytes with more runs from page to page, around the page size
+		return (random % 64 < seed % 24) ? previous : random >> 8;
+	}
+}
+
+bool zx::TestPageCodec(uint8_t buffer1[0x4000], uint8_t buffer2[0x4000])
+{
+	int failed = 0;
+	for (int kind = 0; kind < PAGE_CODEC_KINDS; kind++)
+	{
+		int64_t compressTime = 0;
+		int64_t decompressTime = 0;
+		int stored = 0;
+		uint32_t totalSize = 0;
+
+		for (int i = 0; i < PAGE_CODEC_PAGES; i++)
+		{
+			uint32_t seed = kind * PAGE_CODEC_PAGES + i + 1;
+			uint32_t state = seed;
+			uint8_t previous = 0;
+			for (int offset = 0; offset < 0x4000; offset++)
+			{
+				previous = NextTestByte(&state, seed, kind, previous);
+				buffer1[offset] = previous;
+			}
+
+			int64_t startTime = esp_timer_get_time();
+			uint16_t size;
+			bool isCompressed = CompressPageToBuffer(buffer1, buffer2, 0x4000, &size);
+			compressTime += esp_timer_get_time() - startTime;
+
+			if (!isCompressed)
+			{
+				// Stored as is
+				stored++;
+				totalSize += 0x4000;
+				continue;
+			}
+
+			totalSize += size;
+			if (size >= 0x4000)
+			{
+				ESP_LOGE(TAG, "Page codec kind %d page %d compressed to %u bytes", kind, i, size);
+				failed++;
+				continue;
+			}
+
+			memset(buffer1, 0, 0x4000);
+			startTime = esp_timer_get_time();
+			DecompressPageFromBuffer(buffer2, size, buffer1);
+			decompressTime += esp_timer_get_time() - startTime;
+
+			state = seed;
+			previous = 0;
+			for (int offset = 0; offset < 0x4000; offset++)
+			{
+				previous = NextTestByte(&state, seed, kind, previous);
+				if (buffer1[offset] != previous)
+				{
+					ESP_LOGE(TAG, "Page codec kind %d page %d differs at 0x%04X", kind, i, offset);
+					failed++;
+					break;
+				}
+			}
+		}
+
+		int compressed = PAGE_CODEC_PAGES - stored;
+		ESP_LOGI(TAG, "Page codec kind %d: %d compressed, %d stored, %u bytes, compress %d us, decompress %d us per page",
+			kind, compressed, stored, totalSize / PAGE_CODEC_PAGES, (int)(compressTime / PAGE_CODEC_PAGES),
+			compressed > 0 ? (int)(decompressTime / compressed) : 0);
+	}
+
+	ESP_LOGI(TAG, "Page codec test: %d pages failed", failed);
+	return failed == 0;
+}
+#endif